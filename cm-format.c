@@ -0,0 +1,60 @@
+#include <stdio.h>
+
+#include "cm-format.h"
+#include "cm-global.h"
+#include "cm-stats.h"
+#include "cm-util.h"
+#include "cm-xidmap.h"
+
+// XRenderFind(Visual|Standard)Format() search the format list of the
+// display linearly (after querying it once), for every new window picture,
+// shadow and alpha picture. Remember the results instead.
+static XidMap visual_formats;
+static XRenderPictFormat* standard_formats[PictStandardNUM];
+
+
+bool format_init(void) {
+  return xidmap_init(&visual_formats, 16);
+}
+
+
+XRenderPictFormat* format_from_visual(Visual *visual) {
+  XRenderPictFormat *format;
+
+  format = xidmap_get(&visual_formats, XVisualIDFromVisual(visual));
+  if (likely(format)) {
+    STAT_INC(format_lookups_avoided);
+    return format;
+  }
+  STAT_INC(format_lookups);
+  format = XRenderFindVisualFormat(g_dpy, visual);
+  // Visuals without a format are rare, and not cached.
+  if (format) {
+    xidmap_put(&visual_formats, XVisualIDFromVisual(visual), format);
+  }
+  return format;
+}
+
+
+/// pict_standard is one of PictStandardARGB32, PictStandardA8, ...
+XRenderPictFormat* format_standard(int pict_standard) {
+  if (likely(standard_formats[pict_standard] != NULL)) {
+    STAT_INC(format_lookups_avoided);
+    return standard_formats[pict_standard];
+  }
+  STAT_INC(format_lookups);
+  standard_formats[pict_standard] = XRenderFindStandardFormat(g_dpy, pict_standard);
+  return standard_formats[pict_standard];
+}
+
+
+/// Return the standard format of a pixmap depth, or NULL, if there is none.
+XRenderPictFormat* format_from_depth(int depth) {
+  switch(depth){
+    case 1: return format_standard(PictStandardA1);
+    case 8: return format_standard(PictStandardA8);
+    case 24: return format_standard(PictStandardRGB24);
+    case 32: return format_standard(PictStandardARGB32);
+    default: return NULL;
+  }
+}
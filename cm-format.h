@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include <X11/Xlib.h>
+#include <X11/extensions/Xrender.h>
+
+bool format_init(void);
+XRenderPictFormat* format_from_visual(Visual *visual);
+XRenderPictFormat* format_standard(int pict_standard);
+XRenderPictFormat* format_from_depth(int depth);
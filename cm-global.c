@@ -1,5 +1,9 @@
 
+#include <stdio.h>
+
 #include "cm-global.h"
+#include "cm-window.h"
+#include "cm-xcb.h"
 
 
 Atom atom_opacity;
@@ -8,10 +12,84 @@ Atom atom_pixmap;
 Atom atom_wm_state;
 Atom atom_net_frame_extents;
 Atom atom_gtk_frame_extents;
+Atom atom_net_wm_opaque_region;
 Atom atom_net_wm_state;
 Atom atom_net_wm_state_hidden;
 Atom atom_net_wm_state_focused;
 Atom atom_net_active_window;
+Atom atom_net_wm_name;
+Atom atom_net_wm_cm_s;
+
+Atom win_type[NUM_WINTYPES];
+
+Atom atom_root_background[NUM_ROOT_BACKGROUND_PROPS + 1];
 
 Display* g_dpy = NULL;
+xcb_connection_t *g_xcb = NULL;
 int g_screen = 0;
+
+
+static const struct {
+  const char *name;
+  Atom *atom;
+} atom_table[] = {
+  { "_NET_WM_WINDOW_OPACITY", &atom_opacity },
+  { "_NET_WM_WINDOW_TYPE", &atom_win_type },
+  { "PIXMAP", &atom_pixmap },
+  { "WM_STATE", &atom_wm_state },
+  { "_NET_FRAME_EXTENTS", &atom_net_frame_extents },
+  { "_GTK_FRAME_EXTENTS", &atom_gtk_frame_extents },
+  { "_NET_WM_OPAQUE_REGION", &atom_net_wm_opaque_region },
+  { "_NET_WM_STATE", &atom_net_wm_state },
+  { "_NET_WM_STATE_HIDDEN", &atom_net_wm_state_hidden },
+  { "_NET_WM_STATE_FOCUSED", &atom_net_wm_state_focused },
+  { "_NET_ACTIVE_WINDOW", &atom_net_active_window },
+  { "_NET_WM_NAME", &atom_net_wm_name },
+  { "_NET_WM_CM_S", &atom_net_wm_cm_s }, // screen number appended in atoms_init
+  { "_NET_WM_WINDOW_TYPE_DESKTOP", &win_type[WINTYPE_DESKTOP] },
+  { "_NET_WM_WINDOW_TYPE_DOCK", &win_type[WINTYPE_DOCK] },
+  { "_NET_WM_WINDOW_TYPE_TOOLBAR", &win_type[WINTYPE_TOOLBAR] },
+  { "_NET_WM_WINDOW_TYPE_MENU", &win_type[WINTYPE_MENU] },
+  { "_NET_WM_WINDOW_TYPE_UTILITY", &win_type[WINTYPE_UTILITY] },
+  { "_NET_WM_WINDOW_TYPE_SPLASH", &win_type[WINTYPE_SPLASH] },
+  { "_NET_WM_WINDOW_TYPE_DIALOG", &win_type[WINTYPE_DIALOG] },
+  { "_NET_WM_WINDOW_TYPE_NORMAL", &win_type[WINTYPE_NORMAL] },
+  { "_NET_WM_WINDOW_TYPE_DROPDOWN_MENU", &win_type[WINTYPE_DROPDOWN_MENU] },
+  { "_NET_WM_WINDOW_TYPE_POPUP_MENU", &win_type[WINTYPE_POPUP_MENU] },
+  { "_NET_WM_WINDOW_TYPE_TOOLTIP", &win_type[WINTYPE_TOOLTIP] },
+  { "_NET_WM_WINDOW_TYPE_NOTIFICATION", &win_type[WINTYPE_NOTIFY] },
+  { "_NET_WM_WINDOW_TYPE_COMBO", &win_type[WINTYPE_COMBO] },
+  { "_NET_WM_WINDOW_TYPE_DND", &win_type[WINTYPE_DND] },
+  { "_XROOTPMAP_ID", &atom_root_background[0] },
+  { "_XSETROOT_ID", &atom_root_background[1] },
+};
+
+#define NUM_ATOMS (sizeof(atom_table) / sizeof(atom_table[0]))
+
+
+/// Intern all atoms with a single round trip. Must be called after g_dpy and
+/// g_screen are set.
+bool atoms_init(void) {
+  char *names[NUM_ATOMS];
+  Atom atoms[NUM_ATOMS];
+  char net_wm_cm[32];
+  unsigned i;
+
+  for (i = 0; i < NUM_ATOMS; i++) {
+    names[i] = (char*)atom_table[i].name;
+    if (atom_table[i].atom == &atom_net_wm_cm_s) {
+      snprintf(net_wm_cm, sizeof(net_wm_cm), "_NET_WM_CM_S%d", g_screen);
+      names[i] = net_wm_cm;
+    }
+  }
+  if (!XInternAtoms(g_dpy, names, NUM_ATOMS, False, atoms)) {
+    fprintf(stderr, "Failed to intern atoms\n");
+    return false;
+  }
+  for (i = 0; i < NUM_ATOMS; i++) {
+    *atom_table[i].atom = atoms[i];
+  }
+  win_type[WINTYPE_UNKNOWN] = None;
+  atom_root_background[NUM_ROOT_BACKGROUND_PROPS] = None;
+  return true;
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdbool.h>
 #include <X11/Xlib.h>
 
 extern Atom atom_opacity;
@@ -8,11 +9,24 @@ extern Atom atom_pixmap;
 extern Atom atom_wm_state;
 extern Atom atom_net_frame_extents;
 extern Atom atom_gtk_frame_extents;
+extern Atom atom_net_wm_opaque_region;
 extern Atom atom_net_wm_state;
 extern Atom atom_net_wm_state_hidden;
 extern Atom atom_net_wm_state_focused;
 extern Atom atom_net_active_window;
+extern Atom atom_net_wm_name;
+extern Atom atom_net_wm_cm_s; // _NET_WM_CM_S<screen>
+
+// _NET_WM_WINDOW_TYPE_* indexed by wintype, None for WINTYPE_UNKNOWN
+extern Atom win_type[];
+
+// Root window properties, which may hold the background pixmap,
+// None-terminated.
+#define NUM_ROOT_BACKGROUND_PROPS 2
+extern Atom atom_root_background[];
 
 
 extern Display* g_dpy;
 extern int g_screen;
+
+bool atoms_init(void);
@@ -3,78 +3,58 @@
 #include <stdbool.h>
 #include <string.h>
 
+#include <X11/extensions/Xrandr.h>
+
 #include "cm-root.h"
+#include "cm-format.h"
 #include "cm-global.h"
+#include "cm-xcb.h"
 
 Window root;
 Picture root_picture;
 Picture root_buffer;
 int root_width;
 int root_height;
-
-const char *root_background_props[] = {
-  "_XROOTPMAP_ID",
-  "_XSETROOT_ID",
-  0
-};
+CompRegion root_hidden;
+bool has_randr;
+int randr_event;
+static bool has_randr_current; // RandR >= 1.3
 
 
 static inline int
 _get_valid_pixmap_depth(Pixmap pxmap) {
   if (!pxmap) return 0;
 
-  Window rroot = None;
-  int rx = 0, ry = 0;
-  unsigned rwid = 0, rhei = 0, rborder = 0, rdepth = 0;
+  int depth = 0;
+  xcb_get_geometry_reply_t *geom = xgeometry_reply(xcb_get_geometry(g_xcb, pxmap));
   // In some window managers without managed desktops or also in some versions of
   // xfce (4.18), the found pixmap is invalid having a size of zero.
-  bool is_valid =  XGetGeometry(g_dpy, pxmap, &rroot, &rx, &ry,
-        &rwid, &rhei, &rborder, &rdepth) && rwid && rhei;
-  if(is_valid){
-    return rdepth;
+  if (geom && geom->width && geom->height) {
+    depth = geom->depth;
   }
-  return 0;
+  free(geom);
+  return depth;
 }
 
 
-// XRenderFind(Standard)Format() is a roundtrip, so cache the results
-static XRenderPictFormat* renderformats[ 33 ] = {NULL};
-
 static Picture _create_background_pict(Pixmap pix, int depth)
 {
   XRenderPictureAttributes pa;
-  // Stay safe, and do not cache the fallback render format without further research.
-  renderformats[0] = NULL;
-  if (renderformats[depth] == NULL) {
-    switch(depth){
-      case 0:
-          break;
-      case 1:
-          renderformats[1] = XRenderFindStandardFormat(g_dpy, PictStandardA1);
-          break;
-      case 8:
-          renderformats[8] = XRenderFindStandardFormat(g_dpy, PictStandardA8);
-          break;
-      case 24:
-          renderformats[24] = XRenderFindStandardFormat(g_dpy, PictStandardRGB24);
-          break;
-      case 32:
-          renderformats[32] = XRenderFindStandardFormat(g_dpy, PictStandardARGB32);
-          break;
-      default: {
-          fprintf(stderr, "Unhandled root background depth %d - please report!\n", depth);
-          break;
-      }
-    }
-    if (renderformats[depth] == NULL) {
-      // Use renderformats[0] for all fallback-depths
-      depth = 0;
-      renderformats[0] = XRenderFindVisualFormat(g_dpy, DefaultVisual(g_dpy, g_screen));
+  XRenderPictFormat *format = NULL;
+
+  if (depth) {
+    format = format_from_depth(depth);
+    if (format == NULL) {
+      fprintf(stderr, "Unhandled root background depth %d - please report!\n", depth);
     }
   }
+  if (format == NULL) {
+    // Fallback for all other depths
+    format = format_from_visual(DefaultVisual(g_dpy, g_screen));
+  }
 
   pa.repeat = True;
-  return XRenderCreatePicture(g_dpy, pix, renderformats[depth], CPRepeat, &pa);
+  return XRenderCreatePicture(g_dpy, pix, format, CPRepeat, &pa);
 }
 
 bool root_init(){
@@ -84,11 +64,60 @@ bool root_init(){
 
   pa.subwindow_mode = IncludeInferiors;
   root_picture = XRenderCreatePicture(g_dpy, root,
-    XRenderFindVisualFormat(g_dpy, DefaultVisual(g_dpy, g_screen)),
+    format_from_visual(DefaultVisual(g_dpy, g_screen)),
     CPSubwindowMode, &pa);
+
+  int randr_error, major, minor;
+  if (XRRQueryExtension(g_dpy, &randr_event, &randr_error) &&
+      XRRQueryVersion(g_dpy, &major, &minor) &&
+      (major > 1 || minor >= 2)) {
+    has_randr = true;
+    has_randr_current = major > 1 || minor >= 3;
+    XRRSelectInput(g_dpy, root,
+                   RRScreenChangeNotifyMask | RRCrtcChangeNotifyMask);
+  }
+  root_outputs_update();
   return true;
 }
 
+/// Recompute root_hidden from the geometry of the active CRTCs. If it is
+/// unknown, e.g. without RandR 1.2, the whole root counts as visible.
+void root_outputs_update() {
+  XRRScreenResources *res;
+  CompRegion shown;
+  CompRect r = { .x1 = 0, .y1 = 0, .x2 = root_width, .y2 = root_height };
+
+  region_clear(&root_hidden);
+  if (!has_randr) return;
+
+  // Unlike XRRGetScreenResources, the Current variant does not make the
+  // server probe the outputs, which can take long.
+  res = has_randr_current ? XRRGetScreenResourcesCurrent(g_dpy, root)
+                          : XRRGetScreenResources(g_dpy, root);
+  if (!res) return;
+
+  region_init(&shown);
+  for (int i = 0; i < res->ncrtc; i++) {
+    XRRCrtcInfo *crtc = XRRGetCrtcInfo(g_dpy, res, res->crtcs[i]);
+    if (!crtc) continue;
+    if (crtc->mode != None && crtc->width && crtc->height) {
+      CompRect c = { .x1 = crtc->x, .y1 = crtc->y,
+                     .x2 = crtc->x + (int)crtc->width,
+                     .y2 = crtc->y + (int)crtc->height };
+      region_union_rect(&shown, &c);
+    }
+    XRRFreeCrtcInfo(crtc);
+  }
+  XRRFreeScreenResources(res);
+
+  // No active output at all, e.g. a virtual server: show everything
+  if (!region_is_empty(&shown)) {
+    region_set_rect(&root_hidden, &r);
+    region_subtract(&root_hidden, &root_hidden, &shown);
+  }
+  region_fini(&shown);
+}
+
 /// Create the root background picture. First check, if the root window already
 /// has a valid corresponding pixmap. If so, do not overwrite it, such that e.g.
 /// openbox's root background image is preserved. Create the picture using the
@@ -98,38 +127,37 @@ bool root_init(){
 /// and set a fixed solid background color.
 Picture root_create_tile() {
   Picture picture;
-  Atom actual_type;
+  xcb_get_property_cookie_t cookies[NUM_ROOT_BACKGROUND_PROPS];
+  xcb_get_property_reply_t *r;
   Pixmap pixmap;
-  int actual_format;
-  unsigned long nitems;
-  unsigned long bytes_after;
-  unsigned char *prop;
   unsigned pict_depth = 0;
   bool fill;
-  int p;
-  int res;
+  int p, n;
   const char* valid_pix_str;
 
   pixmap = None;
 
-  for (p=0; root_background_props[p]; p++) {
-    prop = NULL;
-    res = XGetWindowProperty(g_dpy, root,
-          XInternAtom(g_dpy, root_background_props[p], False),
-          0, 4, False, AnyPropertyType, &actual_type,
-          &actual_format, &nitems, &bytes_after, &prop);
-    if (res != Success || prop == NULL ){
+  // Ask for all candidates at once, the first one with a valid pixmap wins.
+  for (n=0; atom_root_background[n]; n++) {
+    cookies[n] = xprop_request(root, atom_root_background[n],
+                               XCB_GET_PROPERTY_TYPE_ANY, 4);
+  }
+  for (p=0; p < n; p++) {
+    if (pixmap != None) {
+      xcb_forget(cookies[p]);
+      continue;
+    }
+    r = xprop_reply(cookies[p]);
+    if (r == NULL){
       continue;
     }
-    if(actual_type == atom_pixmap
-          && actual_format == 32 && nitems == 1) {
-      memcpy(&pixmap, prop, 4);
+    if(r->type == atom_pixmap
+          && r->format == 32 && r->value_len == 1) {
+      pixmap = *(uint32_t *)xcb_get_property_value(r);
     }
-    XFree(prop);
+    free(r);
     pict_depth = _get_valid_pixmap_depth(pixmap);
-    if(pict_depth){
-      break;
-    } else {
+    if(!pict_depth){
       pixmap = None;
     }
   }
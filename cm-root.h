@@ -5,13 +5,19 @@
 #include <X11/Xlib.h>
 #include <X11/extensions/Xrender.h>
 
+#include "comp_rect.h"
+
 extern Window root;
 extern Picture root_picture;
 extern Picture root_buffer;
 extern int root_width;
 extern int root_height;
-extern const char *root_background_props[];
+// The parts of the root, which no active output (RandR CRTC) shows.
+extern CompRegion root_hidden;
+extern bool has_randr;
+extern int randr_event;
 
 
 bool root_init();
 Picture root_create_tile();
+void root_outputs_update();
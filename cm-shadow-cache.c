@@ -0,0 +1,232 @@
+#include <stdlib.h>
+
+#include "cm-shadow-cache.h"
+#include "cm-stats.h"
+
+
+void
+shadow_cache_init(ShadowCache *c, unsigned long max_bytes,
+                  void (*free_picture)(Picture picture)) {
+  *c = (ShadowCache) {
+    .max_bytes = max_bytes,
+    .free_picture = free_picture,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+  };
+}
+
+static unsigned
+shadow_cache_bucket(double opacity, int type, int width, int height) {
+  unsigned h = (unsigned)width * 73856093u ^ (unsigned)height * 19349663u ^
+               (unsigned)type * 83492791u ^ (unsigned)(opacity * 1000000);
+  return h % SHADOW_CACHE_BUCKETS;
+}
+
+static void
+shadow_lru_unlink(ShadowCache *c, ShadowEntry *e) {
+  if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+  else c->lru_first = e->lru_next;
+  if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+  else c->lru_last = e->lru_prev;
+  e->lru_prev = e->lru_next = NULL;
+}
+
+/// Remove e from its hash bucket, if it is still found there.
+static void
+shadow_cache_unlink(ShadowCache *c, ShadowEntry *e) {
+  ShadowEntry **pp = &c->buckets[
+    shadow_cache_bucket(e->opacity, e->type, e->width, e->height)];
+
+  while (*pp && *pp != e) pp = &(*pp)->next;
+  if (*pp) {
+    *pp = e->next;
+    c->bytes -= (unsigned long)e->swidth * e->sheight;
+  }
+}
+
+/// Free the least recently used, unused shadows until the cache fits.
+static void
+shadow_cache_evict(ShadowCache *c) {
+  while (c->bytes > c->max_bytes && c->lru_last) {
+    ShadowEntry *e = c->lru_last;
+
+    shadow_lru_unlink(c, e);
+    shadow_cache_unlink(c, e);
+    c->free_picture(e->picture);
+    free(e);
+    STAT_INC(shadow_cache_evictions);
+  }
+  STAT_SET(shadow_cache_bytes, c->bytes);
+}
+
+static void
+shadow_lru_push(ShadowCache *c, ShadowEntry *e) {
+  e->lru_next = c->lru_first;
+  if (c->lru_first) c->lru_first->lru_prev = e;
+  else c->lru_last = e;
+  c->lru_first = e;
+  shadow_cache_evict(c);
+}
+
+ShadowEntry *
+shadow_cache_find(ShadowCache *c, double opacity, int type,
+                  int width, int height) {
+  unsigned b = shadow_cache_bucket(opacity, type, width, height);
+  ShadowEntry *e;
+
+  for (e = c->buckets[b]; e; e = e->next) {
+    if (e->width == width && e->height == height && e->type == type &&
+        e->opacity == opacity) {
+      if (e->refs++ == 0 && e->picture) shadow_lru_unlink(c, e);
+      STAT_INC(shadow_cache_hits);
+      return e;
+    }
+  }
+  STAT_INC(shadow_cache_misses);
+  return NULL;
+}
+
+static void
+shadow_cache_submit(ShadowCache *c, ShadowEntry *e) {
+  pthread_mutex_lock(&c->lock);
+  e->state = SHADOW_QUEUED;
+  e->job_next = c->queue;
+  c->queue = e;
+  pthread_cond_signal(&c->cond);
+  pthread_mutex_unlock(&c->lock);
+  STAT_INC(shadow_async_rasters);
+}
+
+ShadowEntry *
+shadow_cache_add(ShadowCache *c, double opacity, int type,
+                 int width, int height, int swidth, int sheight,
+                 Picture picture) {
+  unsigned b = shadow_cache_bucket(opacity, type, width, height);
+  ShadowEntry *e;
+
+  e = calloc(1, sizeof(ShadowEntry));
+  if (!e) return NULL;
+  e->opacity = opacity;
+  e->type = type;
+  e->width = width;
+  e->height = height;
+  e->swidth = swidth;
+  e->sheight = sheight;
+  e->picture = picture;
+  e->refs = 1;
+  e->next = c->buckets[b];
+  c->buckets[b] = e;
+  c->bytes += (unsigned long)swidth * sheight;
+  if (!picture) {
+    shadow_cache_submit(c, e);
+  }
+  shadow_cache_evict(c);
+  return e;
+}
+
+/// Take e out of the queue, if the worker did not start it yet. Returns
+/// false, if the worker still owns e, so shadow_cache_ready frees it.
+static bool
+shadow_cache_cancel(ShadowCache *c, ShadowEntry *e) {
+  bool owned = false;
+
+  pthread_mutex_lock(&c->lock);
+  if (e->state == SHADOW_QUEUED) {
+    ShadowEntry **pp = &c->queue;
+    while (*pp != e) pp = &(*pp)->job_next;
+    *pp = e->job_next;
+    e->state = SHADOW_READY;
+  } else {
+    owned = e->state != SHADOW_READY;
+  }
+  pthread_mutex_unlock(&c->lock);
+  return !owned;
+}
+
+void
+shadow_cache_put(ShadowCache *c, ShadowEntry *e) {
+  if (--e->refs > 0) return;
+  if (e->picture) {
+    shadow_lru_push(c, e);
+  } else if (shadow_cache_cancel(c, e)) {
+    // Never started or failed, nothing to keep
+    shadow_cache_unlink(c, e);
+    free(e);
+  }
+}
+
+ShadowEntry *
+shadow_cache_take_job(ShadowCache *c) {
+  ShadowEntry *e;
+
+  pthread_mutex_lock(&c->lock);
+  while (!c->queue) {
+    pthread_cond_wait(&c->cond, &c->lock);
+  }
+  e = c->queue;
+  c->queue = e->job_next;
+  e->state = SHADOW_RUNNING;
+  // Only NULL, if the last result is not ready yet
+  e->data = c->buf;
+  e->data_size = c->buf_size;
+  c->buf = NULL;
+  c->buf_size = 0;
+  pthread_mutex_unlock(&c->lock);
+  return e;
+}
+
+bool
+shadow_cache_finish_job(ShadowCache *c, ShadowEntry *e) {
+  bool first;
+
+  pthread_mutex_lock(&c->lock);
+  e->state = SHADOW_DONE;
+  e->job_next = c->done;
+  c->done = e;
+  first = !e->job_next;
+  pthread_mutex_unlock(&c->lock);
+  return first;
+}
+
+ShadowEntry *
+shadow_cache_take_done(ShadowCache *c) {
+  ShadowEntry *e;
+
+  pthread_mutex_lock(&c->lock);
+  e = c->done;
+  c->done = NULL;
+  pthread_mutex_unlock(&c->lock);
+  return e;
+}
+
+/// Give the raster memory of e back to the worker. Of two buffers, it keeps
+/// the larger one.
+static void
+shadow_cache_recycle(ShadowCache *c, ShadowEntry *e) {
+  pthread_mutex_lock(&c->lock);
+  if (c->buf_size < e->data_size) {
+    unsigned char *smaller = c->buf;
+    c->buf = e->data;
+    c->buf_size = e->data_size;
+    e->data = smaller;
+  }
+  pthread_mutex_unlock(&c->lock);
+  free(e->data);
+  e->data = NULL;
+  e->data_size = 0;
+}
+
+void
+shadow_cache_ready(ShadowCache *c, ShadowEntry *e) {
+  // The worker is done with e
+  e->state = SHADOW_READY;
+  if (e->data) shadow_cache_recycle(c, e);
+
+  if (!e->picture) {
+    // Windows drop their reference with the next resize
+    shadow_cache_unlink(c, e);
+    if (e->refs == 0) free(e);
+  } else if (e->refs == 0) {
+    shadow_lru_push(c, e);
+  }
+}
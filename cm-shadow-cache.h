@@ -0,0 +1,83 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <X11/X.h>
+#include <X11/extensions/render.h>
+
+struct _win;
+
+/// Rasterized shadows, shared by all windows with the same size, opacity and
+/// shadow type, e.g. tiled terminals and repeated popups. Unused ones stay
+/// cached in LRU order, so resizing back and forth and fading popups find
+/// them again, until they exceed the max_bytes of the cache.
+typedef struct _shadow_entry {
+  struct _shadow_entry *next; // in its hash bucket
+  // Unused, most recently first. Only entries with refs == 0 and a picture
+  // are in the LRU list: the worker may still own unused ones without.
+  struct _shadow_entry *lru_prev, *lru_next;
+  double opacity;
+  int width, height;
+  int type; // shadowtype
+  Picture picture; // None, until the worker is done with it
+  struct _win *waiters; // windows to swap in picture, once it is uploaded
+  int swidth, sheight;
+  unsigned refs;
+  // Guarded by ShadowCache.lock
+  enum { SHADOW_READY, SHADOW_QUEUED, SHADOW_RUNNING, SHADOW_DONE } state;
+  struct _shadow_entry *job_next; // in the queue or done list
+  unsigned char *data; // rasterized, but not uploaded yet
+  size_t data_size;
+} ShadowEntry;
+
+#define SHADOW_CACHE_BUCKETS 256
+
+typedef struct {
+  ShadowEntry *buckets[SHADOW_CACHE_BUCKETS];
+  ShadowEntry *lru_first, *lru_last;
+  unsigned long bytes;     // of all entries in the buckets, one per pixel
+  unsigned long max_bytes; // of which unused ones are kept
+  void (*free_picture)(Picture picture);
+
+  // Shadows left to a worker thread. Queued entries are taken newest first,
+  // so during a resize the latest size wins.
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  ShadowEntry *queue;
+  ShadowEntry *done;
+  // Grow-only raster memory. The worker gets it with its job, and
+  // shadow_cache_ready gives it back.
+  unsigned char *buf;
+  size_t buf_size;
+} ShadowCache;
+
+void shadow_cache_init(ShadowCache *c, unsigned long max_bytes,
+                       void (*free_picture)(Picture picture));
+/// Returns a referenced cached shadow, or NULL, if there is none yet.
+ShadowEntry *shadow_cache_find(ShadowCache *c, double opacity, int type,
+                               int width, int height);
+/// Cache the swidth x sheight shadow of a width x height window and return
+/// it referenced, or NULL, if out of memory. Without a picture, it is queued
+/// for the worker.
+ShadowEntry *shadow_cache_add(ShadowCache *c, double opacity, int type,
+                              int width, int height, int swidth, int sheight,
+                              Picture picture);
+/// Drop a reference of a shadow returned by shadow_cache_find or _add.
+void shadow_cache_put(ShadowCache *c, ShadowEntry *e);
+
+// The worker thread takes the queued shadows one after the other and hands
+// them back rasterized to data, after which the main thread takes and uploads
+// them and marks them ready.
+
+/// Wait for the next queued shadow. The worker owns it until
+/// shadow_cache_finish_job.
+ShadowEntry *shadow_cache_take_job(ShadowCache *c);
+/// Returns true, if e is the first one done since the last
+/// shadow_cache_take_done, so the main thread needs to be woken up.
+bool shadow_cache_finish_job(ShadowCache *c, ShadowEntry *e);
+/// Returns the shadows done by the worker, linked by job_next.
+ShadowEntry *shadow_cache_take_done(ShadowCache *c);
+/// e is uploaded to its picture, or failed without one.
+void shadow_cache_ready(ShadowCache *c, ShadowEntry *e);
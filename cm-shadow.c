@@ -0,0 +1,672 @@
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2_TARGET 1
+#endif
+
+#include "cm-shadow.h"
+#include "cm-util.h"
+
+
+conv *gaussian_map;
+
+int Gsize = -1;
+unsigned char *shadow_corner = NULL;
+unsigned char *shadow_top = NULL;
+
+
+static double
+gaussian(double r, double x, double y) {
+  return ((1 / (sqrt(2 * M_PI * r))) *
+      exp((- (x * x + y * y)) / (2 * r * r)));
+}
+
+
+conv *
+make_gaussian_map(double r) {
+  conv *c;
+  int size = ((int) ceil((r * 3)) + 1) & ~1;
+  int center = size / 2;
+  int stride = size + 1;
+  int x, y;
+  double t;
+  double *g;
+
+  c = malloc(sizeof(conv) + stride * stride * sizeof(uint32_t));
+  g = malloc(size * sizeof(double));
+  c->size = size;
+  c->sat = (uint32_t *) (c + 1);
+
+  // The gaussian is separable, so the normalized kernel is the product of a
+  // normalized row and column.
+  t = 0.0;
+  for (x = 0; x < size; x++) {
+    g[x] = gaussian(r, (double) (x - center), 0);
+    t += g[x];
+  }
+  for (x = 0; x < size; x++) {
+    g[x] /= t;
+  }
+
+  memset(c->sat, 0, stride * sizeof(uint32_t));
+  for (y = 0; y < size; y++) {
+    uint32_t row = 0;
+    c->sat[(y + 1) * stride] = 0;
+    for (x = 0; x < size; x++) {
+      row += (uint32_t) lround(g[y] * g[x] * SAT_ONE);
+      c->sat[(y + 1) * stride + x + 1] = c->sat[y * stride + x + 1] + row;
+    }
+  }
+  free(g);
+
+  return c;
+}
+
+/// Opacity as factor of shadow_scale
+static inline unsigned
+shadow_opacity_scale(double opacity) {
+  return (unsigned) lround(opacity * 0xffff);
+}
+
+/// Alpha of a kernel sum v in units of 1 / SAT_ONE. v is capped at 1.0, so
+/// rounding errors of the table do not overflow. The SIMD row kernels
+/// compute exactly the same.
+static inline unsigned char
+shadow_scale(uint32_t v, unsigned op) {
+  v >>= 14;
+  if (v > 0xffff) v = 0xffff;
+  return (unsigned char) ((v * op) >> 24);
+}
+
+/*
+ * A picture will help
+ *
+ *      -center   0                width  width+center
+ *  -center +-----+-------------------+-----+
+ *          |     |                   |     |
+ *          |     |                   |     |
+ *        0 +-----+-------------------+-----+
+ *          |     |                   |     |
+ *          |     |                   |     |
+ *          |     |                   |     |
+ *   height +-----+-------------------+-----+
+ *          |     |                   |     |
+ * height+  |     |                   |     |
+ *  center  +-----+-------------------+-----+
+ */
+
+unsigned char
+sum_gaussian(conv *map, double opacity,
+             int x, int y, int width, int height) {
+  const uint32_t *sat = map->sat;
+  int g_size = map->size;
+  int stride = g_size + 1;
+  int center = g_size / 2;
+  int fx_start, fx_end;
+  int fy_start, fy_end;
+  uint32_t v;
+
+  /*
+   * Compute set of filter values which are "in range",
+   * that's the set with:
+   *    0 <= x + (fx-center) && x + (fx-center) < width &&
+   *  0 <= y + (fy-center) && y + (fy-center) < height
+   *
+   *  0 <= x + (fx - center)    x + fx - center < width
+   *  center - x <= fx    fx < width + center - x
+   */
+
+  fx_start = center - x;
+  if (fx_start < 0) fx_start = 0;
+  fx_end = width + center - x;
+  if (fx_end > g_size) fx_end = g_size;
+
+  fy_start = center - y;
+  if (fy_start < 0) fy_start = 0;
+  fy_end = height + center - y;
+  if (fy_end > g_size) fy_end = g_size;
+
+  if (fx_start >= fx_end || fy_start >= fy_end) return 0;
+
+  // Wraps around in between, but not in the result
+  v = sat[fy_end * stride + fx_end] - sat[fy_start * stride + fx_end]
+      - sat[fy_end * stride + fx_start] + sat[fy_start * stride + fx_start];
+
+  return shadow_scale(v, shadow_opacity_scale(opacity));
+}
+
+/* precompute shadow corners and sides
+   to save time for large windows */
+void
+presum_gaussian(conv *map) {
+  int center = map->size/2;
+  int opacity, x, y;
+
+  Gsize = map->size;
+
+  if (shadow_corner) free((void *)shadow_corner);
+  if (shadow_top) free((void *)shadow_top);
+
+  shadow_corner = (unsigned char *)(malloc((Gsize + 1) * (Gsize + 1) * 26));
+  shadow_top = (unsigned char *)(malloc((Gsize + 1) * 26));
+
+  for (x = 0; x <= Gsize; x++) {
+    shadow_top[25 * (Gsize + 1) + x] =
+      sum_gaussian(map, 1, x - center, center, Gsize * 2, Gsize * 2);
+
+    for (opacity = 0; opacity < 25; opacity++) {
+      shadow_top[opacity * (Gsize + 1) + x] =
+        shadow_top[25 * (Gsize + 1) + x] * opacity / 25;
+    }
+
+    for (y = 0; y <= x; y++) {
+      shadow_corner[25 * (Gsize + 1) * (Gsize + 1) + y * (Gsize + 1) + x]
+        = sum_gaussian(map, 1, x - center, y - center, Gsize * 2, Gsize * 2);
+      shadow_corner[25 * (Gsize + 1) * (Gsize + 1) + x * (Gsize + 1) + y]
+        = shadow_corner[25 * (Gsize + 1) * (Gsize + 1) + y * (Gsize + 1) + x];
+
+      for (opacity = 0; opacity < 25; opacity++) {
+        shadow_corner[opacity * (Gsize + 1) * (Gsize + 1)
+                      + y * (Gsize + 1) + x]
+          = shadow_corner[opacity * (Gsize + 1) * (Gsize + 1)
+                          + x * (Gsize + 1) + y]
+          = shadow_corner[25 * (Gsize + 1) * (Gsize + 1)
+                          + y * (Gsize + 1) + x] * opacity / 25;
+      }
+    }
+  }
+}
+
+
+/*
+ * Row kernels. shadow_sat_row computes out[j] for 0 <= j <= size as the sum
+ * of the kernel between the SAT rows top and bottom, in the columns j to
+ * j + width, clipped to size. With D[k] = bottom[k] - top[k], that is
+ * D[min(j + width, size)] - D[j], so all loads are sequential: below split,
+ * the minuend is D[j + width], from split on it is D[size].
+ */
+
+static inline uint32_t
+sat_row_sum(const uint32_t *top, const uint32_t *bottom,
+            int j, int width, int split, uint32_t last) {
+  uint32_t hi = j < split ? bottom[j + width] - top[j + width] : last;
+  return hi - (bottom[j] - top[j]);
+}
+
+static void
+sat_row_scalar(unsigned char *out, const uint32_t *top,
+               const uint32_t *bottom, int size, int width, unsigned op) {
+  uint32_t last = bottom[size] - top[size];
+  int split = size - width + 1;
+  int j;
+
+  for (j = 0; j <= size; j++) {
+    out[j] = shadow_scale(sat_row_sum(top, bottom, j, width, split, last), op);
+  }
+}
+
+static void
+reverse_bytes_scalar(unsigned char *restrict dst, const unsigned char *src,
+                     int n, int i) {
+  for (; i < n; i++) {
+    dst[i] = src[n - 1 - i];
+  }
+}
+
+#ifdef __SSE2__
+/// shadow_scale of 2 x 4 sums, packed into the low 8 bytes
+static inline __m128i
+sse2_scale8(__m128i v0, __m128i v1, __m128i opv) {
+  const __m128i cap = _mm_set1_epi32(0xffff);
+  const __m128i bias32 = _mm_set1_epi32(0x8000);
+  const __m128i bias16 = _mm_set1_epi16((short) 0x8000);
+  __m128i m0, m1, v;
+
+  // The sums fit into 31 bits, so the signed compare is fine.
+  v0 = _mm_srli_epi32(v0, 14);
+  v1 = _mm_srli_epi32(v1, 14);
+  m0 = _mm_cmpgt_epi32(v0, cap);
+  m1 = _mm_cmpgt_epi32(v1, cap);
+  v0 = _mm_or_si128(_mm_andnot_si128(m0, v0), _mm_and_si128(m0, cap));
+  v1 = _mm_or_si128(_mm_andnot_si128(m1, v1), _mm_and_si128(m1, cap));
+  // SSE2 only packs with signed saturation, so pack biased values
+  v = _mm_packs_epi32(_mm_sub_epi32(v0, bias32), _mm_sub_epi32(v1, bias32));
+  v = _mm_xor_si128(v, bias16);
+  v = _mm_srli_epi16(_mm_mulhi_epu16(v, opv), 8);
+  return _mm_packus_epi16(v, v);
+}
+
+static void
+sat_row_sse2(unsigned char *out, const uint32_t *top,
+             const uint32_t *bottom, int size, int width, unsigned op) {
+  const __m128i opv = _mm_set1_epi16((short) op);
+  uint32_t last = bottom[size] - top[size];
+  __m128i lastv = _mm_set1_epi32((int) last);
+  int split = size - width + 1;
+  int j;
+
+  for (j = 0; j + 8 <= size + 1; j += 8) {
+    __m128i hi0, hi1, lo0, lo1;
+
+    if (j + 8 <= split) {
+      hi0 = _mm_sub_epi32(
+        _mm_loadu_si128((const __m128i *) &bottom[j + width]),
+        _mm_loadu_si128((const __m128i *) &top[j + width]));
+      hi1 = _mm_sub_epi32(
+        _mm_loadu_si128((const __m128i *) &bottom[j + width + 4]),
+        _mm_loadu_si128((const __m128i *) &top[j + width + 4]));
+    } else if (j >= split) {
+      hi0 = hi1 = lastv;
+    } else {
+      // straddles split
+      for (int k = j; k < j + 8; k++) {
+        out[k] = shadow_scale(sat_row_sum(top, bottom, k, width, split, last),
+                              op);
+      }
+      continue;
+    }
+    lo0 = _mm_sub_epi32(_mm_loadu_si128((const __m128i *) &bottom[j]),
+                        _mm_loadu_si128((const __m128i *) &top[j]));
+    lo1 = _mm_sub_epi32(_mm_loadu_si128((const __m128i *) &bottom[j + 4]),
+                        _mm_loadu_si128((const __m128i *) &top[j + 4]));
+    _mm_storel_epi64((__m128i *) &out[j],
+                     sse2_scale8(_mm_sub_epi32(hi0, lo0),
+                                 _mm_sub_epi32(hi1, lo1), opv));
+  }
+  for (; j <= size; j++) {
+    out[j] = shadow_scale(sat_row_sum(top, bottom, j, width, split, last), op);
+  }
+}
+
+static inline __m128i
+sse2_reverse16(__m128i v) {
+  v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+  v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+  v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+  return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+static void
+reverse_bytes_sse2(unsigned char *restrict dst, const unsigned char *src,
+                   int n, int i) {
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) &src[n - 16 - i]);
+    _mm_storeu_si128((__m128i *) &dst[i], sse2_reverse16(v));
+  }
+  reverse_bytes_scalar(dst, src, n, i);
+}
+#endif
+
+#ifdef HAVE_AVX2_TARGET
+__attribute__((target("avx2"))) static void
+sat_row_avx2(unsigned char *out, const uint32_t *top,
+             const uint32_t *bottom, int size, int width, unsigned op) {
+  const __m256i cap = _mm256_set1_epi32(0xffff);
+  const __m256i opv = _mm256_set1_epi16((short) op);
+  uint32_t last = bottom[size] - top[size];
+  __m256i lastv = _mm256_set1_epi32((int) last);
+  int split = size - width + 1;
+  int j;
+
+  for (j = 0; j + 16 <= size + 1; j += 16) {
+    __m256i hi0, hi1, lo0, lo1, v0, v1, v;
+
+    if (j + 16 <= split) {
+      hi0 = _mm256_sub_epi32(
+        _mm256_loadu_si256((const __m256i *) &bottom[j + width]),
+        _mm256_loadu_si256((const __m256i *) &top[j + width]));
+      hi1 = _mm256_sub_epi32(
+        _mm256_loadu_si256((const __m256i *) &bottom[j + width + 8]),
+        _mm256_loadu_si256((const __m256i *) &top[j + width + 8]));
+    } else if (j >= split) {
+      hi0 = hi1 = lastv;
+    } else {
+      // straddles split
+      for (int k = j; k < j + 16; k++) {
+        out[k] = shadow_scale(sat_row_sum(top, bottom, k, width, split, last),
+                              op);
+      }
+      continue;
+    }
+    lo0 = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i *) &bottom[j]),
+                           _mm256_loadu_si256((const __m256i *) &top[j]));
+    lo1 = _mm256_sub_epi32(
+      _mm256_loadu_si256((const __m256i *) &bottom[j + 8]),
+      _mm256_loadu_si256((const __m256i *) &top[j + 8]));
+    v0 = _mm256_min_epu32(_mm256_srli_epi32(_mm256_sub_epi32(hi0, lo0), 14),
+                          cap);
+    v1 = _mm256_min_epu32(_mm256_srli_epi32(_mm256_sub_epi32(hi1, lo1), 14),
+                          cap);
+    // packus works per 128 bit lane, so restore the order of the quadwords
+    v = _mm256_permute4x64_epi64(_mm256_packus_epi32(v0, v1),
+                                 _MM_SHUFFLE(3, 1, 2, 0));
+    v = _mm256_srli_epi16(_mm256_mulhi_epu16(v, opv), 8);
+    _mm_storeu_si128((__m128i *) &out[j],
+                     _mm_packus_epi16(_mm256_castsi256_si128(v),
+                                      _mm256_extracti128_si256(v, 1)));
+  }
+  for (; j <= size; j++) {
+    out[j] = shadow_scale(sat_row_sum(top, bottom, j, width, split, last), op);
+  }
+}
+
+__attribute__((target("avx2"))) static void
+reverse_bytes_avx2(unsigned char *restrict dst, const unsigned char *src,
+                   int n, int i) {
+  const __m256i mask = _mm256_setr_epi8(
+    15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+    15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) &src[n - 32 - i]);
+    // reverse both lanes, then swap them
+    v = _mm256_shuffle_epi8(v, mask);
+    _mm256_storeu_si256((__m256i *) &dst[i],
+                        _mm256_permute2x128_si256(v, v, 1));
+  }
+  reverse_bytes_scalar(dst, src, n, i);
+}
+#endif
+
+static void (*reverse_bytes_impl)(unsigned char *restrict dst,
+                                  const unsigned char *src, int n, int i)
+  = reverse_bytes_scalar;
+static void (*sat_row_impl)(unsigned char *out, const uint32_t *top,
+                            const uint32_t *bottom, int size, int width,
+                            unsigned op) = sat_row_scalar;
+
+shadow_simd
+shadow_simd_select(shadow_simd max) {
+  shadow_simd simd = SHADOW_SIMD_NONE;
+
+#ifdef __SSE2__
+  if (max >= SHADOW_SIMD_SSE2) simd = SHADOW_SIMD_SSE2;
+#endif
+#ifdef HAVE_AVX2_TARGET
+  __builtin_cpu_init();
+  if (max >= SHADOW_SIMD_AVX2 && __builtin_cpu_supports("avx2")) {
+    simd = SHADOW_SIMD_AVX2;
+  }
+#endif
+
+  switch (simd) {
+  case SHADOW_SIMD_NONE:
+    reverse_bytes_impl = reverse_bytes_scalar;
+    sat_row_impl = sat_row_scalar;
+    break;
+#ifdef __SSE2__
+  case SHADOW_SIMD_SSE2:
+    reverse_bytes_impl = reverse_bytes_sse2;
+    sat_row_impl = sat_row_sse2;
+    break;
+#endif
+#ifdef HAVE_AVX2_TARGET
+  case SHADOW_SIMD_AVX2:
+    reverse_bytes_impl = reverse_bytes_avx2;
+    sat_row_impl = sat_row_avx2;
+    break;
+#endif
+  default:
+    assert(false);
+  }
+  return simd;
+}
+
+/// dst[i] = src[n - 1 - i]. dst may start at the last byte of src, as for
+/// the middle pixel of an odd sized shadow.
+void
+reverse_bytes(unsigned char *restrict dst, const unsigned char *src, int n) {
+  int i = 0;
+
+  if (n > 0 && dst == src + n - 1) {
+    i = 1;
+  }
+  reverse_bytes_impl(dst, src, n, i);
+}
+
+/// out[j] = alpha of the kernel sum between the rows top and bottom of the
+/// SAT and the columns j to j + width, for 0 <= j <= size, see above.
+void
+shadow_sat_row(unsigned char *out, const uint32_t *top,
+               const uint32_t *bottom, int size, int width, double opacity) {
+  if (unlikely(bottom <= top || width <= 0)) {
+    memset(out, 0, size + 1);
+    return;
+  }
+  sat_row_impl(out, top, bottom, size, width, shadow_opacity_scale(opacity));
+}
+
+/// Rasterize the shadow of a width x height window into data, which holds
+/// height + gaussian_map->size rows of stride bytes, each at least width +
+/// gaussian_map->size pixels. Only
+/// reads tables set up at startup, so shadow_worker may call it as well.
+void
+shadow_raster(unsigned char *data, size_t stride,
+              double opacity, int width, int height) {
+  int gsize = gaussian_map->size;
+  int sat_stride = gsize + 1;
+  const uint32_t *sat = gaussian_map->sat;
+  unsigned char sums[sat_stride];
+  int ylimit, xlimit;
+  int swidth = width + gsize;
+  int sheight = height + gsize;
+  int center = gsize / 2;
+  int y;
+  unsigned char d;
+  int x_diff;
+  int opacity_int = (int)(opacity * 25);
+
+  /*
+   * Build the gaussian in sections
+   */
+
+  /*
+   * center (fill the complete data array)
+   */
+
+  if (Gsize > 0) {
+    d = shadow_top[opacity_int * (Gsize + 1) + Gsize];
+  } else {
+    d = sum_gaussian(gaussian_map,
+      opacity, center, center, width, height);
+  }
+
+  for (y = 0; y < sheight; y++) {
+    memset(&data[y * stride], d, swidth);
+  }
+
+  /*
+   * corners
+   */
+
+  ylimit = gsize;
+  if (ylimit > sheight / 2) ylimit = (sheight + 1) / 2;
+
+  xlimit = gsize;
+  if (xlimit > swidth / 2) xlimit = (swidth + 1) / 2;
+
+  // Row by row, each top left corner row is mirrored to the right and then
+  // copied to the bottom, so all writes are sequential.
+  for (y = 0; y < ylimit; y++) {
+    unsigned char *row = &data[y * stride];
+    unsigned char *mirror = &data[(sheight - y - 1) * stride];
+
+    if (xlimit == Gsize && ylimit == Gsize) {
+      memcpy(row, &shadow_corner[opacity_int * (Gsize + 1) * (Gsize + 1)
+                                 + y * (Gsize + 1)], xlimit);
+    } else {
+      // The kernel of pixel x, y covers the rows from gsize - y and the
+      // columns from gsize - x on, so the row is sums reversed.
+      int fy_end = height + gsize - y;
+      if (fy_end > gsize) fy_end = gsize;
+      shadow_sat_row(sums, &sat[(gsize - y) * sat_stride],
+                     &sat[fy_end * sat_stride],
+                     gsize, width, opacity);
+      reverse_bytes(row, sums + sat_stride - xlimit, xlimit);
+    }
+    reverse_bytes(row + swidth - xlimit, row, xlimit);
+    if (mirror != row) {
+      memcpy(mirror, row, xlimit);
+      memcpy(mirror + swidth - xlimit, row + swidth - xlimit, xlimit);
+    }
+  }
+
+  /*
+   * top/bottom
+   */
+
+  x_diff = swidth - (gsize * 2);
+  if (x_diff > 0 && ylimit > 0) {
+    for (y = 0; y < ylimit; y++) {
+      if (ylimit == Gsize) {
+        d = shadow_top[opacity_int * (Gsize + 1) + y];
+      } else {
+        d = sum_gaussian(gaussian_map,
+          opacity, center, y - center, width, height);
+      }
+      memset(&data[y * stride + gsize], d, x_diff);
+      memset(&data[(sheight - y - 1) * stride + gsize], d, x_diff);
+    }
+  }
+
+  /*
+   * sides
+   */
+
+  if (sheight - gsize > gsize) {
+    // All rows between the corners equal the first one
+    unsigned char *row = &data[gsize * stride];
+
+    if (xlimit == Gsize) {
+      memcpy(row, &shadow_top[opacity_int * (Gsize + 1)], xlimit);
+    } else {
+      shadow_sat_row(sums, sat, &sat[gsize * sat_stride], gsize, width,
+                     opacity);
+      reverse_bytes(row, sums + sat_stride - xlimit, xlimit);
+    }
+    reverse_bytes(row + swidth - xlimit, row, xlimit);
+    for (y = gsize + 1; y < sheight - gsize; y++) {
+      memcpy(&data[y * stride], row, xlimit);
+      memcpy(&data[y * stride + swidth - xlimit], row + swidth - xlimit,
+             xlimit);
+    }
+  }
+}
+
+/// Make that part of the shadow of a width x height window transparent, which
+/// is immediately below the window, when the shadow is offset by dx, dy.
+void
+shadow_clear_center(unsigned char *data, size_t stride,
+                    int width, int height, int dx, int dy) {
+  int swidth = width + gaussian_map->size;
+  int sheight = height + gaussian_map->size;
+  // The window, in shadow coordinates, clipped to the shadow
+  int x1 = dx < 0 ? -dx : 0;
+  int y1 = dy < 0 ? -dy : 0;
+  int x2 = width - dx < swidth ? width - dx : swidth;
+  int y2 = height - dy < sheight ? height - dy : sheight;
+  int y;
+
+  if (x2 <= x1) return;
+  for (y = y1; y < y2; y++) {
+    memset(&data[y * stride + x1], 0, x2 - x1);
+  }
+}
+
+int
+shadow_patch_level(double opacity, int width, int height) {
+  int level = (int)(opacity * 25);
+
+  if (Gsize <= 0 || width < Gsize || height < Gsize ||
+      level < 0 || level >= SHADOW_LEVELS) {
+    return -1;
+  }
+  return level;
+}
+
+void
+shadow_patch_size(shadow_patch_kind kind, int *width, int *height) {
+  static const int sizes[SHADOW_PATCHES][2] = {
+    [SHADOW_PATCH_CORNERS] = { 2, 2 },
+    [SHADOW_PATCH_HEDGE] = { 0, 2 },
+    [SHADOW_PATCH_VEDGE] = { 2, 0 },
+    [SHADOW_PATCH_CENTER] = { 0, 0 },
+  };
+
+  *width = sizes[kind][0] ? sizes[kind][0] * Gsize : 1;
+  *height = sizes[kind][1] ? sizes[kind][1] * Gsize : 1;
+}
+
+void
+shadow_patch_raster(unsigned char *data, size_t stride,
+                    int level, shadow_patch_kind kind) {
+  const unsigned char *corner =
+    shadow_corner + level * (Gsize + 1) * (Gsize + 1);
+  const unsigned char *top = shadow_top + level * (Gsize + 1);
+  int g = Gsize;
+  int x, y;
+
+  switch (kind) {
+  case SHADOW_PATCH_CORNERS:
+    for (y = 0; y < g; y++) {
+      for (x = 0; x < g; x++) {
+        unsigned char d = corner[y * (g + 1) + x];
+        data[y * stride + x] = d;
+        data[y * stride + (2 * g - x - 1)] = d;
+        data[(2 * g - y - 1) * stride + x] = d;
+        data[(2 * g - y - 1) * stride + (2 * g - x - 1)] = d;
+      }
+    }
+    break;
+  case SHADOW_PATCH_HEDGE:
+    for (y = 0; y < g; y++) {
+      data[y * stride] = data[(2 * g - y - 1) * stride] = top[y];
+    }
+    break;
+  case SHADOW_PATCH_VEDGE:
+    for (x = 0; x < g; x++) {
+      data[x] = data[2 * g - x - 1] = top[x];
+    }
+    break;
+  case SHADOW_PATCH_CENTER:
+    data[0] = top[g];
+    break;
+  case SHADOW_PATCHES:
+    assert(false);
+  }
+}
+
+int
+shadow_parts(shadow_part *parts, int swidth, int sheight) {
+  int g = Gsize;
+  int mw = swidth - 2 * g;
+  int mh = sheight - 2 * g;
+  int n = 0;
+
+#define PART(k, mx, my, px, py, pw, ph) \
+  parts[n++] = (shadow_part) { k, mx, my, px, py, pw, ph }
+  PART(SHADOW_PATCH_CORNERS, 0, 0, 0, 0, g, g);
+  PART(SHADOW_PATCH_CORNERS, g, 0, swidth - g, 0, g, g);
+  PART(SHADOW_PATCH_CORNERS, 0, g, 0, sheight - g, g, g);
+  PART(SHADOW_PATCH_CORNERS, g, g, swidth - g, sheight - g, g, g);
+  if (mw > 0) {
+    PART(SHADOW_PATCH_HEDGE, 0, 0, g, 0, mw, g);
+    PART(SHADOW_PATCH_HEDGE, 0, g, g, sheight - g, mw, g);
+  }
+  if (mh > 0) {
+    PART(SHADOW_PATCH_VEDGE, 0, 0, 0, g, g, mh);
+    PART(SHADOW_PATCH_VEDGE, g, 0, swidth - g, g, g, mh);
+  }
+  if (mw > 0 && mh > 0) {
+    PART(SHADOW_PATCH_CENTER, 0, 0, g, g, mw, mh);
+  }
+#undef PART
+  return n;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Fixed point 1.0 of conv.sat, the sum of the whole kernel
+#define SAT_ONE (1u << 30)
+
+typedef struct _conv {
+  int size;
+  // Summed-area table of the normalized kernel: sat[y * (size + 1) + x] is
+  // the sum of all values above and left of x, y, in units of 1 / SAT_ONE.
+  uint32_t *sat;
+} conv;
+
+/// Implementations of the row kernels of shadow_raster
+typedef enum {
+  SHADOW_SIMD_NONE,
+  SHADOW_SIMD_SSE2,
+  SHADOW_SIMD_AVX2,
+} shadow_simd;
+
+extern conv *gaussian_map;
+
+/* For shadow precomputation */
+extern int Gsize;
+extern unsigned char *shadow_corner;
+extern unsigned char *shadow_top;
+
+conv *make_gaussian_map(double r);
+void presum_gaussian(conv *map);
+unsigned char sum_gaussian(conv *map, double opacity,
+                           int x, int y, int width, int height);
+void shadow_raster(unsigned char *data, size_t stride,
+                   double opacity, int width, int height);
+void shadow_clear_center(unsigned char *data, size_t stride,
+                         int width, int height, int dx, int dy);
+
+/*
+ * The shadow of every window at least Gsize wide and high consists of the
+ * same corners, of edges, which are constant along the window, and of a
+ * constant center. So per opacity level, these patches can be uploaded once
+ * and shared by all such windows, whatever their size.
+ */
+
+// Levels of shadow_corner and shadow_top, opacity * 25
+#define SHADOW_LEVELS 26
+
+typedef enum {
+  SHADOW_PATCH_CORNERS, // 2 Gsize x 2 Gsize, the four corners
+  SHADOW_PATCH_HEDGE,   // 1 x 2 Gsize, repeating: the top, then the bottom edge
+  SHADOW_PATCH_VEDGE,   // 2 Gsize x 1, repeating: the left, then the right edge
+  SHADOW_PATCH_CENTER,  // 1 x 1, repeating
+  SHADOW_PATCHES,
+} shadow_patch_kind;
+
+/// One of the nine parts of a shadow: the patch kind, read from mask_x,
+/// mask_y on and repeated, covers width x height at x, y of the shadow.
+typedef struct {
+  shadow_patch_kind kind;
+  int mask_x, mask_y;
+  int x, y, width, height;
+} shadow_part;
+
+/// The level of the patches of the shadow of a width x height window, or -1,
+/// if the window is too small, so its corners overlap and need shadow_raster.
+int shadow_patch_level(double opacity, int width, int height);
+void shadow_patch_size(shadow_patch_kind kind, int *width, int *height);
+/// Fill the image of a patch, of shadow_patch_size, with rows of stride bytes
+void shadow_patch_raster(unsigned char *data, size_t stride,
+                         int level, shadow_patch_kind kind);
+/// The parts of a swidth x sheight shadow, returns their number, at most 9
+int shadow_parts(shadow_part *parts, int swidth, int sheight);
+
+/// Use the best kernels the CPU supports, but at most max. Returns the ones
+/// selected. Not thread-safe, call it before rasterizing.
+shadow_simd shadow_simd_select(shadow_simd max);
+void reverse_bytes(unsigned char *restrict dst, const unsigned char *src, int n);
+void shadow_sat_row(unsigned char *out, const uint32_t *top,
+                    const uint32_t *bottom, int size, int width, double opacity);
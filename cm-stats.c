@@ -0,0 +1,34 @@
+#include <stdio.h>
+
+#include "cm-stats.h"
+#include "cm-util.h"
+
+CmStats g_stats;
+
+#if DEBUG_STATS
+
+#define STATS_INTERVAL_MS 10000
+
+/// Print all counters along with their rate since the last print, at most
+/// every STATS_INTERVAL_MS.
+void stats_maybe_print(void) {
+  static CmStats last;
+  static int last_time = 0;
+  int now = get_time_in_milliseconds();
+  double secs;
+
+  if (now - last_time < STATS_INTERVAL_MS) return;
+  secs = (now - last_time) / 1000.0;
+
+  fprintf(stderr, "stats after %d s:\n", now / 1000);
+#define CM_STATS_PRINT(name, desc) \
+  fprintf(stderr, "  %-40s %12lu  (%.1f/s)\n", desc, g_stats.name, \
+          (g_stats.name - last.name) / secs);
+  CM_STATS_FIELDS(CM_STATS_PRINT)
+#undef CM_STATS_PRINT
+
+  last = g_stats;
+  last_time = now;
+}
+
+#endif
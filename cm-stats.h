@@ -0,0 +1,60 @@
+#pragma once
+
+#ifndef DEBUG_STATS
+#define DEBUG_STATS 0
+#endif
+
+// Counters, which are periodically printed to stderr, if compiled with
+// -DDEBUG_STATS=1. Otherwise, counting compiles to nothing.
+#define CM_STATS_FIELDS(X) \
+  X(client_walks, "client tree walks") \
+  X(client_walks_avoided, "client tree walks avoided") \
+  X(client_walk_round_trips, "client tree walk round trips") \
+  X(win_creates, "windows created") \
+  X(win_setups, "window setups") \
+  X(win_setups_avoided, "window setups avoided (never mapped)") \
+  X(wintype_lookups, "window type lookups") \
+  X(wintype_lookups_avoided, "window type lookups avoided") \
+  X(prop_reads, "cached property reads") \
+  X(prop_reads_avoided, "cached property reads avoided") \
+  X(format_lookups, "render format lookups") \
+  X(format_lookups_avoided, "render format lookups avoided") \
+  X(shape_fetches, "bounding shape fetches") \
+  X(occlusion_evals, "windows re-evaluated for occlusion") \
+  X(occlusion_evals_avoided, "windows keeping their occlusion state") \
+  X(damage_suspends, "damage tracking suspended (window invisible)") \
+  X(damage_resumes, "damage tracking resumed") \
+  X(damage_events_dropped, "damage events of suspended windows dropped") \
+  X(shadow_rasters, "shadows rasterized and uploaded") \
+  X(shadow_patch_paints, "shadows painted from shared patches") \
+  X(shadow_async_rasters, "shadows left to the worker thread") \
+  X(shadow_stale_frames, "frames painted with a stale shadow") \
+  X(shm_uploads, "shadow uploads by MIT-SHM") \
+  X(shm_syncs, "MIT-SHM uploads waiting for the server") \
+  X(shadow_cache_hits, "shadow cache hits") \
+  X(shadow_cache_misses, "shadow cache misses") \
+  X(shadow_cache_evictions, "shadow cache evictions") \
+  X(shadow_cache_bytes, "shadow cache bytes held") \
+  X(damage_exact, "frames painting the exact damage") \
+  X(damage_tiled, "frames painting damage merged into tiles") \
+  X(damage_bbox, "frames painting the damage bounding box")
+
+typedef struct {
+#define CM_STATS_DECLARE(name, desc) unsigned long name;
+  CM_STATS_FIELDS(CM_STATS_DECLARE)
+#undef CM_STATS_DECLARE
+} CmStats;
+
+extern CmStats g_stats;
+
+#if DEBUG_STATS
+#define STAT_INC(field) (g_stats.field++)
+#define STAT_ADD(field, n) (g_stats.field += (n))
+#define STAT_SET(field, v) (g_stats.field = (v))
+void stats_maybe_print(void);
+#else
+#define STAT_INC(field) ((void)0)
+#define STAT_ADD(field, n) ((void)0)
+#define STAT_SET(field, v) ((void)0)
+static inline void stats_maybe_print(void) {}
+#endif
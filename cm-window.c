@@ -1,5 +1,6 @@
 
 #include <stdio.h>
+#include <stdint.h>
 
 #include <X11/Xatom.h>
 
@@ -7,104 +8,292 @@
 #include "cm-root.h"
 #include "cm-window.h"
 #include "cm-global.h"
+#include "cm-stats.h"
 #include "cm-util.h"
+#include "cm-xcb.h"
+#include "cm-xidmap.h"
 
 
 win *list;
+static win *list_bottom;
 
-typedef struct _AtomArr {
-  Atom *atoms;
-  unsigned long n_items;
-} AtomArr;
+// All windows of list, which are not destroyed, indexed by their id.
+static XidMap win_index;
+// Maps client windows to their toplevel win. Each win is referenced by at
+// most one entry, its win.client_id, so the entry can be dropped with the
+// window.
+static XidMap client_index;
 
+// Lazily filled map of the visual ids of our screen to their Visual, to turn
+// GetWindowAttributes replies into XWindowAttributes.
+static XidMap visual_index;
 
-_Static_assert (sizeof(Atom) == sizeof(long),
-                "_query_atom_values depends on long-sized atom. See XGetWindowProperty");
 
-static AtomArr _query_atom_values(Window window, Atom property) {
-  Atom actual_type;
-  int actual_format;
-  unsigned long n_items, bytes_after;
-  Atom *atoms = NULL;
-  AtomArr ret;
+static Visual* _visual_from_id(VisualID id) {
+  Visual *v = xidmap_get(&visual_index, id);
+  if (likely(v)) return v;
 
-  set_ignore(g_dpy, NextRequest(g_dpy));
-  int result = XGetWindowProperty(g_dpy, window, property, 0, (~0L), False,
-                                  XA_ATOM, &actual_type, &actual_format,
-                                  &n_items, &bytes_after, (unsigned char**)&atoms);
-  if(result != Success || atoms == NULL){
-    memset(&ret, 0, sizeof(AtomArr));
+  Screen *screen = ScreenOfDisplay(g_dpy, g_screen);
+  for (int d = 0; d < screen->ndepths; d++) {
+    for (int i = 0; i < screen->depths[d].nvisuals; i++) {
+      v = &screen->depths[d].visuals[i];
+      if (v->visualid == id) {
+        xidmap_put(&visual_index, id, v);
+        return v;
+      }
+    }
+  }
+  return NULL;
+}
+
+
+/// Request what XGetWindowAttributes() would return, without waiting for it.
+WinAttrCookie win_attributes_request(Window id) {
+  WinAttrCookie c;
+  c.attr = xcb_get_window_attributes(g_xcb, id);
+  c.geom = xcb_get_geometry(g_xcb, id);
+  return c;
+}
+
+
+/// Collect the replies of win_attributes_request into a. Returns false, if
+/// the window does not exist (anymore).
+bool win_attributes_reply(WinAttrCookie c, XWindowAttributes *a) {
+  xcb_generic_error_t *err = NULL;
+  xcb_get_window_attributes_reply_t *attr;
+  xcb_get_geometry_reply_t *geom;
+
+  attr = xcb_get_window_attributes_reply(g_xcb, c.attr, &err);
+  free(err);
+  geom = xgeometry_reply(c.geom);
+  if (unlikely(!attr || !geom)) {
+    free(attr);
+    free(geom);
+    return false;
+  }
+
+  a->x = geom->x;
+  a->y = geom->y;
+  a->width = geom->width;
+  a->height = geom->height;
+  a->border_width = geom->border_width;
+  a->depth = geom->depth;
+  a->root = geom->root;
+  a->visual = _visual_from_id(attr->visual);
+  a->class = attr->_class;
+  a->bit_gravity = attr->bit_gravity;
+  a->win_gravity = attr->win_gravity;
+  a->backing_store = attr->backing_store;
+  a->backing_planes = attr->backing_planes;
+  a->backing_pixel = attr->backing_pixel;
+  a->save_under = attr->save_under;
+  a->colormap = attr->colormap;
+  a->map_installed = attr->map_is_installed;
+  a->map_state = attr->map_state;
+  a->all_event_masks = attr->all_event_masks;
+  a->your_event_mask = attr->your_event_mask;
+  a->do_not_propagate_mask = attr->do_not_propagate_mask;
+  a->override_redirect = attr->override_redirect;
+  a->screen = ScreenOfDisplay(g_dpy, g_screen);
+
+  free(attr);
+  free(geom);
+  return true;
+}
+
+
+xcb_get_property_cookie_t win_query_atoms_request(Window window, Atom property) {
+  return xprop_request(window, property, XCB_ATOM_ATOM, UINT32_MAX);
+}
+
+
+/// Collect all atoms of a property requested by win_query_atoms_request. The
+/// caller has to atom_arr_free() the result.
+AtomArr win_query_atoms_reply(xcb_get_property_cookie_t cookie) {
+  AtomArr ret = { 0 };
+  xcb_get_property_reply_t *r = xprop_reply(cookie);
+
+  if (r == NULL) {
     return ret;
   }
-  if(unlikely(actual_format != 32)){
+  if (r->type != XCB_ATOM_ATOM) {
+    free(r);
+    return ret;
+  }
+  if(unlikely(r->format != 32)){
     fprintf(stderr, "fastcompmgr error: expected actual_format==32, got %d\n",
-            actual_format);
-    XFree(atoms);
-    memset(&ret, 0, sizeof(AtomArr));
+            r->format);
+    free(r);
     return ret;
   }
-  ret.atoms = atoms;
-  ret.n_items = n_items;
+  ret.reply = r;
+  ret.atoms = xcb_get_property_value(r);
+  ret.n_items = xcb_get_property_value_length(r) / sizeof(xcb_atom_t);
   return ret;
 }
 
 
-static bool win_has_atom(Window window, Atom atom){
-  Atom type = None;
-  int format;
-  unsigned long nitems, after;
-  unsigned char *data = NULL;
-  int res;
+static xcb_get_property_cookie_t _has_atom_request(Window window, Atom atom) {
+  return xprop_request(window, atom, XCB_GET_PROPERTY_TYPE_ANY, 0);
+}
+
 
-  set_ignore(g_dpy, NextRequest(g_dpy));
-  res = XGetWindowProperty(
-    g_dpy, window, atom, 0, 0, False,
-    AnyPropertyType, &type, &format, &nitems,
-    &after, &data);
-  if (likely(res == Success && data != NULL )) {
-      XFree(data);
-      if (likely(type)) return true;
+static bool _has_atom_reply(xcb_get_property_cookie_t cookie) {
+  xcb_get_property_reply_t *r = xprop_reply(cookie);
+  if (likely(r != NULL)) {
+    free(r);
+    return true;
   }
   return false;
 }
 
 
-win* find_win(Window id) {
-  win *w;
-  for (w = list; w; w = w->next) {
-    if (w->id == id && !w->destroyed)
-      return w;
+bool win_init(void) {
+  return xidmap_init(&win_index, 256) && xidmap_init(&client_index, 256) &&
+         xidmap_init(&visual_index, 64);
+}
+
+
+void win_index_add(win *w) {
+  if (unlikely(!xidmap_put(&win_index, w->id, w))) {
+    fprintf(stderr, "fastcompmgr error: failed to index window 0x%lx\n", w->id);
+  }
+}
+
+
+static void _client_index_put(win *w, Window client) {
+  if (w->client_id != client) {
+    if (w->client_id) {
+      win_client_forget(w->client_id);
+    }
+    w->client_id = client;
+  }
+  w->client_searched = true;
+  if (client != w->id) {
+    xidmap_put(&client_index, client, w);
   }
-  return NULL;
 }
 
 
+/// Remove w from the index, unless a newer window of the same id replaced it.
+/// Its client is no longer resolved to w either.
+void win_index_remove(win *w) {
+  if (xidmap_get(&win_index, w->id) == w) {
+    xidmap_remove(&win_index, w->id);
+  }
+  win_client_invalidate(w);
+}
+
+
+/// Forget the cached client of w, the next win_get_client() searches again.
+void win_client_invalidate(win *w) {
+  if (w->client_id && w->client_id != w->id) {
+    xidmap_remove(&client_index, w->client_id);
+  }
+  w->client_id = None;
+  w->client_searched = false;
+}
+
+
+/// Drop a client from the client index, e.g. after it was reparented.
+void win_client_forget(Window client) {
+  win *w = xidmap_remove(&client_index, client);
+  if (w && w->client_id == client) {
+    w->client_id = None;
+    w->client_searched = false;
+  }
+}
+
+
+/// Link w into the stacking order directly above below. If below is NULL,
+/// w becomes the bottommost window.
+void win_list_insert_above(win *w, win *below) {
+  w->next = below;
+  if (below) {
+    w->prev = below->prev;
+    below->prev = w;
+  } else {
+    w->prev = list_bottom;
+    list_bottom = w;
+  }
+  if (w->prev) {
+    w->prev->next = w;
+  } else {
+    list = w;
+  }
+}
+
+
+void win_list_unhook(win *w) {
+  if (w->prev) {
+    w->prev->next = w->next;
+  } else {
+    list = w->next;
+  }
+  if (w->next) {
+    w->next->prev = w->prev;
+  } else {
+    list_bottom = w->prev;
+  }
+  w->next = w->prev = NULL;
+}
+
+
+/// Move w directly above below (or to the bottom, if below is NULL).
+/// Returns false, if w already was there.
+bool win_list_restack(win *w, win *below) {
+  if (w == below || w->next == below) return false;
+  win_list_unhook(w);
+  win_list_insert_above(w, below);
+  return true;
+}
+
+
+win* find_win(Window id) {
+  return xidmap_get(&win_index, id);
+}
+
+
+/// Find the toplevel win of w or any of its ancestors. Clients known from
+/// the client index are resolved without a round trip, otherwise we walk
+/// up the tree and remember the result for next time.
 win* find_win_any_parent(Window w) {
-  Window root, parent;
-  Window *children;
-  win* res = NULL;
-  unsigned int nchildren;
-  // FIXME: find_win should rather return the window in constant time
+  xcb_query_tree_reply_t *tree;
+  Window parent;
+  Window cur = w;
+  win* res;
+
   if((res=find_win(w)) != NULL){
-      return res;
+    return res;
   }
-  set_ignore(g_dpy, NextRequest(g_dpy));
-  if (!XQueryTree(g_dpy, w, &root,
-      &parent, &children, &nchildren)) {
-    return NULL;
+  if((res=xidmap_get(&client_index, w)) != NULL){
+    return res;
   }
-  if (children) XFree((char *)children);
-  if(parent == root){
+  for(;;) {
+    tree = xtree_reply(xcb_query_tree(g_xcb, cur));
+    if (!tree) {
+      return NULL;
+    }
+    parent = tree->parent;
+    if(parent == tree->root || parent == None){
+      free(tree);
       return NULL;
+    }
+    free(tree);
+    if((res=find_win(parent)) != NULL){
+      _client_index_put(res, w);
+      return res;
+    }
+    cur = parent;
   }
-  return find_win_any_parent(parent);
 }
 
 
-bool win_state_is_hidden(Window window) {
+/// Collect the _NET_WM_STATE requested by win_state_request.
+bool win_state_is_hidden_reply(xcb_get_property_cookie_t cookie) {
   AtomArr atom_arr;
   bool hidden;
-  atom_arr = _query_atom_values(window, atom_net_wm_state);
+  atom_arr = win_query_atoms_reply(cookie);
   if(atom_arr.atoms == NULL) {
     return false;
   }
@@ -120,17 +309,135 @@ bool win_state_is_hidden(Window window) {
       break;
     }
   }
-  XFree(atom_arr.atoms);
+  atom_arr_free(&atom_arr);
   return hidden;
 }
 
 
+xcb_get_property_cookie_t win_state_request(Window window) {
+  return win_query_atoms_request(window, atom_net_wm_state);
+}
+
+
+bool win_state_is_hidden(Window window) {
+  return win_state_is_hidden_reply(win_state_request(window));
+}
+
+
 bool win_is_client(Window window){
-  return win_has_atom(window, atom_wm_state);
+  return _has_atom_reply(_has_atom_request(window, atom_wm_state));
+}
+
+
+/// Search the children of a QueryTree request for a client. All children
+/// of one level are asked at once, whether they are a client, and for their
+/// own children, so the search costs a round trip per level instead of two
+/// per window.
+static Window
+_find_client_in_children(xcb_query_tree_cookie_t tree_cookie) {
+  xcb_query_tree_reply_t *tree;
+  xcb_window_t *children;
+  xcb_get_property_cookie_t *state_cookies;
+  xcb_query_tree_cookie_t *tree_cookies;
+  int nchildren, i, found = -1;
+  Window client = None;
+
+  STAT_INC(client_walk_round_trips);
+  tree = xtree_reply(tree_cookie);
+  if (!tree) {
+    return None;
+  }
+  children = xcb_query_tree_children(tree);
+  nchildren = xcb_query_tree_children_length(tree);
+  state_cookies = malloc(nchildren * sizeof(*state_cookies));
+  tree_cookies = malloc(nchildren * sizeof(*tree_cookies));
+  if (unlikely(nchildren && (!state_cookies || !tree_cookies))) {
+    goto free_out;
+  }
+
+  for (i = 0; i < nchildren; i++) {
+    state_cookies[i] = _has_atom_request(children[i], atom_wm_state);
+    tree_cookies[i] = xcb_query_tree(g_xcb, children[i]);
+  }
+  for (i = 0; i < nchildren; i++) {
+    if (_has_atom_reply(state_cookies[i]) && found < 0) {
+      found = i;
+    }
+  }
+  if (found >= 0) {
+    client = children[found];
+    i = 0;
+  } else {
+    for (i = 0; i < nchildren && !client; i++) {
+      client = _find_client_in_children(tree_cookies[i]);
+    }
+  }
+  for (; i < nchildren; i++) {
+    xcb_forget(tree_cookies[i]);
+  }
+
+free_out:
+  free(state_cookies);
+  free(tree_cookies);
+  free(tree);
+  return client;
 }
 
 
-void win_register_client_events(Window window)
+/// Start the search for the client of w, unless it is cached already. Many
+/// windows can be searched at once by requesting all of them before
+/// collecting the first win_client_reply().
+ClientCookie win_client_request(win *w) {
+  ClientCookie c = { 0 };
+  if (w->client_searched) {
+    return c;
+  }
+  c.state = _has_atom_request(w->id, atom_wm_state);
+  c.tree = xcb_query_tree(g_xcb, w->id);
+  return c;
+}
+
+
+/// Finish the search started by win_client_request, see win_get_client.
+Window win_client_reply(win *w, ClientCookie c) {
+  Window client;
+
+  if (c.state.sequence == 0) {
+    STAT_INC(client_walks_avoided);
+    return w->client_id;
+  }
+  STAT_INC(client_walks);
+  STAT_INC(client_walk_round_trips);
+  if (_has_atom_reply(c.state)) {
+    xcb_forget(c.tree);
+    client = w->id;
+  } else {
+    client = _find_client_in_children(c.tree);
+  }
+  if (client) {
+    _client_index_put(w, client);
+  } else {
+    w->client_searched = true;
+  }
+  return client;
+}
+
+
+/// Return the client of w, which is w itself or its first descendant having
+/// WM_STATE set, or None. The search is expensive (a round trip per tree
+/// level), so the result is cached until the client or any other window is
+/// reparented into or out of w.
+Window win_get_client(win *w) {
+  return win_client_reply(w, win_client_request(w));
+}
+
+
+/// Listen for property changes of a client (or other descendant) of the
+/// toplevel w and resolve it to w from now on.
+void win_register_client_events(win *w, Window client)
 {
-  XSelectInput(g_dpy, window, PropertyChangeMask);
+  xselect_input(client, PropertyChangeMask);
+  if (client != w->id) {
+    _client_index_put(w, client);
+  }
 }
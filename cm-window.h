@@ -1,11 +1,15 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdlib.h>
 
 #include <X11/Xlib.h>
 #include <X11/extensions/Xcomposite.h>
 #include <X11/extensions/Xdamage.h>
 #include <X11/extensions/Xrender.h>
+#include <xcb/xproto.h>
+
+#include "comp_rect.h"
 
 #if COMPOSITE_MAJOR > 0 || COMPOSITE_MINOR >= 2
 #define HAS_NAME_WINDOW_PIXMAP 1
@@ -52,8 +56,41 @@ typedef enum {
 } hiddentype;
 
 
+// Bits of win.props_valid, the window properties cached in win. They are
+// read on first use and afterwards only updated on PropertyNotify.
+enum {
+  WINPROP_OPACITY = 1 << 0,           // opacity_prop, has_opacity_prop
+  WINPROP_GTK_FRAME_EXTENTS = 1 << 1, // has_gtk_frame_extents
+  WINPROP_OPAQUE_REGION = 1 << 2,     // opaque_region
+};
+
+
+typedef struct _AtomArr {
+  void *reply; // owns atoms
+  xcb_atom_t *atoms;
+  unsigned long n_items;
+} AtomArr;
+
+static inline void atom_arr_free(AtomArr *arr) {
+  free(arr->reply);
+}
+
+
+typedef struct {
+  xcb_get_window_attributes_cookie_t attr;
+  xcb_get_geometry_cookie_t geom;
+} WinAttrCookie;
+
+// A client search in flight. Zero, if the client of the window was cached.
+typedef struct {
+  xcb_get_property_cookie_t state;
+  xcb_query_tree_cookie_t tree;
+} ClientCookie;
+
+
 typedef struct _win {
-  struct _win *next;
+  struct _win *next; // the window below, NULL for the bottommost one
+  struct _win *prev; // the window above, NULL for the topmost one
   Window id;
 #if HAS_NAME_WINDOW_PIXMAP
   Pixmap pixmap;
@@ -70,41 +107,83 @@ typedef struct _win {
   Picture alpha_pict;
   Picture alpha_border_pict;
   Picture shadow_pict;
-  XserverRegion border_size;
+  CompRegion shape; // bounding shape relative to the window, if shape_valid
+  bool shape_valid;
+  bool bounding_shaped; // shape is not the default rectangle
+  CompRegion border_size; // bounding shape on screen, empty if not yet known
   XserverRegion extents;
-  Picture shadow;
+  Picture shadow; // picture of shadow_entry, or of shadow_stale
+  struct _shadow_entry *shadow_entry; // cached, shared shadow
+  const struct _shadow_patch *shadow_patch; // shared patches, instead of shadow
+  struct _shadow_entry *shadow_stale; // painted, until shadow_entry is ready
+  struct _win *shadow_waiter_next; // waiting for the upload of shadow_entry
   int shadow_dx;
   int shadow_dy;
   int shadow_width;
   int shadow_height;
   unsigned int opacity;
   bool userdefined_opacity; // Do not set inactive opacity, if the client requests a custom
+  unsigned int props_valid;
+  unsigned int opacity_prop; // _NET_WM_WINDOW_OPACITY, if has_opacity_prop
+  bool has_opacity_prop;
+  bool has_gtk_frame_extents;
+  CompRegion opaque_region; // _NET_WM_OPAQUE_REGION, relative to the client
+  int opaque_dx, opaque_dy; // origin of the client in the window
   hiddentype hidden_type;
-  wintype window_type;
+  wintype window_type; // cached until _NET_WM_WINDOW_TYPE changes
   shadowtype shadow_type;
   unsigned long damage_sequence; /* sequence when damage was created */
   Bool destroyed;
   Bool paint_needed;
+  bool occlusion_dirty; // changed since paint_needed was evaluated last
+  bool extents_dirty; // geometry or shadow changed since win_extents
+  CompRect occlusion_rect; // visible rect, when paint_needed was evaluated
   unsigned int left_width;
   unsigned int right_width;
   unsigned int top_width;
-  unsigned int bottom_width;
+  unsigned int bottom_width; // left..bottom_width: _NET_FRAME_EXTENTS of the client
+  Window client_id; // client window (carrying WM_STATE), may be id itself
+  bool client_searched; // client_id is valid, None means there is no client
+  bool setup_pending; // not mapped yet, client and properties not read yet
+  bool setup_damaged; // damage was reported while setup_pending
+  bool damage_suspended; // damage destroyed, while nothing of w is visible
+  bool damage_full; // repair all of w on the next damage report
 
   Bool need_configure;
   bool configure_size_changed;
   XConfigureEvent queue_configure;
 
   /* for drawing translucent windows */
-  XserverRegion border_clip;
+  CompRegion border_clip;
   struct _win *prev_trans;
 } win;
 
 
 extern win *list;
 
+bool win_init(void);
+void win_index_add(win *w);
+void win_index_remove(win *w);
+
+void win_list_insert_above(win *w, win *below);
+void win_list_unhook(win *w);
+bool win_list_restack(win *w, win *below);
+
 win* find_win(Window id);
 win* find_win_any_parent(Window w);
 
+WinAttrCookie win_attributes_request(Window id);
+bool win_attributes_reply(WinAttrCookie c, XWindowAttributes *a);
+
+xcb_get_property_cookie_t win_query_atoms_request(Window window, Atom property);
+AtomArr win_query_atoms_reply(xcb_get_property_cookie_t cookie);
+xcb_get_property_cookie_t win_state_request(Window window);
+bool win_state_is_hidden_reply(xcb_get_property_cookie_t cookie);
 bool win_state_is_hidden(Window window);
 bool win_is_client(Window window);
-void win_register_client_events(Window window);
+ClientCookie win_client_request(win *w);
+Window win_client_reply(win *w, ClientCookie c);
+Window win_get_client(win *w);
+void win_client_invalidate(win *w);
+void win_register_client_events(win *w, Window client);
+void win_client_forget(Window client);
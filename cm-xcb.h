@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdlib.h>
+
+#include <X11/Xlib.h>
+#include <xcb/xcb.h>
+#include <xcb/xproto.h>
+
+// The XCB connection underlying g_dpy. Requests with a reply are sent through
+// XCB, so independent requests can be issued at once and their replies be
+// collected later, instead of waiting a round trip for each. Errors of these
+// requests are returned with the reply instead of being passed to the Xlib
+// error handler, so they need no set_ignore().
+extern xcb_connection_t *g_xcb;
+
+
+static inline xcb_get_property_cookie_t
+xprop_request(Window w, Atom property, Atom type, uint32_t long_length) {
+  return xcb_get_property(g_xcb, 0, w, property, type, 0, long_length);
+}
+
+/// Wait for a property reply. Returns NULL on error (e.g. the window is
+/// already gone) or if the property does not exist, otherwise the reply,
+/// which must be free()d.
+static inline xcb_get_property_reply_t *
+xprop_reply(xcb_get_property_cookie_t cookie) {
+  xcb_generic_error_t *err = NULL;
+  xcb_get_property_reply_t *r = xcb_get_property_reply(g_xcb, cookie, &err);
+  free(err);
+  if (r && r->type == XCB_NONE) {
+    free(r);
+    return NULL;
+  }
+  return r;
+}
+
+static inline xcb_query_tree_reply_t *
+xtree_reply(xcb_query_tree_cookie_t cookie) {
+  xcb_generic_error_t *err = NULL;
+  xcb_query_tree_reply_t *r = xcb_query_tree_reply(g_xcb, cookie, &err);
+  free(err);
+  return r;
+}
+
+static inline xcb_get_geometry_reply_t *
+xgeometry_reply(xcb_get_geometry_cookie_t cookie) {
+  xcb_generic_error_t *err = NULL;
+  xcb_get_geometry_reply_t *r = xcb_get_geometry_reply(g_xcb, cookie, &err);
+  free(err);
+  return r;
+}
+
+/// We are no longer interested in the reply (or error) of a request. Void
+/// requests sent _checked and forgotten this way report no errors at all, as
+/// needed for windows, which may already be destroyed.
+#define xcb_forget(cookie) xcb_discard_reply(g_xcb, (cookie).sequence)
+
+/// Select the events of a window, which may be gone already.
+static inline void
+xselect_input(Window w, uint32_t mask) {
+  xcb_forget(xcb_change_window_attributes_checked(
+    g_xcb, w, XCB_CW_EVENT_MASK, &mask));
+}
@@ -0,0 +1,100 @@
+#include <stdlib.h>
+
+#include "cm-xidmap.h"
+#include "cm-util.h"
+
+
+static bool _xidmap_alloc(XidMap *m, unsigned long capacity) {
+  int bits = 0;
+  while ((1UL << bits) < capacity) bits++;
+  capacity = 1UL << bits;
+
+  m->keys = calloc(capacity, sizeof(XID));
+  m->vals = calloc(capacity, sizeof(void*));
+  if (unlikely(!m->keys || !m->vals)) {
+    free(m->keys);
+    free(m->vals);
+    return false;
+  }
+  m->mask = capacity - 1;
+  m->count = 0;
+  m->shift = 64 - bits;
+  return true;
+}
+
+
+bool xidmap_init(XidMap *m, unsigned long capacity) {
+  if (capacity < 8) capacity = 8;
+  return _xidmap_alloc(m, capacity);
+}
+
+
+static bool _xidmap_grow(XidMap *m) {
+  XidMap old = *m;
+  if (!_xidmap_alloc(m, (old.mask + 1) * 2)) {
+    *m = old;
+    return false;
+  }
+  for (unsigned long i = 0; i <= old.mask; i++) {
+    if (old.keys[i] != None) {
+      xidmap_put(m, old.keys[i], old.vals[i]);
+    }
+  }
+  free(old.keys);
+  free(old.vals);
+  return true;
+}
+
+
+/// Insert or replace the value for key. Fails for None.
+bool xidmap_put(XidMap *m, XID key, void *val) {
+  unsigned long i;
+
+  // None marks free slots
+  if (unlikely(key == None)) return false;
+
+  // Keep the load factor at or below 1/2, probe sequences stay short.
+  if (unlikely((m->count + 1) * 2 > m->mask + 1)) {
+    if (!_xidmap_grow(m)) return false;
+  }
+
+  for (i = xidmap_slot(m, key); m->keys[i] != None; i = (i + 1) & m->mask) {
+    if (m->keys[i] == key) {
+      m->vals[i] = val;
+      return true;
+    }
+  }
+  m->keys[i] = key;
+  m->vals[i] = val;
+  m->count++;
+  return true;
+}
+
+
+/// Remove key and return its value, or NULL, if it was not present.
+void *xidmap_remove(XidMap *m, XID key) {
+  unsigned long i, j;
+  void *val;
+
+  if (unlikely(key == None)) return NULL;
+  for (i = xidmap_slot(m, key); m->keys[i] != key; i = (i + 1) & m->mask) {
+    if (m->keys[i] == None) return NULL;
+  }
+  val = m->vals[i];
+
+  // Backward-shift deletion: move every following entry of the probe
+  // sequence, whose home slot is not within (i, j], into the hole.
+  for (j = (i + 1) & m->mask; m->keys[j] != None; j = (j + 1) & m->mask) {
+    unsigned long home = xidmap_slot(m, m->keys[j]);
+    bool stays = (i < j) ? (i < home && home <= j)
+                         : (i < home || home <= j);
+    if (stays) continue;
+    m->keys[i] = m->keys[j];
+    m->vals[i] = m->vals[j];
+    i = j;
+  }
+  m->keys[i] = None;
+  m->vals[i] = NULL;
+  m->count--;
+  return val;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <X11/X.h>
+
+/// Open-addressing hash map from XIDs to pointers. Collisions are resolved by
+/// linear probing, removal uses backward-shift deletion, so lookups never
+/// have to skip over tombstones. None (0) is not a valid key.
+typedef struct {
+  XID *keys;          // None marks a free slot
+  void **vals;
+  unsigned long mask; // capacity - 1, capacity is a power of two
+  unsigned long count;
+  int shift;          // 64 - log2(capacity), for fibonacci hashing
+} XidMap;
+
+bool xidmap_init(XidMap *m, unsigned long capacity);
+bool xidmap_put(XidMap *m, XID key, void *val);
+void *xidmap_remove(XidMap *m, XID key);
+
+
+static inline unsigned long
+xidmap_slot(const XidMap *m, XID key) {
+  // XIDs of one client only differ in the low bits, so spread them out.
+  return (unsigned long)(((uint64_t)key * 0x9E3779B97F4A7C15ull) >> m->shift);
+}
+
+static inline void *
+xidmap_get(const XidMap *m, XID key) {
+  unsigned long i = xidmap_slot(m, key);
+  for (;;) {
+    XID k = m->keys[i];
+    if (k == key) return m->vals[i];
+    if (k == None) return NULL;
+    i = (i + 1) & m->mask;
+  }
+}
@@ -1,62 +1,504 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "comp_rect.h"
+#include "cm-util.h"
 
 
+enum {
+    REGION_OP_UNION,
+    REGION_OP_INTERSECT,
+    REGION_OP_SUBTRACT,
+};
 
-/// Returns true, if r1 fully contains r2
-static bool rect_contains(CompRect* r1, CompRect* r2){
-    return r1->x1 <= r2->x1 && r1->y1 <= r2->y1 &&
-            r1->x2 >= r2->x2 && r1->y2 >=r2->y2;
+
+void region_init(CompRegion *r){
+    memset(r, 0, sizeof(*r));
 }
 
 
-static bool rects_are_intersecting(CompRect* r1, CompRect* r2)
-{
-    // if the left point of one rect is greater
-    // than the right one of the other, nothing intersects.
-    if(r1->x1 > r2->x2 || r2->x1 > r1->x2){
+void region_fini(CompRegion *r){
+    free(r->rects);
+    region_init(r);
+}
+
+
+static bool region_reserve(CompRegion *r, int n){
+    CompRect *rects;
+    int size;
+
+    if(likely(n <= r->size)){
+        return true;
+    }
+    size = r->size ? r->size : 8;
+    while(size < n){
+        size *= 2;
+    }
+    rects = realloc(r->rects, size * sizeof(CompRect));
+    if(unlikely(!rects)){
         return false;
     }
-    if(r1->y1 > r2->y2 || r2->y1 > r1->y2){
+    r->rects = rects;
+    r->size = size;
+    return true;
+}
+
+
+bool region_copy(CompRegion *dst, const CompRegion *src){
+    if(dst == src){
+        return true;
+    }
+    if(!region_reserve(dst, src->n)){
         return false;
     }
+    if(src->n){
+        memcpy(dst->rects, src->rects, src->n * sizeof(CompRect));
+    }
+    dst->n = src->n;
+    dst->extents = src->extents;
     return true;
 }
 
-/// Check if we can omit painting a window (rect). E.g., a window
-/// completely occluded by another one, does not need to be
-/// painted. Further, we try to select the largest possible ignore region
-/// Based on window and intersection areas.
-bool rect_paint_needed(CompRect* ignore_reg, CompRect* reg){
-    if(rect_contains(ignore_reg, reg)){
-        // the ignore-region completely occludes the window.
+
+bool region_set_rect(CompRegion *r, const CompRect *rect){
+    region_clear(r);
+    if(rect_is_empty(rect)){
+        return true;
+    }
+    if(!region_reserve(r, 1)){
         return false;
     }
-    if(! rects_are_intersecting(ignore_reg, reg)){
-        // KISS and just use the greater rect as new ignore region.
-        if(reg->w*reg->h > ignore_reg->w*ignore_reg->h){
-            *ignore_reg = *reg;
+    r->rects[0] = *rect;
+    r->n = 1;
+    r->extents = *rect;
+    return true;
+}
+
+
+/// Index one past the last rect of the band starting at rects[i].
+static int band_end(const CompRegion *r, int i){
+    int y1 = r->rects[i].y1;
+    while(i < r->n && r->rects[i].y1 == y1){
+        i++;
+    }
+    return i;
+}
+
+
+/// Append the span [x1, x2) to the band being built from index band_start
+/// on, merging it with the previous span, if they touch.
+static bool band_append(CompRegion *r, int band_start, int y1, int y2,
+                        int x1, int x2){
+    if(r->n > band_start && r->rects[r->n - 1].x2 >= x1){
+        if(x2 > r->rects[r->n - 1].x2){
+            r->rects[r->n - 1].x2 = x2;
         }
         return true;
     }
+    if(!region_reserve(r, r->n + 1)){
+        return false;
+    }
+    r->rects[r->n++] = (CompRect){ .x1 = x1, .y1 = y1, .x2 = x2, .y2 = y2 };
+    return true;
+}
+
+
+/// Combine the spans a[0..na) and b[0..nb) of one band with op and append
+/// the result as a new band [y1, y2) to r.
+static bool band_op(CompRegion *r, int op, int y1, int y2,
+                    const CompRect *a, int na, const CompRect *b, int nb){
+    int start = r->n;
+    int i = 0, j = 0;
+
+    switch(op){
+    case REGION_OP_UNION:
+        while(i < na || j < nb){
+            const CompRect *s;
+            if(j >= nb || (i < na && a[i].x1 <= b[j].x1)){
+                s = &a[i++];
+            } else {
+                s = &b[j++];
+            }
+            if(!band_append(r, start, y1, y2, s->x1, s->x2)) return false;
+        }
+        break;
+    case REGION_OP_INTERSECT:
+        while(i < na && j < nb){
+            int x1 = a[i].x1 > b[j].x1 ? a[i].x1 : b[j].x1;
+            int x2 = a[i].x2 < b[j].x2 ? a[i].x2 : b[j].x2;
+            if(x1 < x2 && !band_append(r, start, y1, y2, x1, x2)){
+                return false;
+            }
+            if(a[i].x2 < b[j].x2){
+                i++;
+            } else {
+                j++;
+            }
+        }
+        break;
+    case REGION_OP_SUBTRACT:
+        for(; i < na; i++){
+            int x1 = a[i].x1;
+            // skip subtrahends left of the span
+            while(j < nb && b[j].x2 <= x1){
+                j++;
+            }
+            for(int k = j; k < nb && b[k].x1 < a[i].x2; k++){
+                if(b[k].x1 > x1 &&
+                   !band_append(r, start, y1, y2, x1, b[k].x1)){
+                    return false;
+                }
+                if(b[k].x2 > x1){
+                    x1 = b[k].x2;
+                }
+            }
+            if(x1 < a[i].x2 && !band_append(r, start, y1, y2, x1, a[i].x2)){
+                return false;
+            }
+        }
+        break;
+    }
+    return true;
+}
+
+
+/// Merge the band starting at cur into the one starting at prev, if they
+/// touch and have the same spans. Returns the start of the last band.
+static int band_coalesce(CompRegion *r, int prev, int cur){
+    int n = r->n - cur;
+
+    if(prev < 0 || cur - prev != n || n == 0 ||
+       r->rects[prev].y2 != r->rects[cur].y1){
+        return n ? cur : prev;
+    }
+    for(int i = 0; i < n; i++){
+        if(r->rects[prev + i].x1 != r->rects[cur + i].x1 ||
+           r->rects[prev + i].x2 != r->rects[cur + i].x2){
+            return cur;
+        }
+    }
+    for(int i = 0; i < n; i++){
+        r->rects[prev + i].y2 = r->rects[cur].y2;
+    }
+    r->n = cur;
+    return prev;
+}
 
-    // calculate the intersection rect.
-    short x1 = (ignore_reg->x1 > reg->x1) ? ignore_reg->x1 : reg->x1;
-    short x2 = (ignore_reg->x2 < reg->x2) ? ignore_reg->x1 : reg->x1;
-    short y1 = (ignore_reg->y1 > reg->y1) ? ignore_reg->y1 : reg->y1;
-    short y2 = (ignore_reg->y2 < reg->y2) ? ignore_reg->y1 : reg->y1;
-    short w = x2 - x1;
-    short h = y2 - y1;
 
-    // KISS and just use the biggest rect as new ignore rect
-    if(reg->w*reg->h > ignore_reg->w*ignore_reg->h){
-        *ignore_reg = *reg;
+static void region_update_extents(CompRegion *r){
+    if(r->n == 0){
+        r->extents = (CompRect){0};
+        return;
+    }
+    r->extents.y1 = r->rects[0].y1;
+    r->extents.y2 = r->rects[r->n - 1].y2;
+    r->extents.x1 = r->rects[0].x1;
+    r->extents.x2 = r->rects[0].x2;
+    for(int i = 1; i < r->n; i++){
+        if(r->rects[i].x1 < r->extents.x1) r->extents.x1 = r->rects[i].x1;
+        if(r->rects[i].x2 > r->extents.x2) r->extents.x2 = r->rects[i].x2;
+    }
+}
+
+
+/// Sweep both regions top to bottom, cutting them into horizontal slices,
+/// within which neither region changes, and combine the spans of each slice
+/// with op. dst may be a or b.
+static bool region_op(CompRegion *dst, const CompRegion *a,
+                      const CompRegion *b, int op){
+    CompRegion res;
+    int ia = 0, ib = 0;
+    int ea = a->n ? band_end(a, 0) : 0;
+    int eb = b->n ? band_end(b, 0) : 0;
+    int prev_band = -1;
+    int y = INT_MIN;
+
+    region_init(&res);
+    if(!region_reserve(&res, a->n + b->n)){
+        return false;
     }
-    if(w*h > ignore_reg->w*ignore_reg->h){
-        CompRect r_intersect = {.x1 = x1, .y1 = y1,
-                  .x2 = x2, .y2 = y2,
-                  .w = w, .h = h };
-        *ignore_reg = r_intersect;
+
+    while(ia < a->n || ib < b->n){
+        const CompRect *ra = NULL, *rb = NULL;
+        int na = 0, nb = 0;
+        int ay1 = ia < a->n ? a->rects[ia].y1 : 0;
+        int by1 = ib < b->n ? b->rects[ib].y1 : 0;
+        int top, bot;
+
+        if(ia < a->n && ay1 < y) ay1 = y;
+        if(ib < b->n && by1 < y) by1 = y;
+
+        if(ib >= b->n || (ia < a->n && ay1 < by1)){
+            // only a
+            top = ay1;
+            bot = a->rects[ia].y2;
+            if(ib < b->n && by1 < bot) bot = by1;
+            ra = &a->rects[ia];
+            na = ea - ia;
+        } else if(ia >= a->n || by1 < ay1){
+            // only b
+            top = by1;
+            bot = b->rects[ib].y2;
+            if(ia < a->n && ay1 < bot) bot = ay1;
+            rb = &b->rects[ib];
+            nb = eb - ib;
+        } else {
+            top = ay1;
+            bot = a->rects[ia].y2 < b->rects[ib].y2 ? a->rects[ia].y2
+                                                      : b->rects[ib].y2;
+            ra = &a->rects[ia];
+            na = ea - ia;
+            rb = &b->rects[ib];
+            nb = eb - ib;
+        }
+
+        if((op == REGION_OP_UNION) ||
+           (op == REGION_OP_SUBTRACT && na) ||
+           (op == REGION_OP_INTERSECT && na && nb)){
+            int start = res.n;
+            if(!band_op(&res, op, top, bot, ra, na, rb, nb)){
+                region_fini(&res);
+                return false;
+            }
+            prev_band = band_coalesce(&res, prev_band, start);
+        }
+
+        y = bot;
+        if(ia < a->n && a->rects[ia].y2 <= y){
+            ia = ea;
+            ea = ia < a->n ? band_end(a, ia) : ia;
+        }
+        if(ib < b->n && b->rects[ib].y2 <= y){
+            ib = eb;
+            eb = ib < b->n ? band_end(b, ib) : ib;
+        }
     }
+
+    region_update_extents(&res);
+    free(dst->rects);
+    *dst = res;
     return true;
 }
+
+
+bool region_union(CompRegion *dst, const CompRegion *a, const CompRegion *b){
+    if(a->n == 0) return region_copy(dst, b);
+    if(b->n == 0) return region_copy(dst, a);
+    return region_op(dst, a, b, REGION_OP_UNION);
+}
+
+
+bool region_intersect(CompRegion *dst, const CompRegion *a, const CompRegion *b){
+    CompRect e;
+    rect_intersect(&e, &a->extents, &b->extents);
+    if(a->n == 0 || b->n == 0 || rect_is_empty(&e)){
+        region_clear(dst);
+        return true;
+    }
+    if(a->n == 1 && b->n == 1){
+        return region_set_rect(dst, &e);
+    }
+    return region_op(dst, a, b, REGION_OP_INTERSECT);
+}
+
+
+bool region_subtract(CompRegion *dst, const CompRegion *a, const CompRegion *b){
+    CompRect e;
+    rect_intersect(&e, &a->extents, &b->extents);
+    if(a->n == 0 || b->n == 0 || rect_is_empty(&e)){
+        return region_copy(dst, a);
+    }
+    return region_op(dst, a, b, REGION_OP_SUBTRACT);
+}
+
+
+bool region_union_rect(CompRegion *r, const CompRect *rect){
+    CompRegion tmp = { .extents = *rect, .rects = (CompRect*)rect, .n = 1,
+                       .size = 1 };
+    if(rect_is_empty(rect)){
+        return true;
+    }
+    if(region_contains_rect(r, rect)){
+        return true;
+    }
+    return region_union(r, r, &tmp);
+}
+
+
+void region_translate(CompRegion *r, int dx, int dy){
+    for(int i = 0; i < r->n; i++){
+        r->rects[i].x1 += dx;
+        r->rects[i].x2 += dx;
+        r->rects[i].y1 += dy;
+        r->rects[i].y2 += dy;
+    }
+    if(r->n){
+        r->extents.x1 += dx;
+        r->extents.x2 += dx;
+        r->extents.y1 += dy;
+        r->extents.y2 += dy;
+    }
+}
+
+
+long long region_area(const CompRegion *r){
+    long long area = 0;
+    for(int i = 0; i < r->n; i++){
+        area += (long long)(r->rects[i].x2 - r->rects[i].x1) *
+                (r->rects[i].y2 - r->rects[i].y1);
+    }
+    return area;
+}
+
+
+static int floor_div(int a, int b){
+    return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+
+/// Replace r by the cells of a tile x tile grid aligned to 0,0, which r
+/// touches. The result covers r with fewer, larger rectangles: at most one
+/// per cell, usually far less, since touching cells are merged.
+bool region_tile(CompRegion *r, int tile){
+    CompRegion res;
+    unsigned char *cells;
+    int gx1, gy1, cols, rows;
+    int prev_band = -1;
+
+    if(r->n <= 1 || tile <= 1){
+        return true;
+    }
+    gx1 = floor_div(r->extents.x1, tile);
+    gy1 = floor_div(r->extents.y1, tile);
+    cols = floor_div(r->extents.x2 - 1, tile) - gx1 + 1;
+    rows = floor_div(r->extents.y2 - 1, tile) - gy1 + 1;
+    cells = calloc((size_t)cols * rows, 1);
+    if(unlikely(!cells)){
+        return false;
+    }
+    for(int i = 0; i < r->n; i++){
+        const CompRect *rect = &r->rects[i];
+        int cx1 = floor_div(rect->x1, tile) - gx1;
+        int cx2 = floor_div(rect->x2 - 1, tile) - gx1;
+        int cy1 = floor_div(rect->y1, tile) - gy1;
+        int cy2 = floor_div(rect->y2 - 1, tile) - gy1;
+        for(int y = cy1; y <= cy2; y++){
+            memset(&cells[y * cols + cx1], 1, cx2 - cx1 + 1);
+        }
+    }
+
+    region_init(&res);
+    for(int y = 0; y < rows; y++){
+        int start = res.n;
+        int y1 = (gy1 + y) * tile;
+        for(int x = 0; x < cols; x++){
+            if(!cells[y * cols + x]) continue;
+            int x1 = (gx1 + x) * tile;
+            if(!band_append(&res, start, y1, y1 + tile, x1, x1 + tile)){
+                free(cells);
+                region_fini(&res);
+                return false;
+            }
+        }
+        prev_band = band_coalesce(&res, prev_band, start);
+    }
+    free(cells);
+
+    region_update_extents(&res);
+    free(r->rects);
+    *r = res;
+    return true;
+}
+
+
+/// Returns true, if r fully covers rect, i.e. nothing of rect is visible
+/// below the region.
+bool region_contains_rect(const CompRegion *r, const CompRect *rect){
+    const CompRect *e = &r->extents;
+    int y = rect->y1;
+    int i = 0;
+
+    if(rect_is_empty(rect)){
+        return true;
+    }
+    if(r->n == 0 || rect->x1 < e->x1 || rect->x2 > e->x2 ||
+       rect->y1 < e->y1 || rect->y2 > e->y2){
+        return false;
+    }
+
+    // skip the bands above
+    while(i < r->n && r->rects[i].y2 <= y){
+        i++;
+    }
+    while(i < r->n){
+        int end = band_end(r, i);
+        bool covered = false;
+        if(r->rects[i].y1 > y){
+            // gap between the bands
+            return false;
+        }
+        // spans neither overlap nor touch, so one of them has to cover rect
+        for(; i < end && r->rects[i].x1 <= rect->x1; i++){
+            if(r->rects[i].x2 >= rect->x2){
+                covered = true;
+                break;
+            }
+        }
+        if(!covered){
+            return false;
+        }
+        y = r->rects[i].y2;
+        if(y >= rect->y2){
+            return true;
+        }
+        i = end;
+    }
+    return false;
+}
+
+
+bool region_intersects_rect(const CompRegion *r, const CompRect *rect){
+    CompRect e;
+
+    rect_intersect(&e, &r->extents, rect);
+    if(r->n == 0 || rect_is_empty(&e)){
+        return false;
+    }
+    for(int i = 0; i < r->n && r->rects[i].y1 < rect->y2; i++){
+        const CompRect *b = &r->rects[i];
+        if(b->y2 > rect->y1 && b->x1 < rect->x2 && b->x2 > rect->x1){
+            return true;
+        }
+    }
+    return false;
+}
+
+
+int region_simplify(CompRegion *r, int max_rects, long long rect_cost,
+                    int tile){
+    static CompRegion tiled;
+    long long exact_cost, tiled_cost, bbox_cost;
+    CompRect bbox;
+
+    if(likely(r->n <= max_rects)){
+        return REGION_SIMPLIFY_EXACT;
+    }
+
+    exact_cost = r->n * rect_cost + region_area(r);
+    bbox_cost = rect_cost + (long long)(r->extents.x2 - r->extents.x1) *
+                            (r->extents.y2 - r->extents.y1);
+    if(region_copy(&tiled, r) && region_tile(&tiled, tile)){
+        tiled_cost = tiled.n * rect_cost + region_area(&tiled);
+        if(tiled_cost < bbox_cost && tiled_cost < exact_cost){
+            region_copy(r, &tiled);
+            return REGION_SIMPLIFY_TILED;
+        }
+    }
+    if(bbox_cost >= exact_cost){
+        return REGION_SIMPLIFY_EXACT;
+    }
+    bbox = r->extents;
+    region_set_rect(r, &bbox);
+    return REGION_SIMPLIFY_BBOX;
+}
@@ -2,15 +2,73 @@
 
 #include <stdbool.h>
 
+/// A rectangle, x2 and y2 are exclusive. 32 bit coordinates, so areas and
+/// sums of large multi-monitor roots do not overflow.
 typedef struct {
-    short x1;
-    short y1;
-    short x2;
-    short y2;
-    short w;
-    short h;
+    int x1;
+    int y1;
+    int x2;
+    int y2;
 } CompRect;
 
+/// A client-side region in y-x banded form, like the regions of the X server
+/// or pixman: rects are sorted by y1, then x1. Rects of one band share y1 and
+/// y2, do neither overlap nor touch each other, and adjacent bands with the
+/// same x spans are merged. So every region has exactly one representation.
+typedef struct {
+    CompRect extents;
+    CompRect *rects;
+    int n;
+    int size;
+} CompRegion;
+
+
+void region_init(CompRegion *r);
+void region_fini(CompRegion *r);
+bool region_copy(CompRegion *dst, const CompRegion *src);
+bool region_set_rect(CompRegion *r, const CompRect *rect);
+bool region_union_rect(CompRegion *r, const CompRect *rect);
+bool region_union(CompRegion *dst, const CompRegion *a, const CompRegion *b);
+bool region_intersect(CompRegion *dst, const CompRegion *a, const CompRegion *b);
+bool region_subtract(CompRegion *dst, const CompRegion *a, const CompRegion *b);
+bool region_contains_rect(const CompRegion *r, const CompRect *rect);
+bool region_intersects_rect(const CompRegion *r, const CompRect *rect);
+void region_translate(CompRegion *r, int dx, int dy);
+bool region_tile(CompRegion *r, int tile);
+long long region_area(const CompRegion *r);
+
+/// Strategies of region_simplify
+enum {
+    REGION_SIMPLIFY_EXACT,
+    REGION_SIMPLIFY_TILED,
+    REGION_SIMPLIFY_BBOX,
+};
+
+/// If r has more than max_rects rects, replace it by its tiles or its
+/// bounding box, if that is cheaper, where each rect costs as much as
+/// rect_cost pixels. Returns the strategy used.
+int region_simplify(CompRegion *r, int max_rects, long long rect_cost,
+                    int tile);
+
+
+static inline bool rect_is_empty(const CompRect *r){
+    return r->x1 >= r->x2 || r->y1 >= r->y2;
+}
+
+static inline void rect_intersect(CompRect *dst, const CompRect *a,
+                                  const CompRect *b){
+    dst->x1 = a->x1 > b->x1 ? a->x1 : b->x1;
+    dst->y1 = a->y1 > b->y1 ? a->y1 : b->y1;
+    dst->x2 = a->x2 < b->x2 ? a->x2 : b->x2;
+    dst->y2 = a->y2 < b->y2 ? a->y2 : b->y2;
+}
 
+static inline bool region_is_empty(const CompRegion *r){
+    return r->n == 0;
+}
 
-bool rect_paint_needed(CompRect* ignore_reg, CompRect* reg);
+/// Empty r, but keep its memory for reuse.
+static inline void region_clear(CompRegion *r){
+    r->n = 0;
+    r->extents = (CompRect){0};
+}
@@ -12,29 +12,50 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <limits.h>
 #include <math.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/ipc.h>
 #include <sys/poll.h>
+#include <sys/shm.h>
 #include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
 #include <getopt.h>
 
 #include <X11/Xlib.h>
+#include <X11/Xlib-xcb.h>
 #include <X11/Xutil.h>
 #include <X11/Xatom.h>
 #include <X11/extensions/Xcomposite.h>
 #include <X11/extensions/Xdamage.h>
 #include <X11/extensions/Xrender.h>
+#include <X11/extensions/shape.h>
+#include <X11/Xmd.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/shmproto.h>
+#include <X11/extensions/Xrandr.h>
+#include <xcb/composite.h>
+#include <xcb/damage.h>
+#include <xcb/render.h>
+#include <xcb/shape.h>
 
 #include "cm-global.h"
 #include "cm-event.h"
+#include "cm-format.h"
 #include "cm-root.h"
+#include "cm-shadow.h"
+#include "cm-shadow-cache.h"
+#include "cm-stats.h"
 #include "cm-util.h"
 #include "cm-window.h"
+#include "cm-xcb.h"
 #include "comp_rect.h"
 #include "ringbuffer.h"
 
@@ -45,11 +66,6 @@ typedef struct _ignore {
 } ignore;
 
 
-typedef struct _conv {
-  int size;
-  double *data;
-} conv;
-
 typedef struct _fade {
   struct _fade *next;
   win *w;
@@ -68,19 +84,23 @@ Picture root_tile;
 XserverRegion all_damage;
 XserverRegion g_xregion_tmp;
 Bool all_damage_is_dirty;
-Bool clip_changed;
 #if HAS_NAME_WINDOW_PIXMAP
 Bool has_name_pixmap;
 #endif
 int xfixes_event, xfixes_error;
+Bool has_shape;
+int shape_event, shape_error;
+Bool has_shm;
+int shm_opcode;
 int damage_event, damage_error;
 int composite_event, composite_error;
 int render_event, render_error;
 Bool synchronize;
 int composite_opcode;
 static Bool g_paint_ignore_region_is_dirty = True;
+// Not only single windows (occlusion_dirty) changed
+static Bool g_paint_ignore_region_all_dirty = True;
 
-Atom win_type[NUM_WINTYPES];
 double win_type_opacity[NUM_WINTYPES];
 Bool win_type_shadow[NUM_WINTYPES];
 Bool win_type_fade[NUM_WINTYPES];
@@ -89,8 +109,6 @@ Bool win_type_fade[NUM_WINTYPES];
 
 #define OPAQUE 0xffffffff
 
-conv *gaussian_map;
-
 #define WINDOW_SOLID 0
 #define WINDOW_TRANS 1
 #define WINDOW_ARGB 2
@@ -104,11 +122,38 @@ conv *gaussian_map;
 #ifndef MONITOR_REPAINT
 #define MONITOR_REPAINT 0
 #endif
+// Print how long the server was grabbed at startup, when the first frame
+// was painted and when all windows were set up.
+#ifndef DEBUG_STARTUP
+#define DEBUG_STARTUP 0
+#endif
+
+// Cost model of simplify_damage, measured by tests/damage_bench
+#ifndef DAMAGE_RECT_COST
+#define DAMAGE_RECT_COST 40
+#endif
+#ifndef DAMAGE_TILE_SIZE
+#define DAMAGE_TILE_SIZE 16
+#endif
+
+// Memory of unused shadows kept for reuse, see ShadowCache
+#ifndef SHADOW_CACHE_BYTES
+#define SHADOW_CACHE_BYTES (16 << 20)
+#endif
+// Shadows of at least this many pixels are rasterized by shadow_worker, if
+// the resized window can show its previous shadow meanwhile.
+#ifndef SHADOW_ASYNC_PIXELS
+#define SHADOW_ASYNC_PIXELS (64 * 1024)
+#endif
+
+// Number of windows found at startup, which are set up per main loop
+// iteration, see startup_setup_batch.
+#define STARTUP_BATCH 64
 
 static void
 determine_mode(Display *dpy, win *w);
 static bool
-is_gtk_frame_extent(Display *dpy, Window w);
+is_gtk_frame_extent(Display *dpy, win *w);
 
 static double
 get_opacity_percent(Display *dpy, win *w);
@@ -116,9 +161,25 @@ static void
 do_configure_win(Display *dpy, win* w);
 static void
 set_paint_ignore_region_dirty(void);
+static void
+set_win_ignore_region_dirty(win *w);
 
 static XserverRegion
 win_extents(Display *dpy, win *w);
+static void
+win_setup(Display *dpy, win *w);
+static void
+win_suspend_damage(Display *dpy, win *w);
+static void
+win_resume_damage(Display *dpy, win *w);
+static bool
+win_has_shadow(win *w);
+static void
+win_free_shadow(Display *dpy, win *w);
+static void
+add_damage(Display *dpy, XserverRegion damage);
+
+int damage_max_rects = 256;
 
 int shadow_radius = 12;
 int shadow_offset_x = -15;
@@ -143,12 +204,6 @@ double frame_opacity = 0;
 
 #define HAS_FRAME_OPACITY(w) (frame_opacity && (w)->top_width)
 
-/* For shadow precomputation */
-int Gsize = -1;
-unsigned char *shadow_corner = NULL;
-unsigned char *shadow_top = NULL;
-
-
 fade *
 find_fade(win *w) {
   fade *f;
@@ -234,10 +289,9 @@ set_fade(Display *dpy, win *w, double start,
 
   determine_mode(dpy, w);
 
-  if (w->shadow) {
+  if (win_has_shadow(w)) {
     // rebuild the shadow
-    XRenderFreePicture(dpy, w->shadow);
-    w->shadow = None;
+    win_free_shadow(dpy, w);
     win_extents(dpy, w);
   }
 
@@ -312,10 +366,9 @@ run_fades(Display *dpy) {
 
     determine_mode(dpy, w);
 
-    if (w->shadow) {
+    if (win_has_shadow(w)) {
       // rebuild the shadow
-      XRenderFreePicture(dpy, w->shadow);
-      w->shadow = None;
+      win_free_shadow(dpy, w);
       win_extents(dpy, w);
     }
 
@@ -327,358 +380,541 @@ run_fades(Display *dpy) {
   fade_time = now + fade_delta;
 }
 
-static double
-gaussian(double r, double x, double y) {
-  return ((1 / (sqrt(2 * M_PI * r))) *
-      exp((- (x * x + y * y)) / (2 * r * r)));
+// An XShmPutImage, which may still read the arena from start on
+typedef struct {
+  size_t start;
+  unsigned long sequence;
+} A8Put;
+
+ringBuffer_typedef(A8Put, A8PutRingbuf);
+
+// Grow-only memory of a8_image. With MIT-SHM, it is a shared memory segment,
+// so images are uploaded without copying them through the socket. Then it is
+// used as a ring: each image starts behind the previous one, so reusing the
+// memory only waits for the server, if it wraps around onto a put the server
+// has not processed yet.
+static struct {
+  char *data;
+  size_t size;
+  size_t head; // where the next image starts
+  bool shm;
+  XShmSegmentInfo shminfo;
+  A8PutRingbuf puts; // pending puts, oldest first
+} a8_arena;
+
+// Scanline pad of depth 8 images in bits, as the server expects them. Set at
+// startup, from then on read-only, so shadow_worker may read it as well.
+static int a8_scanline_pad = 32;
+
+/// Bytes per line of a depth 8 image. XShmPutImage does not send it, so
+/// images in the arena have to be padded as the server reads them.
+static size_t
+a8_stride(int width) {
+  return (size_t) (width + a8_scanline_pad / 8 - 1) / (a8_scanline_pad / 8)
+         * (a8_scanline_pad / 8);
 }
 
+/// Take a8_scanline_pad from the pixmap formats of the server.
+static void
+a8_init_pad(Display *dpy) {
+  XPixmapFormatValues *formats;
+  int i, n;
+
+  formats = XListPixmapFormats(dpy, &n);
+  if (!formats) return;
+  for (i = 0; i < n; i++) {
+    if (formats[i].depth == 8 && formats[i].scanline_pad >= 8) {
+      a8_scanline_pad = formats[i].scanline_pad;
+    }
+  }
+  XFree(formats);
+}
 
-static conv *
-make_gaussian_map(Display *dpy, double r) {
-  conv *c;
-  int size = ((int) ceil((r * 3)) + 1) & ~1;
-  int center = size / 2;
-  int x, y;
-  double t;
-  double g;
+// Images, which fit into the ring at once, unless they are larger
+#define A8_ARENA_RING 4
+#define A8_ARENA_MIN (1 << 20)
 
-  c = malloc(sizeof(conv) + size * size * sizeof(double));
-  c->size = size;
-  c->data = (double *) (c + 1);
-  t = 0.0;
+static void
+a8_arena_free(Display *dpy) {
+  if (a8_arena.shm) {
+    // The server processes the detach after all puts from the segment
+    XShmDetach(dpy, &a8_arena.shminfo);
+    shmdt(a8_arena.shminfo.shmaddr);
+    a8_arena.shm = false;
+    a8_arena.puts.start = a8_arena.puts.end = 0;
+  } else {
+    free(a8_arena.data);
+  }
+  a8_arena.data = NULL;
+  a8_arena.size = 0;
+  a8_arena.head = 0;
+}
 
-  for (y = 0; y < size; y++) {
-    for (x = 0; x < size; x++) {
-      g = gaussian(r, (double) (x - center), (double) (y - center));
-      t += g;
-      c->data[y * size + x] = g;
+/// Attach a new shared memory segment of size bytes as arena. Returns false,
+/// if the server cannot attach it, e.g. if it runs on another host.
+static bool
+a8_arena_shm(Display *dpy, size_t size) {
+  XShmSegmentInfo *si = &a8_arena.shminfo;
+
+  if (!a8_arena.puts.elems) {
+    bufferInit(a8_arena.puts, 64, A8Put);
+    if (!a8_arena.puts.elems) return false;
+  }
+  si->shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
+  if (si->shmid < 0) return false;
+  si->shmaddr = shmat(si->shmid, NULL, 0);
+  // Removed, once both sides are detached
+  shmctl(si->shmid, IPC_RMID, NULL);
+  if (si->shmaddr == (char *) -1) return false;
+  si->readOnly = True;
+
+  // error() clears has_shm, if the attach fails
+  XShmAttach(dpy, si);
+  XSync(dpy, False);
+  if (!has_shm) {
+    fprintf(stderr, "info: MIT-SHM unusable, uploading shadows by XPutImage.\n");
+    shmdt(si->shmaddr);
+    return false;
+  }
+  a8_arena.data = si->shmaddr;
+  a8_arena.size = size;
+  a8_arena.shm = true;
+  return true;
+}
+
+/// Find size bytes in the ring, which no pending put reads, at *offset.
+static bool
+a8_arena_ring_fit(size_t size, size_t *offset) {
+  A8PutRingbuf *puts = &a8_arena.puts;
+  size_t head = a8_arena.head;
+  size_t tail;
+
+  if (isBufferEmpty(puts)) {
+    *offset = 0;
+    return true;
+  }
+  if (isBufferFull(puts)) return false;
+
+  // Pending puts read from tail to head. Images never end exactly at tail,
+  // so head == tail would be ambiguous.
+  tail = bufferReadPeek(puts).start;
+  if (head > tail) {
+    if (a8_arena.size - head >= size) {
+      *offset = head;
+      return true;
     }
+    head = 0;
   }
+  if (head + size < tail) {
+    *offset = head;
+    return true;
+  }
+  return false;
+}
 
-/*  printf("gaussian total %f\n", t); */
-
-  for (y = 0; y < size; y++) {
-    for (x = 0; x < size; x++) {
-      c->data[y * size + x] /= t;
+/// Make the arena hold size bytes at *offset, which the server does not read
+/// anymore.
+static bool
+a8_arena_reserve(Display *dpy, size_t size, size_t *offset) {
+  A8PutRingbuf *puts = &a8_arena.puts;
+
+  if (unlikely(size > a8_arena.size)) {
+    size_t want = size;
+
+    if (has_shm && want < A8_ARENA_RING * size) want = A8_ARENA_RING * size;
+    if (has_shm && want < A8_ARENA_MIN) want = A8_ARENA_MIN;
+    if (want < 2 * a8_arena.size) want = 2 * a8_arena.size;
+    want = (want + 4095) & ~(size_t)4095;
+
+    a8_arena_free(dpy);
+    if (!(has_shm && a8_arena_shm(dpy, want))) {
+      a8_arena.data = malloc(want);
+      if (!a8_arena.data) return false;
+      a8_arena.size = want;
     }
   }
+  if (!a8_arena.shm) {
+    // Xlib copies the image into its buffer, so the arena is always free
+    *offset = 0;
+    return true;
+  }
 
-  return c;
+  while (!isBufferEmpty(puts) &&
+         bufferReadPeek(puts).sequence <= LastKnownRequestProcessed(dpy)) {
+    bufferReadSkip(puts);
+  }
+  if (unlikely(!a8_arena_ring_fit(size, offset))) {
+    // Wrapped around onto pending puts
+    XSync(dpy, False);
+    STAT_INC(shm_syncs);
+    puts->start = puts->end = 0;
+    *offset = 0;
+  }
+  a8_arena.head = *offset + size;
+  return true;
 }
 
-/*
- * A picture will help
- *
- *      -center   0                width  width+center
- *  -center +-----+-------------------+-----+
- *          |     |                   |     |
- *          |     |                   |     |
- *        0 +-----+-------------------+-----+
- *          |     |                   |     |
- *          |     |                   |     |
- *          |     |                   |     |
- *   height +-----+-------------------+-----+
- *          |     |                   |     |
- * height+  |     |                   |     |
- *  center  +-----+-------------------+-----+
- */
+/// Returns an uninitialized A8 image in the arena. It stays valid until the
+/// next call, so it has to be uploaded by a8_picture before.
+static XImage *
+a8_image(Display *dpy, int width, int height) {
+  static XImage ximage;
+  size_t stride = a8_stride(width);
+  size_t offset;
+
+  if (!a8_arena_reserve(dpy, stride * height, &offset)) return 0;
+
+  memset(&ximage, 0, sizeof(ximage));
+  ximage.width = width;
+  ximage.height = height;
+  ximage.format = ZPixmap;
+  ximage.data = a8_arena.data + offset;
+  ximage.byte_order = ImageByteOrder(dpy);
+  ximage.bitmap_unit = BitmapUnit(dpy);
+  ximage.bitmap_bit_order = BitmapBitOrder(dpy);
+  ximage.bitmap_pad = a8_scanline_pad;
+  ximage.depth = 8;
+  ximage.bytes_per_line = stride;
+  ximage.bits_per_pixel = 8;
+  ximage.obdata = a8_arena.shm ? (char *) &a8_arena.shminfo : NULL;
+  if (!XInitImage(&ximage)) return 0;
+  return &ximage;
+}
 
-static unsigned char
-sum_gaussian(conv *map, double opacity,
-             int x, int y, int width, int height) {
-  int fx, fy;
-  double *g_data;
-  double *g_line = map->data;
-  int g_size = map->size;
-  int center = g_size / 2;
-  int fx_start, fx_end;
-  int fy_start, fy_end;
-  double v;
+/// shadow_raster of the given type. Only reads tables and options set up at
+/// startup, so shadow_worker may call it as well.
+static void
+shadow_raster_type(unsigned char *data, size_t stride, double opacity,
+                   int width, int height, shadowtype shadow_type) {
+  shadow_raster(data, stride, opacity, width, height);
+  switch (shadow_type) {
+  case SHADOW_UNKNOWN:
+  case SHADOW_NO: assert(false);
+  case SHADOW_FULL: break;
+  case SHADOW_NOCENTER:
+    shadow_clear_center(data, stride, width, height,
+                        shadow_offset_x, shadow_offset_y);
+  }
+}
 
-  /*
-   * Compute set of filter values which are "in range",
-   * that's the set with:
-   *    0 <= x + (fx-center) && x + (fx-center) < width &&
-   *  0 <= y + (fy-center) && y + (fy-center) < height
-   *
-   *  0 <= x + (fx - center)    x + fx - center < width
-   *  center - x <= fx    fx < width + center - x
-   */
+static XImage *
+make_shadow(Display *dpy, double opacity,
+            int width, int height, shadowtype shadow_type) {
+  XImage *ximage;
 
-  fx_start = center - x;
-  if (fx_start < 0) fx_start = 0;
-  fx_end = width + center - x;
-  if (fx_end > g_size) fx_end = g_size;
+  ximage = a8_image(dpy, width + gaussian_map->size,
+                    height + gaussian_map->size);
+  if (!ximage) return 0;
+  shadow_raster_type((unsigned char *) ximage->data, ximage->bytes_per_line,
+                     opacity, width, height, shadow_type);
+  return ximage;
+}
 
-  fy_start = center - y;
-  if (fy_start < 0) fy_start = 0;
-  fy_end = height + center - y;
-  if (fy_end > g_size) fy_end = g_size;
+/// Upload the A8 image of a8_image into a new picture.
+static Picture
+a8_picture(Display *dpy, XImage *shadowImage, Bool repeat) {
+  static GC gc; // for all depth 8 pixmaps
+  XRenderPictureAttributes pa;
+  Pixmap shadowPixmap;
+  Picture shadow_picture;
 
-  g_line = g_line + fy_start * g_size + fx_start;
+  shadowPixmap = XCreatePixmap(dpy, root,
+    shadowImage->width, shadowImage->height, 8);
 
-  v = 0;
+  if (!shadowPixmap) {
+    return None;
+  }
 
-  for (fy = fy_start; fy < fy_end; fy++) {
-    g_data = g_line;
-    g_line += g_size;
+  pa.repeat = repeat;
+  shadow_picture = XRenderCreatePicture(dpy, shadowPixmap,
+    format_standard(PictStandardA8), CPRepeat, &pa);
+  if (!shadow_picture) {
+    XFreePixmap(dpy, shadowPixmap);
+    return None;
+  }
 
-    for (fx = fx_start; fx < fx_end; fx++) {
-      v += *g_data++;
+  if (unlikely(!gc)) {
+    gc = XCreateGC(dpy, shadowPixmap, 0, 0);
+    if (!gc) {
+      XFreePixmap(dpy, shadowPixmap);
+      XRenderFreePicture(dpy, shadow_picture);
+      return None;
     }
   }
 
-  if (v > 1) v = 1;
-
-  return ((unsigned char) (v * opacity * 255.0));
-}
-
-/* precompute shadow corners and sides
-   to save time for large windows */
-static void
-presum_gaussian(conv *map) {
-  int center = map->size/2;
-  int opacity, x, y;
-
-  Gsize = map->size;
-
-  if (shadow_corner) free((void *)shadow_corner);
-  if (shadow_top) free((void *)shadow_top);
+  if (a8_arena.shm) {
+    A8Put put = { shadowImage->data - a8_arena.data, NextRequest(dpy) };
+    bufferWrite(&a8_arena.puts, put);
+    XShmPutImage(
+      dpy, shadowPixmap, gc, shadowImage, 0, 0, 0, 0,
+      shadowImage->width, shadowImage->height, False);
+    STAT_INC(shm_uploads);
+  } else {
+    // Xlib copies the image into its buffer, so the arena is free again
+    XPutImage(
+      dpy, shadowPixmap, gc, shadowImage, 0, 0, 0, 0,
+      shadowImage->width, shadowImage->height);
+  }
 
-  shadow_corner = (unsigned char *)(malloc((Gsize + 1) * (Gsize + 1) * 26));
-  shadow_top = (unsigned char *)(malloc((Gsize + 1) * 26));
+  XFreePixmap(dpy, shadowPixmap);
 
-  for (x = 0; x <= Gsize; x++) {
-    shadow_top[25 * (Gsize + 1) + x] =
-      sum_gaussian(map, 1, x - center, center, Gsize * 2, Gsize * 2);
+  return shadow_picture;
+}
 
-    for (opacity = 0; opacity < 25; opacity++) {
-      shadow_top[opacity * (Gsize + 1) + x] =
-        shadow_top[25 * (Gsize + 1) + x] * opacity / 25;
-    }
+static Picture
+shadow_picture(Display *dpy, double opacity, shadowtype shadow_type,
+               int width, int height, int *wp, int *hp) {
+  XImage *shadowImage;
+  Picture picture;
 
-    for (y = 0; y <= x; y++) {
-      shadow_corner[25 * (Gsize + 1) * (Gsize + 1) + y * (Gsize + 1) + x]
-        = sum_gaussian(map, 1, x - center, y - center, Gsize * 2, Gsize * 2);
-      shadow_corner[25 * (Gsize + 1) * (Gsize + 1) + x * (Gsize + 1) + y]
-        = shadow_corner[25 * (Gsize + 1) * (Gsize + 1) + y * (Gsize + 1) + x];
+  shadowImage = make_shadow(dpy, opacity, width, height, shadow_type);
+  if (!shadowImage) return None;
 
-      for (opacity = 0; opacity < 25; opacity++) {
-        shadow_corner[opacity * (Gsize + 1) * (Gsize + 1)
-                      + y * (Gsize + 1) + x]
-          = shadow_corner[opacity * (Gsize + 1) * (Gsize + 1)
-                          + x * (Gsize + 1) + y]
-          = shadow_corner[25 * (Gsize + 1) * (Gsize + 1)
-                          + y * (Gsize + 1) + x] * opacity / 25;
-      }
-    }
+  *wp = shadowImage->width;
+  *hp = shadowImage->height;
+  picture = a8_picture(dpy, shadowImage, False);
+  if (picture) {
+    STAT_INC(shadow_rasters);
   }
+  return picture;
 }
 
-/// Make that part of the shadow transparent that is immediately below its window
-static void make_transparent_shadowcenter(int width, int height, int swidth, int sheight,
-                                          unsigned char *data){
-  int ylimit;
-  int x, y;
-  int x_diff;
-
-  if(shadow_offset_x < 0){
-    x = -shadow_offset_x;
-    if(swidth - x < width){
-      x_diff = swidth-x;
-    } else {
-      x_diff = width;
+static ShadowCache shadow_cache;
+
+/// Rasterizes shadows of shadow_cache off the main thread, so resizing a
+/// window does not stall events and painting. Finished ones are uploaded by
+/// shadow_worker_collect, once the pipe wakes up the main loop.
+static struct {
+  int pipe[2];
+  bool running;
+} shadow_worker = {
+  .pipe = { -1, -1 },
+};
+
+static void *
+shadow_worker_run(void *arg) {
+  (void) arg;
+  for (;;) {
+    ShadowEntry *e = shadow_cache_take_job(&shadow_cache);
+    // Padded like a8_image, so it is copied as a whole
+    size_t size = a8_stride(e->swidth) * e->sheight;
+
+    if (e->data_size < size) {
+      free(e->data);
+      e->data = malloc(size);
+      e->data_size = e->data ? size : 0;
     }
-  } else {
-    x = 0;
-    x_diff = width - shadow_offset_x;
-  }
-
-  if(shadow_offset_y < 0){
-    y = -shadow_offset_y;
-    if(sheight - y < height){
-      ylimit = sheight;
-    } else {
-      ylimit = height + y;
+    if (e->data) {
+      shadow_raster_type(e->data, a8_stride(e->swidth), e->opacity,
+                         e->width, e->height, e->type);
     }
-  } else {
-    y = 0;
-    ylimit = height - shadow_offset_y;
-  }
 
-  if(likely(x_diff > 0)){
-    assert(y >=0);
-    assert(ylimit <= sheight);
-    assert(x >=0 && x < swidth);
-    assert(x+x_diff <= swidth);
-    for(; y < ylimit ; y++){
-      memset(&data[y * swidth + x], 0, x_diff);
+    if (shadow_cache_finish_job(&shadow_cache, e)) {
+      while (write(shadow_worker.pipe[1], "", 1) < 0 && errno == EINTR);
     }
   }
+  return NULL;
 }
 
-static XImage *
-make_shadow(Display *dpy, double opacity,
-            int width, int height, shadowtype shadow_type) {
-  XImage *ximage;
-  unsigned char *data;
-  int gsize = gaussian_map->size;
-  int ylimit, xlimit;
-  int swidth = width + gsize;
-  int sheight = height + gsize;
-  int center = gsize / 2;
-  int x, y;
-  unsigned char d;
-  int x_diff;
-  int opacity_int = (int)(opacity * 25);
-
-  data = malloc(swidth * sheight * sizeof(unsigned char));
-  if (!data) return 0;
-
-  ximage = XCreateImage(
-    dpy, DefaultVisual(dpy, DefaultScreen(dpy)), 8,
-    ZPixmap, 0, (char *) data, swidth, sheight, 8,
-    swidth * sizeof(unsigned char));
-
-  if (!ximage) {
-    free(data);
-    return 0;
-  }
-
-  /*
-   * Build the gaussian in sections
-   */
-
-  /*
-   * center (fill the complete data array)
-   */
-
-  if (Gsize > 0) {
-    d = shadow_top[opacity_int * (Gsize + 1) + Gsize];
-  } else {
-    d = sum_gaussian(gaussian_map,
-      opacity, center, center, width, height);
+/// Start shadow_worker. Without it, all shadows are rasterized in place.
+static void
+shadow_worker_init(void) {
+  pthread_t thread;
+
+  if (pipe(shadow_worker.pipe) < 0) return;
+  fcntl(shadow_worker.pipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(shadow_worker.pipe[0], F_SETFD, FD_CLOEXEC);
+  fcntl(shadow_worker.pipe[1], F_SETFD, FD_CLOEXEC);
+  if (pthread_create(&thread, NULL, shadow_worker_run, NULL) != 0) {
+    close(shadow_worker.pipe[0]);
+    close(shadow_worker.pipe[1]);
+    shadow_worker.pipe[0] = shadow_worker.pipe[1] = -1;
+    return;
   }
+  pthread_detach(thread);
+  shadow_worker.running = true;
+}
 
-  memset(data, d, sheight * swidth);
+static void
+shadow_free_picture(Picture picture) {
+  XRenderFreePicture(dpy, picture);
+}
 
-  /*
-   * corners
-   */
+/// Returns a referenced shadow of a width x height window, rasterized only
+/// if it is not cached yet, or NULL on failure. With async, large shadows are
+/// left to shadow_worker, so their picture is None until it is done.
+static ShadowEntry *
+shadow_cache_get(Display *dpy, double opacity, shadowtype type,
+                 int width, int height, bool async) {
+  ShadowEntry *e;
+  Picture picture = None;
+  int swidth = width + gaussian_map->size;
+  int sheight = height + gaussian_map->size;
+
+  e = shadow_cache_find(&shadow_cache, opacity, type, width, height);
+  if (e) return e;
+
+  if (!async || !shadow_worker.running ||
+      (long)swidth * sheight < SHADOW_ASYNC_PIXELS) {
+    picture = shadow_picture(dpy, opacity, type, width, height,
+                             &swidth, &sheight);
+    if (!picture) return NULL;
+  }
+  e = shadow_cache_add(&shadow_cache, opacity, type, width, height,
+                       swidth, sheight, picture);
+  if (!e && picture) XRenderFreePicture(dpy, picture);
+  return e;
+}
 
-  ylimit = gsize;
-  if (ylimit > sheight / 2) ylimit = (sheight + 1) / 2;
+/// Shared patches of the shadows of windows at least Gsize wide and high
+typedef struct _shadow_patch {
+  Picture pictures[SHADOW_PATCHES];
+} ShadowPatch;
+
+static ShadowPatch shadow_patches[SHADOW_LEVELS];
+
+/// Returns the shared patches of the shadow of a width x height window, or
+/// NULL, if the window is too small, so its corners overlap and need to be
+/// computed by make_shadow.
+static const ShadowPatch *
+shadow_patch_get(Display *dpy, double opacity, int width, int height) {
+  int level = shadow_patch_level(opacity, width, height);
+  ShadowPatch *p;
+  XImage *img;
+  int i;
 
-  xlimit = gsize;
-  if (xlimit > swidth / 2) xlimit = (swidth + 1) / 2;
+  if (level < 0) return NULL;
+  p = &shadow_patches[level];
+  if (likely(p->pictures[SHADOW_PATCH_CORNERS])) return p;
 
-  for (y = 0; y < ylimit; y++)
-    for (x = 0; x < xlimit; x++) {
-      if (xlimit == Gsize && ylimit == Gsize) {
-        d = shadow_corner[opacity_int * (Gsize + 1) * (Gsize + 1)
-                          + y * (Gsize + 1) + x];
-      } else {
-        d = sum_gaussian(gaussian_map,
-          opacity, x - center, y - center, width, height);
-      }
-      data[y * swidth + x] = d;
-      data[(sheight - y - 1) * swidth + x] = d;
-      data[(sheight - y - 1) * swidth + (swidth - x - 1)] = d;
-      data[y * swidth + (swidth - x - 1)] = d;
-    }
-
-  /*
-   * top/bottom
-   */
+  for (i = 0; i < SHADOW_PATCHES; i++) {
+    int pw, ph;
 
-  x_diff = swidth - (gsize * 2);
-  if (x_diff > 0 && ylimit > 0) {
-    for (y = 0; y < ylimit; y++) {
-      if (ylimit == Gsize) {
-        d = shadow_top[opacity_int * (Gsize + 1) + y];
-      } else {
-        d = sum_gaussian(gaussian_map,
-          opacity, center, y - center, width, height);
-      }
-      memset(&data[y * swidth + gsize], d, x_diff);
-      memset(&data[(sheight - y - 1) * swidth + gsize], d, x_diff);
-    }
+    shadow_patch_size(i, &pw, &ph);
+    if (!(img = a8_image(dpy, pw, ph))) break;
+    shadow_patch_raster((unsigned char *) img->data, img->bytes_per_line,
+                        level, i);
+    // All but the corners repeat
+    p->pictures[i] = a8_picture(dpy, img, i != SHADOW_PATCH_CORNERS);
+    if (!p->pictures[i]) break;
   }
 
-  /*
-   * sides
-   */
-
-  for (x = 0; x < xlimit; x++) {
-    if (xlimit == Gsize) {
-      d = shadow_top[opacity_int * (Gsize + 1) + x];
-    } else {
-      d = sum_gaussian(gaussian_map,
-        opacity, x - center, center, width, height);
-    }
-    for (y = gsize; y < sheight - gsize; y++) {
-      data[y * swidth + x] = d;
-      data[y * swidth + (swidth - x - 1)] = d;
+  if (i < SHADOW_PATCHES) {
+    for (i = 0; i < SHADOW_PATCHES; i++) {
+      if (p->pictures[i]) XRenderFreePicture(dpy, p->pictures[i]);
     }
+    memset(p, 0, sizeof(*p));
+    return NULL;
   }
+  return p;
+}
 
-  switch (shadow_type) {
-  case SHADOW_UNKNOWN:
-  case SHADOW_NO: assert(false);
-  case SHADOW_FULL: break;
-  case SHADOW_NOCENTER:
-    make_transparent_shadowcenter(width, height, swidth, sheight, data);
+/// Paint a width x height shadow at x, y from its patches in nine parts.
+static void
+shadow_patch_paint(Display *dpy, const ShadowPatch *p, Picture dst,
+                   int x, int y, int width, int height) {
+  shadow_part parts[9];
+  int i, n;
+
+  n = shadow_parts(parts, width, height);
+  for (i = 0; i < n; i++) {
+    XRenderComposite(dpy, PictOpOver, cshadow_picture,
+      p->pictures[parts[i].kind], dst,
+      0, 0, parts[i].mask_x, parts[i].mask_y,
+      x + parts[i].x, y + parts[i].y, parts[i].width, parts[i].height);
   }
-  return ximage;
 }
 
-static Picture
-shadow_picture(Display *dpy, double opacity, shadowtype shadow_type,
-               int width, int height, int *wp, int *hp) {
-  XImage *shadowImage;
-  Pixmap shadowPixmap;
-  Picture shadow_picture;
-  GC gc;
-
-  shadowImage = make_shadow(dpy, opacity, width, height, shadow_type);
-  if (!shadowImage) return None;
+static bool
+win_has_shadow(win *w) {
+  return w->shadow_entry || w->shadow_patch;
+}
 
-  shadowPixmap = XCreatePixmap(dpy, root,
-    shadowImage->width, shadowImage->height, 8);
+/// Drop the reference of w to its shadow_entry, and stop waiting for it.
+static void
+win_put_shadow_entry(win *w) {
+  win **pp = &w->shadow_entry->waiters;
+
+  while (*pp && *pp != w) pp = &(*pp)->shadow_waiter_next;
+  if (*pp) *pp = w->shadow_waiter_next;
+  w->shadow_waiter_next = NULL;
+  shadow_cache_put(&shadow_cache, w->shadow_entry);
+  w->shadow_entry = NULL;
+}
 
-  if (!shadowPixmap) {
-    XDestroyImage(shadowImage);
-    return None;
+/// Drop the shadow of w, so win_extents builds a new one.
+static void
+win_free_shadow(Display *dpy, win *w) {
+  if (w->shadow_entry) {
+    win_put_shadow_entry(w);
   }
-
-  shadow_picture = XRenderCreatePicture(dpy, shadowPixmap,
-    XRenderFindStandardFormat(dpy, PictStandardA8), 0, 0);
-  if (!shadow_picture) {
-    XDestroyImage(shadowImage);
-    XFreePixmap(dpy, shadowPixmap);
-    return None;
+  if (w->shadow_stale) {
+    shadow_cache_put(&shadow_cache, w->shadow_stale);
+    w->shadow_stale = NULL;
   }
+  w->shadow = None;
+  w->shadow_patch = NULL;
+}
 
-  gc = XCreateGC(dpy, shadowPixmap, 0, 0);
-  if (!gc) {
-    XDestroyImage(shadowImage);
-    XFreePixmap(dpy, shadowPixmap);
-    XRenderFreePicture(dpy, shadow_picture);
-    return None;
+/// Like win_free_shadow, but keep painting the current shadow, until the
+/// one of the new size is rasterized by shadow_worker.
+static void
+win_stale_shadow(Display *dpy, win *w) {
+  if (w->shadow_entry && w->shadow_entry->picture) {
+    if (w->shadow_stale) shadow_cache_put(&shadow_cache, w->shadow_stale);
+    w->shadow_stale = w->shadow_entry;
+  } else if (w->shadow_entry) {
+    // Still pending, keep the older one
+    win_put_shadow_entry(w);
+  }
+  w->shadow_entry = NULL;
+  w->shadow_patch = NULL;
+}
+
+/// Paint the shadow_entry of w from now on, instead of its stale shadow.
+static void
+win_shadow_ready(Display *dpy, win *w) {
+  if (w->shadow_stale) {
+    shadow_cache_put(&shadow_cache, w->shadow_stale);
+    w->shadow_stale = NULL;
   }
+  w->shadow = w->shadow_entry ? w->shadow_entry->picture : None;
+}
 
-  XPutImage(
-    dpy, shadowPixmap, gc, shadowImage, 0, 0, 0, 0,
-    shadowImage->width, shadowImage->height);
+/// Upload the shadows finished by shadow_worker and swap them in.
+static void
+shadow_worker_collect(Display *dpy) {
+  char buf[64];
+  ShadowEntry *e, *next;
+  win *w, *wnext;
+
+  while (read(shadow_worker.pipe[0], buf, sizeof(buf)) > 0);
+
+  for (e = shadow_cache_take_done(&shadow_cache); e; e = next) {
+    next = e->job_next;
+    if (e->data) {
+      XImage *img = a8_image(dpy, e->swidth, e->sheight);
+      if (img) {
+        memcpy(img->data, e->data, (size_t) img->bytes_per_line * e->sheight);
+        e->picture = a8_picture(dpy, img, False);
+        if (e->picture) {
+          STAT_INC(shadow_rasters);
+        }
+      }
+    }
 
-  *wp = shadowImage->width;
-  *hp = shadowImage->height;
-  XFreeGC(dpy, gc);
-  XDestroyImage(shadowImage);
-  XFreePixmap(dpy, shadowPixmap);
+    for (w = e->waiters; w; w = wnext) {
+      wnext = w->shadow_waiter_next;
+      w->shadow_waiter_next = NULL;
+      win_shadow_ready(dpy, w);
+      if (w->extents) {
+        add_damage(dpy, w->extents);
+      }
+    }
 
-  return shadow_picture;
+    e->waiters = NULL;
+    shadow_cache_ready(&shadow_cache, e);
+  }
 }
 
 Picture
@@ -695,8 +931,7 @@ solid_picture(Display *dpy, Bool argb, double a,
 
   pa.repeat = True;
   picture = XRenderCreatePicture(dpy, pixmap,
-    XRenderFindStandardFormat(dpy, argb
-      ? PictStandardARGB32 : PictStandardA8),
+    format_standard(argb ? PictStandardARGB32 : PictStandardA8),
     CPRepeat,
     &pa);
 
@@ -732,7 +967,7 @@ paint_root(Display *dpy) {
 static shadowtype shadow_find_type(win *w){
   if(unlikely(!w->window_type) ||
      ! win_type_shadow[w->window_type] ||
-     is_gtk_frame_extent(dpy, w->id)){
+     is_gtk_frame_extent(dpy, w)){
     return SHADOW_NO;
   }
   if (w->mode == WINDOW_SOLID && ! w->a.override_redirect) {
@@ -753,8 +988,8 @@ static shadowtype shadow_find_type(win *w){
   // at the borders but not directly below the window. Examples include:
   // * transparent terminals (ARGB): a center-shadow would make the font less readable
   // * zoom's screen-share (override_redirect): a center-shadow darkens the whole desktop.
-  //   Note: currently, we do not track whether a window makes use of the XShape extension.
-  //         zoom does, so in the future we may use that instead.
+  //   Note: zoom also sets a bounding shape (w->bounding_shaped), so in the
+  //         future we may use that instead.
   return SHADOW_NOCENTER;
 
 }
@@ -789,7 +1024,7 @@ win_extents(Display *dpy, win *w) {
     w->shadow_dx = shadow_offset_x;
     w->shadow_dy = shadow_offset_y;
 
-    if (!w->shadow) {
+    if (!win_has_shadow(w)) {
       double opacity = shadow_opacity;
 
       if (w->mode != WINDOW_SOLID) {
@@ -800,11 +1035,27 @@ win_extents(Display *dpy, win *w) {
         opacity = opacity * frame_opacity;
       }
 
-      w->shadow = shadow_picture(
-        dpy, opacity, w->shadow_type,
-        w->a.width + w->a.border_width * 2,
-        w->a.height + w->a.border_width * 2,
-        &w->shadow_width, &w->shadow_height);
+      int width = w->a.width + w->a.border_width * 2;
+      int height = w->a.height + w->a.border_width * 2;
+      w->shadow_patch = shadow_patch_get(dpy, opacity, width, height);
+      if (w->shadow_patch) {
+        w->shadow_width = width + Gsize;
+        w->shadow_height = height + Gsize;
+      } else {
+        w->shadow_entry = shadow_cache_get(
+          dpy, opacity, w->shadow_type, width, height, w->shadow_stale != NULL);
+        if (w->shadow_entry) {
+          w->shadow_width = w->shadow_entry->swidth;
+          w->shadow_height = w->shadow_entry->sheight;
+        }
+      }
+      if (!w->shadow_entry || w->shadow_entry->picture) {
+        win_shadow_ready(dpy, w);
+      } else {
+        // until shadow_worker_collect uploads it
+        w->shadow_waiter_next = w->shadow_entry->waiters;
+        w->shadow_entry->waiters = w;
+      }
     }
 
     sr.x = w->a.x + w->shadow_dx;
@@ -835,85 +1086,114 @@ win_extents(Display *dpy, win *w) {
   } else {
     XFixesSetRegion(dpy, w->extents, &r, 1);
   }
+  w->extents_dirty = false;
   return w->extents;
 
 }
 
-static XserverRegion
+/// Set w->border_size to the bounding shape of w on screen. The shape is
+/// fetched from the server once and cached, until the window is resized or
+/// reshaped (ShapeNotify).
+static void
 border_size(Display *dpy, win *w) {
-  XserverRegion border;
-
-  /*
-   * if window doesn't exist anymore,  this will generate an error
-   * as well as not generate a region.  Perhaps a better XFixes
-   * architecture would be to have a request that copies instead
-   * of creates, that way you'd just end up with an empty region
-   * instead of an invalid XID.
-   */
+  if (!w->shape_valid) {
+    // The default bounding shape, relative to the window's origin
+    CompRect unshaped = { .x1 = -w->a.border_width, .y1 = -w->a.border_width,
+                          .x2 = w->a.width + w->a.border_width,
+                          .y2 = w->a.height + w->a.border_width };
+    xcb_shape_get_rectangles_reply_t *reply = NULL;
+
+    region_clear(&w->shape);
+    if (has_shape) {
+      // If the window does not exist anymore, this returns an error and no
+      // region.
+      xcb_generic_error_t *err = NULL;
+      reply = xcb_shape_get_rectangles_reply(g_xcb,
+        xcb_shape_get_rectangles(g_xcb, w->id, XCB_SHAPE_SK_BOUNDING), &err);
+      free(err);
+      STAT_INC(shape_fetches);
+    } else {
+      region_set_rect(&w->shape, &unshaped);
+    }
 
-  set_ignore(dpy, NextRequest(dpy));
-  border = XFixesCreateRegionFromWindow(
-    dpy, w->id, WindowRegionBounding);
+    if (reply) {
+      xcb_rectangle_t *rects = xcb_shape_get_rectangles_rectangles(reply);
+      int n = xcb_shape_get_rectangles_rectangles_length(reply);
+      for (int i = 0; i < n; i++) {
+        CompRect r = { .x1 = rects[i].x, .y1 = rects[i].y,
+                       .x2 = rects[i].x + rects[i].width,
+                       .y2 = rects[i].y + rects[i].height };
+        region_union_rect(&w->shape, &r);
+      }
+      free(reply);
+    }
+    w->bounding_shaped = w->shape.n != 1 ||
+      memcmp(&w->shape.extents, &unshaped, sizeof(unshaped)) != 0;
+    w->shape_valid = true;
+  }
 
   /* translate this */
-  set_ignore(dpy, NextRequest(dpy));
-  XFixesTranslateRegion(dpy, border,
+  region_copy(&w->border_size, &w->shape);
+  region_translate(&w->border_size,
     w->a.x + w->a.border_width,
     w->a.y + w->a.border_width);
-
-  return border;
 }
 
-static Window
-find_client_win(Display *dpy, Window win) {
-  Window root, parent;
-  Window *children;
-  unsigned int nchildren;
-  unsigned int i;
-  Window client = 0;
-
-  if(win_is_client(win)){
-    return win;
-  }
-
-  if (!XQueryTree(dpy, win, &root,
-      &parent, &children, &nchildren)) {
-    return 0;
-  }
-
-  for (i = 0; i < nchildren; i++) {
-    client = find_client_win(dpy, children[i]);
-    if (client) break;
-  }
-
-  if (children) XFree((char *)children);
-
-  return client;
+static xcb_get_property_cookie_t
+get_net_frame_extents_request(Window client_window) {
+  return xprop_request(client_window, atom_net_frame_extents,
+                       XCB_GET_PROPERTY_TYPE_ANY, 4);
 }
 
 static void
-get_frame_extents(win* w,
-                  unsigned int *left,
-                  unsigned int *right,
-                  unsigned int *top,
-                  unsigned int *bottom) {
-  long *extents;
-  Atom type;
-  int format;
-  unsigned long nitems, after;
-  unsigned char *data = NULL;
-  int result;
-  Window client_window = 0;
+get_net_frame_extents_reply(xcb_get_property_cookie_t cookie,
+                            unsigned int *left,
+                            unsigned int *right,
+                            unsigned int *top,
+                            unsigned int *bottom) {
+  xcb_get_property_reply_t *r;
+  uint32_t *extents;
 
   *left = 0;
   *right = 0;
   *top = 0;
   *bottom = 0;
 
-  client_window = find_client_win(dpy, w->id);
+  r = xprop_reply(cookie);
+  if (!r) return;
+  if (r->format == 32 && r->value_len == 4 && r->bytes_after == 0) {
+    extents = xcb_get_property_value(r);
+    *left = extents[0];
+    *right = extents[1];
+    *top = extents[2];
+    *bottom = extents[3];
+  }
+  free(r);
+}
+
+static void
+get_net_frame_extents(Window client_window,
+                      unsigned int *left,
+                      unsigned int *right,
+                      unsigned int *top,
+                      unsigned int *bottom) {
+  get_net_frame_extents_reply(get_net_frame_extents_request(client_window),
+                              left, right, top, bottom);
+}
+
+typedef struct {
+  Window client;
+  xcb_get_property_cookie_t state;
+  xcb_get_property_cookie_t extents;
+} FrameExtentsCookie;
+
+static FrameExtentsCookie
+get_frame_extents_request(win* w, Window client_window) {
+  FrameExtentsCookie c = { .client = client_window };
+
   if (!client_window) {
-    w->hidden_type = win_state_is_hidden( w->id) ? HIDDEN_YES : HIDDEN_NO;
-    return;
+    c.state = win_state_request(w->id);
+    return c;
   }
 
   if(w->id != client_window){
@@ -923,39 +1203,211 @@ get_frame_extents(win* w,
     // _NET_WM_STATE attribute set. Thus, although fastcompmgr normally only listens to
     // events of "container" windows, in this case, we also have to register for
     // "Property" changes of the client window:
-    win_register_client_events(client_window);
+    win_register_client_events(w, client_window);
+  }
+  // Both properties are independent, so ask for them at once.
+  c.state = win_state_request(client_window);
+  c.extents = get_net_frame_extents_request(client_window);
+  return c;
+}
+
+static void
+get_frame_extents_reply(win* w, FrameExtentsCookie c,
+                        unsigned int *left,
+                        unsigned int *right,
+                        unsigned int *top,
+                        unsigned int *bottom) {
+  *left = 0;
+  *right = 0;
+  *top = 0;
+  *bottom = 0;
+
+  w->hidden_type = win_state_is_hidden_reply(c.state) ? HIDDEN_YES : HIDDEN_NO;
+  if (!c.client) {
+    return;
   }
-  w->hidden_type = win_state_is_hidden(client_window) ? HIDDEN_YES : HIDDEN_NO;
 
   // FIXME: determine the active window on fastcompmgr startup and set opacity accordingly
   // if(win_has_focus(client_window)){
   //   fprintf(stderr, "YES, HAS FOCUS: 0x%lx\n", client_window);
   // }
 
-  result = XGetWindowProperty(
-    dpy, client_window, atom_net_frame_extents,
-    0L, 4L, False, AnyPropertyType,
-    &type, &format, &nitems, &after,
-    (unsigned char **)&data);
+  get_net_frame_extents_reply(c.extents, left, right, top, bottom);
+}
+
+typedef struct {
+  xcb_get_property_cookie_t region;
+  xcb_translate_coordinates_cookie_t offset; // unset, if w is its own client
+} OpaqueRegionCookie;
+
+/// Under a reparenting window manager, the client sets
+/// _NET_WM_OPAQUE_REGION, relative to itself, so ask for its offset in the
+/// frame along with it.
+static OpaqueRegionCookie
+get_opaque_region_request(win *w, Window client) {
+  OpaqueRegionCookie c = { 0 };
+
+  if (!client) client = w->id;
+  c.region = xprop_request(client, atom_net_wm_opaque_region,
+                           XCB_ATOM_CARDINAL, UINT32_MAX);
+  if (client != w->id) {
+    c.offset = xcb_translate_coordinates(g_xcb, client, w->id, 0, 0);
+  }
+  return c;
+}
 
-  if (result == Success) {
-    if (nitems == 4 && after == 0) {
-      extents = (long *)data;
-      *left =
-        (unsigned int)extents[0];
-      *right =
-        (unsigned int)extents[1];
-      *top =
-        (unsigned int)extents[2];
-      *bottom =
-        (unsigned int)extents[3];
+/// Store the _NET_WM_OPAQUE_REGION requested by get_opaque_region_request in
+/// w, a list of x, y, width, height quadruples.
+static void
+get_opaque_region_reply(win *w, OpaqueRegionCookie c) {
+  xcb_get_property_reply_t *r;
+
+  STAT_INC(prop_reads);
+  w->props_valid |= WINPROP_OPAQUE_REGION;
+  region_clear(&w->opaque_region);
+  w->opaque_dx = w->opaque_dy = 0;
+
+  if (c.offset.sequence) {
+    xcb_generic_error_t *err = NULL;
+    xcb_translate_coordinates_reply_t *t =
+      xcb_translate_coordinates_reply(g_xcb, c.offset, &err);
+    free(err);
+    if (t) {
+      w->opaque_dx = t->dst_x;
+      w->opaque_dy = t->dst_y;
+      free(t);
+    } else {
+      // The client is gone, so is its region
+      xcb_discard_reply(g_xcb, c.region.sequence);
+      return;
     }
-    XFree(data);
   }
+
+  r = xprop_reply(c.region);
+  if (!r) return;
+  if (r->type == XCB_ATOM_CARDINAL && r->format == 32) {
+    uint32_t *v = xcb_get_property_value(r);
+    int n = xcb_get_property_value_length(r) / (4 * sizeof(uint32_t));
+    for (int i = 0; i < n; i++, v += 4) {
+      CompRect rect = { .x1 = (int32_t)v[0], .y1 = (int32_t)v[1],
+                        .x2 = (int32_t)v[0] + (int)v[2],
+                        .y2 = (int32_t)v[1] + (int)v[3] };
+      region_union_rect(&w->opaque_region, &rect);
+    }
+  }
+  free(r);
+}
+
+/// The part of an ARGB window, which the client declares as opaque, relative
+/// to the client, which is at opaque_dx, opaque_dy in the window.
+static const CompRegion*
+get_opaque_region(win *w) {
+  if (likely(w->props_valid & WINPROP_OPAQUE_REGION)) {
+    STAT_INC(prop_reads_avoided);
+  } else {
+    get_opaque_region_reply(
+      w, get_opaque_region_request(w, win_get_client(w)));
+  }
+  return &w->opaque_region;
+}
+
+/// Set dst to the opaque part of the fully opaque ARGB window w on screen, as
+/// declared by _NET_WM_OPAQUE_REGION. Returns false, if there is none.
+static bool
+win_opaque_part(win *w, CompRegion *dst) {
+  const CompRegion *opaque;
+  CompRect bounds = { .x1 = 0, .y1 = 0,
+                      .x2 = w->a.width, .y2 = w->a.height };
+
+  if (w->mode != WINDOW_ARGB || w->opacity != OPAQUE || HAS_FRAME_OPACITY(w)) {
+    return false;
+  }
+  opaque = get_opaque_region(w);
+  if (region_is_empty(opaque)) {
+    return false;
+  }
+  // Clients may declare more than their window
+  bounds.x1 -= w->opaque_dx;
+  bounds.y1 -= w->opaque_dy;
+  bounds.x2 -= w->opaque_dx;
+  bounds.y2 -= w->opaque_dy;
+  if (rect_is_empty(&bounds) || !region_set_rect(dst, &bounds) ||
+      !region_intersect(dst, dst, opaque)) {
+    return false;
+  }
+  region_translate(dst, w->a.x + w->a.border_width + w->opaque_dx,
+                   w->a.y + w->a.border_width + w->opaque_dy);
+  return !region_is_empty(dst);
+}
+
+/// The window including its border and shadow, as far as it is on screen.
+static void
+win_visible_rect(win *w, CompRect *visible) {
+  CompRect screen = { .x1 = 0, .y1 = 0, .x2 = root_width, .y2 = root_height };
+
+  visible->x1 = w->a.x;
+  visible->y1 = w->a.y;
+  visible->x2 = w->a.x + w->a.width + w->a.border_width * 2;
+  visible->y2 = w->a.y + w->a.height + w->a.border_width * 2;
+  if (win_has_shadow(w)) {
+    CompRect s = { .x1 = w->a.x + w->shadow_dx, .y1 = w->a.y + w->shadow_dy,
+                   .x2 = w->a.x + w->shadow_dx + w->shadow_width,
+                   .y2 = w->a.y + w->shadow_dy + w->shadow_height };
+    if (s.x1 < visible->x1) visible->x1 = s.x1;
+    if (s.y1 < visible->y1) visible->y1 = s.y1;
+    if (s.x2 > visible->x2) visible->x2 = s.x2;
+    if (s.y2 > visible->y2) visible->y2 = s.y2;
+  }
+  rect_intersect(visible, visible, &screen);
 }
 
+/// Add the opaque part of the visible window w to occluded.
+static void
+win_occlude(win *w, CompRegion *occluded) {
+  CompRect screen = { .x1 = 0, .y1 = 0, .x2 = root_width, .y2 = root_height };
+
+    // Unmapped, destroyed or translucent windows must not contribute to the ignore region.
+    // Same applies to override_redirect windows, which some screenshooter apps employ
+    // (s. e.g. xfce4-screenshooter
+    // screenshooter-capture.c::get_rectangle_screenshot_composited )
+    if (w->a.map_state != IsViewable || w->destroyed || w->opacity != OPAQUE ||
+        HAS_FRAME_OPACITY(w) || w->a.override_redirect){
+      return;
+    }
+    if (region_is_empty(&w->border_size)) {
+      border_size(dpy, w);
+    }
+    if (w->mode != WINDOW_SOLID) {
+      // ARGB windows only occlude with the part they declare opaque
+      static CompRegion opaque;
+      if (win_opaque_part(w, &opaque)) {
+        if (w->bounding_shaped) {
+          region_intersect(&opaque, &opaque, &w->border_size);
+        }
+        region_union(occluded, occluded, &opaque);
+      }
+      return;
+    }
+    if (unlikely(w->bounding_shaped)) {
+      // Only the shape occludes, e.g. of round clocks
+      static CompRegion shape;
+      region_set_rect(&shape, &screen);
+      region_intersect(&shape, &shape, &w->border_size);
+      region_union(occluded, occluded, &shape);
+      return;
+    }
+    CompRect w_rect = {.x1 = w->a.x, .y1 = w->a.y,
+                   .x2 = w->a.x + w->a.width + w->a.border_width * 2,
+                   .y2 = w->a.y + w->a.height + w->a.border_width * 2 };
+    rect_intersect(&w_rect, &w_rect, &screen);
+    region_union_rect(occluded, &w_rect);
+}
+
+/// Returns false, if w is hidden or nothing of its visible rect is on screen
+/// below the opaque windows above it, occluded. Adds w to occluded, if it is
+/// opaque.
 static Bool
-win_paint_needed(win* w, CompRect* ignore_reg){
+win_paint_needed(win* w, CompRegion* occluded, const CompRect *visible){
   // if invisible, ignore it
     if (unlikely(w->a.x + w->a.width < 1 || w->a.y + w->a.height < 1
         || w->a.x >= root_width || w->a.y >= root_height)) {
@@ -966,14 +1418,14 @@ win_paint_needed(win* w, CompRect* ignore_reg){
     case HIDDEN_UNKNOWN: {
       fprintf(stderr, "fastcompmgr warning: hidden state still unknown in "
                       "win_paint_needed: 0x%lx\n", w->id);
-      Window client_window = find_client_win(dpy, w->id);
+      Window client_window = win_get_client(w);
       if (!client_window) {
         // We already tried to find a client on add_win - give up for now.
         w->hidden_type = HIDDEN_IGNORE;
         break;
       }
 
-      win_register_client_events(client_window);
+      win_register_client_events(w, client_window);
       if(win_state_is_hidden(client_window)){
         w->hidden_type = HIDDEN_YES;
         return false;
@@ -987,18 +1439,93 @@ win_paint_needed(win* w, CompRect* ignore_reg){
     case HIDDEN_IGNORE: break;
     }
 
-    // Unmapped, destroyed or translucent windows must not contribute to the ignore region.
-    // Same applies to override_redirect windows, which some screenshooter apps employ
-    // (s. e.g. xfce4-screenshooter
-    // screenshooter-capture.c::get_rectangle_screenshot_composited )
-    if (w->a.map_state != IsViewable || w->destroyed || w->opacity != OPAQUE ||
-        w->a.override_redirect){
-      return True;
+    if (region_contains_rect(occluded, visible)) {
+      return False;
     }
-    CompRect w_rect = {.x1 = w->a.x, .y1 = w->a.y,
-                   .x2 = w->a.x + w->a.width, .y2 = w->a.y + w->a.height,
-                   .w = w->a.width , .h = w->a.height };
-    return rect_paint_needed(ignore_reg, &w_rect);
+    win_occlude(w, occluded);
+    return True;
+}
+
+/// Fetch the server region src into the client-side region dst, clipped to
+/// the screen, so all coordinates fit into an XRectangle.
+static void
+fetch_region(Display *dpy, XserverRegion src, CompRegion *dst) {
+  CompRect screen = { .x1 = 0, .y1 = 0, .x2 = root_width, .y2 = root_height };
+  XRectangle *rects;
+  int n = 0;
+
+  region_clear(dst);
+  rects = XFixesFetchRegion(dpy, src, &n);
+  if (!rects) return;
+  for (int i = 0; i < n; i++) {
+    CompRect r = { .x1 = rects[i].x, .y1 = rects[i].y,
+                   .x2 = rects[i].x + rects[i].width,
+                   .y2 = rects[i].y + rects[i].height };
+    rect_intersect(&r, &r, &screen);
+    region_union_rect(dst, &r);
+  }
+  XFree(rects);
+}
+
+/// Clip pict to region r. r must lie on screen.
+static void
+set_picture_clip(Display *dpy, Picture pict, const CompRegion *r) {
+  static XRectangle *rects;
+  static int size;
+
+  if (unlikely(r->n > size)) {
+    XRectangle *tmp = realloc(rects, r->n * sizeof(XRectangle));
+    if (unlikely(!tmp)) return;
+    rects = tmp;
+    size = r->n;
+  }
+  for (int i = 0; i < r->n; i++) {
+    rects[i].x = r->rects[i].x1;
+    rects[i].y = r->rects[i].y1;
+    rects[i].width = r->rects[i].x2 - r->rects[i].x1;
+    rects[i].height = r->rects[i].y2 - r->rects[i].y1;
+  }
+  XRenderSetPictureClipRectangles(dpy, pict, 0, 0, rects, r->n);
+}
+
+/// Clip pict to the part of r within rect. Returns false without touching
+/// pict, if nothing of rect is within r.
+static bool
+set_picture_clip_rect(Display *dpy, Picture pict, const CompRegion *r,
+                      const CompRect *rect) {
+  static CompRegion clip;
+  CompRect e;
+
+  rect_intersect(&e, &r->extents, rect);
+  if (rect_is_empty(&e)) return false;
+  if (region_contains_rect(r, rect)) {
+    // A single clip rect suffices
+    region_set_rect(&clip, rect);
+  } else {
+    region_set_rect(&clip, &e);
+    region_intersect(&clip, &clip, r);
+    if (region_is_empty(&clip)) return false;
+  }
+  set_picture_clip(dpy, pict, &clip);
+  return true;
+}
+
+/// Fragmented damage, e.g. of plots and line drawings, makes clipping more
+/// expensive than painting some more pixels. Once the damage has more than
+/// damage_max_rects rectangles, it is replaced by its tiles or its bounding
+/// box, if that is cheaper according to a cost model, where each clip
+/// rectangle costs as much as painting DAMAGE_RECT_COST pixels. Below
+/// damage_max_rects, even dropping all rectangles saves less than trying
+/// costs. tests/damage_bench measures these values, DEBUG_STATS counts the
+/// chosen strategies.
+static void
+simplify_damage(CompRegion *damage) {
+  switch (region_simplify(damage, damage_max_rects, DAMAGE_RECT_COST,
+                          DAMAGE_TILE_SIZE)) {
+  case REGION_SIMPLIFY_EXACT: STAT_INC(damage_exact); break;
+  case REGION_SIMPLIFY_TILED: STAT_INC(damage_tiled); break;
+  case REGION_SIMPLIFY_BBOX: STAT_INC(damage_bbox); break;
+  }
 }
 
 static void
@@ -1017,14 +1544,31 @@ paint_all(Display *dpy, XserverRegion region) {
       DefaultDepth(dpy, g_screen));
 
     root_buffer = XRenderCreatePicture(dpy, rootPixmap,
-      XRenderFindVisualFormat(dpy, DefaultVisual(dpy, g_screen)),
+      format_from_visual(DefaultVisual(dpy, g_screen)),
       0, 0);
 
     XFreePixmap(dpy, rootPixmap);
   }
 #endif
 
-  XFixesSetPictureClipRegion(dpy, root_picture, 0, 0, region);
+  // The part of the screen still to be painted, which shrinks by every
+  // opaque window from top to bottom. The damage is fetched once, all clips
+  // are derived from it on our side and only uploaded for the composites,
+  // which actually intersect them.
+  static CompRegion paint;
+  static CompRegion clip;
+  static CompRegion opaque;
+  bool stale_shadows = false;
+  fetch_region(dpy, region, &paint);
+  simplify_damage(&paint);
+  // Nothing needs painting, where no output shows it. Done after
+  // simplify_damage, which may grow the damage.
+  if (unlikely(!region_is_empty(&root_hidden))) {
+    region_subtract(&paint, &paint, &root_hidden);
+  }
+  CompRect damage_box = paint.extents;
+
+  set_picture_clip(dpy, root_picture, &paint);
 
 #if MONITOR_REPAINT
   XRenderComposite(
@@ -1037,29 +1581,83 @@ paint_all(Display *dpy, XserverRegion region) {
   printf("paint:");
 #endif
 
-  CompRect ignore_reg = {0};
+  // Opaque windows above the current one and the parts of the root no output
+  // shows. Kept across frames to reuse its memory.
+  static CompRegion occluded;
+  bool need_update = ignore_region_is_dirty;
+  // Unless the whole stack is dirty, only windows below a changed one and
+  // intersecting what it covered before or covers now need to be checked
+  // again. Everything else keeps its paint_needed.
+  static CompRegion changed;
+  bool update_all = g_paint_ignore_region_all_dirty;
+  g_paint_ignore_region_all_dirty = False;
+  region_copy(&occluded, &root_hidden);
+  region_clear(&changed);
   for (w = list; w; w = w->next) {
+    CompRect visible;
+    bool win_changed = false;
+
     // Don't do this here, otherwise we get artifacts after move.
     // if (w->need_configure){
     //   do_configure_win(dpy, w);
     // }
 
+    // Nothing below is visible. Windows below only need a visit, to update
+    // what changed since the last frame.
+    if (region_is_empty(&paint) && !need_update) break;
+
 #if CAN_DO_USABLE
     if (!w->usable) continue;
 #endif
 
+    if (unlikely(need_update)) {
+      win_visible_rect(w, &visible);
+      if (w->occlusion_dirty) {
+        // Also, if w is unmapped and never painted again
+        w->occlusion_dirty = false;
+        win_changed = true;
+        region_union_rect(&changed, &w->occlusion_rect);
+        region_union_rect(&changed, &visible);
+      }
+      w->occlusion_rect = visible;
+    }
+
     /* never painted, ignore it */
     if (likely(!w->damaged)) continue;
 
     // Note that undamaged windows should not contribute to the ignore
     // region. Otherwise VBoxManager makes other windows disappear during startup.
-    if(unlikely(ignore_region_is_dirty || clip_changed)){
-      // maybe_todo: pass only clipped rects, actually visible on screen.
-      // Now we may choose the ignore region from a big window which
-      // resides largely outside the screen.
-      w->paint_needed = win_paint_needed(w, &ignore_reg);
+    if(unlikely(need_update)){
+      if (update_all || win_changed ||
+          region_intersects_rect(&changed, &visible)) {
+        STAT_INC(occlusion_evals);
+        w->paint_needed = win_paint_needed(w, &occluded, &visible);
+      } else {
+        STAT_INC(occlusion_evals_avoided);
+        if (w->paint_needed) {
+          win_occlude(w, &occluded);
+        }
+      }
+    }
+    if(!w->paint_needed) {
+      if (w->a.map_state == IsViewable) {
+        win_suspend_damage(dpy, w);
+      }
+      continue;
+    }
+    if (unlikely(w->damage_suspended)) {
+      win_resume_damage(dpy, w);
+    }
+
+    if (region_is_empty(&w->border_size)) {
+      border_size(dpy, w);
+    }
+
+    if (unlikely(!w->extents || w->extents_dirty)) {
+      win_extents(dpy, w);
     }
-    if(!w->paint_needed) continue;
+
+    if (region_is_empty(&paint)) continue;
 
     if (!w->picture) {
       XRenderPictureAttributes pa;
@@ -1068,13 +1666,14 @@ paint_all(Display *dpy, XserverRegion region) {
 
 #if HAS_NAME_WINDOW_PIXMAP
       if (has_name_pixmap && !w->pixmap) {
-        set_ignore(dpy, NextRequest(dpy));
-        w->pixmap = XCompositeNameWindowPixmap(dpy, w->id);
+        w->pixmap = xcb_generate_id(g_xcb);
+        xcb_forget(xcb_composite_name_window_pixmap_checked(
+          g_xcb, w->id, w->pixmap));
       }
       if (w->pixmap) draw = w->pixmap;
 #endif
 
-      format = XRenderFindVisualFormat(dpy, w->a.visual);
+      format = format_from_visual(w->a.visual);
       pa.subwindow_mode = IncludeInferiors;
       w->picture = XRenderCreatePicture(
         dpy, draw, format, CPSubwindowMode, &pa);
@@ -1084,51 +1683,50 @@ paint_all(Display *dpy, XserverRegion region) {
     printf(" 0x%x", w->id);
 #endif
 
-    if (clip_changed) {
-      if (w->border_size) {
-        set_ignore(dpy, NextRequest(dpy));
-        XFixesDestroyRegion(dpy, w->border_size);
-        w->border_size = None;
-      }
-      win_extents(dpy, w);
-    }
-
-    if (!w->border_size) {
-      w->border_size = border_size (dpy, w);
-    }
-
-    if (unlikely(!w->extents)) {
-      win_extents(dpy, w);
-    }
-
-    if (w->mode == WINDOW_SOLID && !HAS_FRAME_OPACITY(w)) {
-      int x, y, wid, hei;
-
+    // Where w->picture is on screen
 #if HAS_NAME_WINDOW_PIXMAP
-      x = w->a.x;
-      y = w->a.y;
-      wid = w->a.width + w->a.border_width * 2;
-      hei = w->a.height + w->a.border_width * 2;
+    int x = w->a.x;
+    int y = w->a.y;
+    int wid = w->a.width + w->a.border_width * 2;
+    int hei = w->a.height + w->a.border_width * 2;
 #else
-      x = w->a.x + w->a.border_width;
-      y = w->a.y + w->a.border_width;
-      wid = w->a.width;
-      hei = w->a.height;
+    int x = w->a.x + w->a.border_width;
+    int y = w->a.y + w->a.border_width;
+    int wid = w->a.width;
+    int hei = w->a.height;
 #endif
 
-      set_ignore(dpy, NextRequest(dpy));
-      XFixesSetPictureClipRegion(dpy, root_buffer, 0, 0, region);
-
-      set_ignore(dpy, NextRequest(dpy));
-      XFixesSubtractRegion(dpy, region, region, w->border_size);
-
-      XRenderComposite(
-        dpy, PictOpSrc, w->picture,
-        None, root_buffer, 0, 0, 0, 0,
-        x, y, wid, hei);
+    if (w->mode == WINDOW_SOLID && !HAS_FRAME_OPACITY(w)) {
+      region_intersect(&clip, &paint, &w->border_size);
+      if (!region_is_empty(&clip)) {
+        set_picture_clip(dpy, root_buffer, &clip);
+        // The composites of a frame stay Xlib requests, guarded by
+        // set_ignore: sending single ones through XCB would make Xlib
+        // hand over its socket and flush for each of them.
+        set_ignore(dpy, NextRequest(dpy));
+        XRenderComposite(
+          dpy, PictOpSrc, w->picture,
+          None, root_buffer, 0, 0, 0, 0,
+          x, y, wid, hei);
+        region_subtract(&paint, &paint, &w->border_size);
+      }
+    } else if (win_opaque_part(w, &opaque)) {
+      // Copy the opaque part of an ARGB window like a solid window, only
+      // the rest needs blending below.
+      region_intersect(&opaque, &opaque, &w->border_size);
+      region_intersect(&clip, &paint, &opaque);
+      if (!region_is_empty(&clip)) {
+        set_picture_clip(dpy, root_buffer, &clip);
+        set_ignore(dpy, NextRequest(dpy));
+        XRenderComposite(
+          dpy, PictOpSrc, w->picture,
+          None, root_buffer, 0, 0, 0, 0,
+          x, y, wid, hei);
+        region_subtract(&paint, &paint, &opaque);
+      }
     }
 
-    XFixesCopyRegion(dpy, w->border_clip, region);
+    region_copy(&w->border_clip, &paint);
 
     w->prev_trans = t;
     t = w;
@@ -1139,20 +1737,44 @@ paint_all(Display *dpy, XserverRegion region) {
   fflush(stdout);
 #endif
 
-  XFixesSetPictureClipRegion(dpy,
-    root_buffer, 0, 0, region);
-  paint_root(dpy);
+  if (!region_is_empty(&paint)) {
+    set_picture_clip(dpy, root_buffer, &paint);
+    paint_root(dpy);
+  }
 
   for (w = t; w; w = w->prev_trans) {
-    XFixesSetPictureClipRegion(dpy,
-      root_buffer, 0, 0, w->border_clip);
+    if (region_is_empty(&w->border_clip)) continue;
 
     if(shadow_should_render(w->shadow_type)) {
-      XRenderComposite(
-        dpy, PictOpOver, cshadow_picture, w->shadow,
-        root_buffer, 0, 0, 0, 0,
-        w->a.x + w->shadow_dx, w->a.y + w->shadow_dy,
-        w->shadow_width, w->shadow_height);
+      CompRect sr = { .x1 = w->a.x + w->shadow_dx, .y1 = w->a.y + w->shadow_dy,
+                      .x2 = w->a.x + w->shadow_dx + w->shadow_width,
+                      .y2 = w->a.y + w->shadow_dy + w->shadow_height };
+      const CompRegion *shadow_clip = &w->border_clip;
+      if (w->shadow_patch && w->shadow_type == SHADOW_NOCENTER) {
+        // Patches have a center, so clip away what make_shadow keeps
+        // transparent: the part below the window.
+        CompRect wr = { .x1 = w->a.x, .y1 = w->a.y,
+                        .x2 = w->a.x + w->a.width + w->a.border_width * 2,
+                        .y2 = w->a.y + w->a.height + w->a.border_width * 2 };
+        region_set_rect(&clip, &wr);
+        region_subtract(&clip, &w->border_clip, &clip);
+        shadow_clip = &clip;
+      }
+      if (set_picture_clip_rect(dpy, root_buffer, shadow_clip, &sr)) {
+        if (w->shadow_patch) {
+          STAT_INC(shadow_patch_paints);
+          shadow_patch_paint(dpy, w->shadow_patch, root_buffer,
+            sr.x1, sr.y1, w->shadow_width, w->shadow_height);
+        } else if (w->shadow) {
+          // A stale shadow is clipped to the new size
+          if (w->shadow_stale) stale_shadows = true;
+          XRenderComposite(
+            dpy, PictOpOver, cshadow_picture, w->shadow,
+            root_buffer, 0, 0, 0, 0,
+            w->a.x + w->shadow_dx, w->a.y + w->shadow_dy,
+            w->shadow_width, w->shadow_height);
+        }
+      }
     }
 
     if (w->opacity != OPAQUE && !w->alpha_pict) {
@@ -1166,11 +1788,13 @@ paint_all(Display *dpy, XserverRegion region) {
 
     if (w->mode != WINDOW_SOLID || HAS_FRAME_OPACITY(w)) {
       int x, y, wid, hei;
-      // 2024-11-26: Without the next two lines, the Microsoft-Teams screen-share
-      // window has a broken frame instead of a shadow, with a "startup-frozen"
-      // picture. Inspired by xcompmgr's commit 5a7d139f (2012-08-11).
-      XFixesIntersectRegion(dpy, w->border_clip, w->border_clip, w->border_size);
-      XFixesSetPictureClipRegion(dpy, root_buffer, 0, 0, w->border_clip);
+      // 2024-11-26: Without clipping to the window's shape, the Microsoft-Teams
+      // screen-share window has a broken frame instead of a shadow, with a
+      // "startup-frozen" picture. Inspired by xcompmgr's commit 5a7d139f
+      // (2012-08-11).
+      region_intersect(&clip, &w->border_clip, &w->border_size);
+      if (region_is_empty(&clip)) continue;
+      set_picture_clip(dpy, root_buffer, &clip);
 
 #if HAS_NAME_WINDOW_PIXMAP
       x = w->a.x;
@@ -1225,12 +1849,18 @@ paint_all(Display *dpy, XserverRegion region) {
     }
   }
 
+  if (stale_shadows) {
+    STAT_INC(shadow_stale_frames);
+  }
+
 #if ! MONITOR_REPAINT
     XFixesSetPictureClipRegion(dpy, root_buffer, 0, 0, None);
+    // root_picture is clipped to the damage, which excludes hidden parts
     XRenderComposite(
       dpy, PictOpSrc, root_buffer, None,
-      root_picture, 0, 0, 0, 0,
-      0, 0, root_width, root_height);
+      root_picture, damage_box.x1, damage_box.y1, 0, 0,
+      damage_box.x1, damage_box.y1,
+      damage_box.x2 - damage_box.x1, damage_box.y2 - damage_box.y1);
 #endif // ! MONITOR_REPAINT
 }
 
@@ -1252,7 +1882,7 @@ add_damage_if_hidden_changed(Window window, bool is_reparent_event) {
     return;
   }
   if(is_reparent_event){
-    win_register_client_events(window);
+    win_register_client_events(w, window);
   }
   hiddentype hidden_type = win_state_is_hidden(window) ? HIDDEN_YES : HIDDEN_NO;
   // _NET_WM_STATE may change without altering _NET_WM_STATE_HIDDEN, so
@@ -1264,22 +1894,20 @@ add_damage_if_hidden_changed(Window window, bool is_reparent_event) {
   if(w->extents){
     add_damage(dpy, w->extents);
   }
-  clip_changed = True;
-  set_paint_ignore_region_dirty();
+  set_win_ignore_region_dirty(w);
 }
 
 static void
 repair_win(Display *dpy, win *w) {
   XserverRegion parts;
 
-  if (!w->damaged) {
+  if (!w->damaged || w->damage_full) {
+    w->damage_full = false;
     parts = win_extents(dpy, w);
-    set_ignore(dpy, NextRequest(dpy));
-    XDamageSubtract(dpy, w->damage, None, None);
+    xcb_forget(xcb_damage_subtract_checked(g_xcb, w->damage, None, None));
   } else {
     parts = g_xregion_tmp;
-    set_ignore(dpy, NextRequest(dpy));
-    XDamageSubtract(dpy, w->damage, None, parts);
+    xcb_forget(xcb_damage_subtract_checked(g_xcb, w->damage, None, parts));
     XFixesTranslateRegion(dpy, parts,
       w->a.x + w->a.border_width,
       w->a.y + w->a.border_width);
@@ -1346,73 +1974,210 @@ wintype_name(wintype type) {
 }
 #endif
 
+/// The first known type of a _NET_WM_WINDOW_TYPE list wins. Frees atom_arr.
 static wintype
-get_wintype_prop(Display * dpy, Window w) {
-  Atom actual;
-  int format;
-  unsigned long n, left, off;
-  unsigned char *data;
-
-  off = 0;
-
-  do {
-    set_ignore(dpy, NextRequest(dpy));
-
-    int result = XGetWindowProperty(
-      dpy, w, atom_win_type, off, 1L, False, XA_ATOM,
-      &actual, &format, &n, &left, &data);
-
-    if (unlikely(result != Success)) break;
-
-    if (likely(data != None)) {
-      int i;
-      for (i = 1; i < NUM_WINTYPES; ++i) {
-        Atom a;
-        memcpy(&a, data, sizeof(Atom));
-        if (a == win_type[i]) {
-          /* known type */
-          XFree((void *) data);
-          return i;
-        }
+wintype_from_atoms(AtomArr atom_arr) {
+  wintype type = WINTYPE_UNKNOWN;
+  unsigned long n;
+  int i;
+
+  for (n = 0; n < atom_arr.n_items && type == WINTYPE_UNKNOWN; n++) {
+    for (i = 1; i < NUM_WINTYPES; ++i) {
+      if (atom_arr.atoms[n] == win_type[i]) {
+        type = i;
+        break;
       }
-      XFree((void *) data);
     }
-    ++off;
-  } while (left >= 4);
-
-  return WINTYPE_UNKNOWN;
+  }
+  atom_arr_free(&atom_arr);
+  return type;
 }
 
 static wintype
 determine_wintype(Display *dpy, Window w, Window top) {
-  Window root_return, parent_return;
-  Window *children = NULL;
-  unsigned int nchildren, i;
+  xcb_get_property_cookie_t type_cookie;
+  xcb_query_tree_cookie_t tree_cookie;
+  xcb_query_tree_reply_t *tree;
+  xcb_window_t *children;
+  int nchildren, i;
+  wintype type = WINTYPE_UNKNOWN;
+
+  // Ask for the children right away, we need them, if w has no type.
+  type_cookie = win_query_atoms_request(w, atom_win_type);
+  tree_cookie = xcb_query_tree(g_xcb, w);
+  type = wintype_from_atoms(win_query_atoms_reply(type_cookie));
+  if (type != WINTYPE_UNKNOWN) {
+    xcb_forget(tree_cookie);
+    return type;
+  }
+
+  tree = xtree_reply(tree_cookie);
+  if (unlikely(!tree)) {
+    return WINTYPE_UNKNOWN;
+  }
+  children = xcb_query_tree_children(tree);
+  nchildren = xcb_query_tree_children_length(tree);
+
+  for (i = 0; i < nchildren; i++) {
+    type = determine_wintype(dpy, children[i], top);
+    if (type != WINTYPE_UNKNOWN) goto free_out;
+  }
+
+  if (w != top) {
+    type = WINTYPE_UNKNOWN;
+  } else {
+    type = WINTYPE_NORMAL;
+  }
+
+free_out:
+  free(tree);
+  return type;
+}
+
+/// Something w's shadow type depends on changed, so find it out again and
+/// repaint the window with its new shadow.
+static void
+shadow_type_changed(Display *dpy, win *w) {
+  w->shadow_type = SHADOW_UNKNOWN;
+  win_free_shadow(dpy, w);
+  if (w->extents) {
+    add_damage(dpy, w->extents);
+  }
+  add_damage(dpy, win_extents(dpy, w));
+  set_win_ignore_region_dirty(w);
+}
+
+/// Return the cached window type of w or resolve it. Usually, the type is
+/// set either on w itself or on its client, which we already know from
+/// get_frame_extents, so the recursive search of determine_wintype is only
+/// needed for windows without a client.
+typedef struct {
+  xcb_get_property_cookie_t top;
+  xcb_get_property_cookie_t client; // zero, if client is the toplevel itself
+} WintypeCookie;
+
+/// Request the window type of the toplevel and its client at once. Without a
+/// client nothing is requested, see win_determine_wintype_reply.
+static WintypeCookie
+win_determine_wintype_request(win *w, Window client) {
+  WintypeCookie c = { 0 };
+
+  if (!client) return c;
+  c.top = win_query_atoms_request(w->id, atom_win_type);
+  if (client != w->id) {
+    c.client = win_query_atoms_request(client, atom_win_type);
+  }
+  return c;
+}
+
+static wintype
+win_determine_wintype_reply(Display *dpy, win *w, WintypeCookie c) {
   wintype type;
 
-  type = get_wintype_prop(dpy, w);
-  if (type != WINTYPE_UNKNOWN) return type;
+  STAT_INC(wintype_lookups);
+  if (c.top.sequence == 0) {
+    type = determine_wintype(dpy, w->id, w->id);
+  } else {
+    type = wintype_from_atoms(win_query_atoms_reply(c.top));
+    if (c.client.sequence != 0) {
+      if (type == WINTYPE_UNKNOWN) {
+        type = wintype_from_atoms(win_query_atoms_reply(c.client));
+      } else {
+        xcb_forget(c.client);
+      }
+    }
+    if (type == WINTYPE_UNKNOWN) {
+      type = WINTYPE_NORMAL;
+    }
+  }
+  w->window_type = type;
+  return type;
+}
 
-  set_ignore(dpy, NextRequest(dpy));
-  if (unlikely(!XQueryTree(dpy, w, &root_return, &parent_return,
-                  &children, &nchildren))) {
-    goto free_out;
+static wintype
+win_determine_wintype(Display *dpy, win *w) {
+  if (likely(w->window_type != WINTYPE_UNKNOWN)) {
+    STAT_INC(wintype_lookups_avoided);
+    return w->window_type;
+  }
+  return win_determine_wintype_reply(
+    dpy, w, win_determine_wintype_request(w, win_get_client(w)));
+}
+
+/// _NET_WM_WINDOW_TYPE of a toplevel or its client changed.
+static void
+wintype_changed(Display *dpy, XPropertyEvent *pe) {
+  win *w = find_win_any_parent(pe->window);
+
+  if (!w || w->window_type == WINTYPE_UNKNOWN) return;
+
+  w->window_type = WINTYPE_UNKNOWN;
+  // Unmapped windows resolve their type on the next map.
+  if (w->a.map_state != IsViewable) return;
+
+  win_determine_wintype(dpy, w);
+  // Whether to draw a shadow depends on the type
+  shadow_type_changed(dpy, w);
+}
+
+/// Update the cache bit of a property of w, which changed according to pe.
+/// A deleted property is known to be absent, otherwise it is read again on
+/// next use.
+static void
+prop_changed(win *w, XPropertyEvent *pe, unsigned int prop) {
+  if (pe->state == PropertyDelete) {
+    w->props_valid |= prop;
+    switch (prop) {
+    case WINPROP_OPACITY: w->has_opacity_prop = false; break;
+    case WINPROP_GTK_FRAME_EXTENTS: w->has_gtk_frame_extents = false; break;
+    case WINPROP_OPAQUE_REGION: region_clear(&w->opaque_region); break;
+    }
+  } else {
+    w->props_valid &= ~prop;
+  }
+}
+
+static void
+gtk_frame_extents_changed(Display *dpy, XPropertyEvent *pe) {
+  win *w = find_win(pe->window);
+
+  if (!w) return;
+  prop_changed(w, pe, WINPROP_GTK_FRAME_EXTENTS);
+  if (w->a.map_state == IsViewable && w->shadow_type != SHADOW_UNKNOWN) {
+    shadow_type_changed(dpy, w);
+  }
+}
+
+static void
+opaque_region_changed(Display *dpy, XPropertyEvent *pe) {
+  win *w = find_win_any_parent(pe->window);
+  Window client;
+
+  if (!w) return;
+  // Only the client's counts, see get_opaque_region_request
+  client = win_get_client(w);
+  if (pe->window != (client ? client : w->id)) return;
+  prop_changed(w, pe, WINPROP_OPAQUE_REGION);
+  if (w->a.map_state == IsViewable) {
+    set_win_ignore_region_dirty(w);
+    if (w->extents) {
+      add_damage(dpy, w->extents);
+    }
   }
+}
 
-  for (i = 0; i < nchildren; i++) {
-    type = determine_wintype(dpy, children[i], top);
-    if (type != WINTYPE_UNKNOWN) goto free_out;
-  }
+static void
+net_frame_extents_changed(Display *dpy, XPropertyEvent *pe) {
+  win *w = find_win_any_parent(pe->window);
 
-  if (w != top) {
-    type = WINTYPE_UNKNOWN;
-  } else {
-    type = WINTYPE_NORMAL;
-  }
+  // Frame extents are taken from the client only
+  if (!w || win_get_client(w) != pe->window) return;
 
-free_out:
-  if (children) XFree((void *)children);
-  return type;
+  get_net_frame_extents(pe->window, &w->left_width, &w->right_width,
+                        &w->top_width, &w->bottom_width);
+  if (frame_opacity && w->a.map_state == IsViewable && w->extents) {
+    add_damage(dpy, w->extents);
+  }
 }
 
 static unsigned int
@@ -1428,22 +2193,29 @@ map_win(Display *dpy, Window id,
 
   if (unlikely(!w)) return;
 
+  if (w->setup_pending) {
+    // The setup maps the window
+    w->a.map_state = IsViewable;
+    win_setup(dpy, w);
+    return;
+  }
+
+  // Without Damage, a remapped window would never be repaired and painted
+  win_resume_damage(dpy, w);
+
   w->a.map_state = IsViewable;
-  w->window_type = determine_wintype(dpy, w->id, w->id);
 
-  if (! w->border_clip) {
-    w->border_clip = XFixesCreateRegion(dpy, 0, 0);
-  }
+  // unmap_win only keeps property changes selected. These were selected
+  // before reading any property, by win_setup_request.
+  xselect_input(id, PropertyChangeMask | FocusChangeMask);
+
+  win_determine_wintype(dpy, w);
 
 #if 0
   printf("window 0x%x type %s\n",
     w->id, wintype_name(w->window_type));
 #endif
 
-  /* select before reading the property
-     so that no property changes are lost */
-  XSelectInput(dpy, id, PropertyChangeMask | FocusChangeMask);
-
   // this causes problems for inactive transparency
   //w->opacity = get_opacity_prop(dpy, w, OPAQUE);
 
@@ -1462,7 +2234,7 @@ map_win(Display *dpy, Window id,
       fade_in_step, 0, True, True);
   }
 
-  set_paint_ignore_region_dirty();
+  set_win_ignore_region_dirty(w);
 
   /* if any configure events happened while
      the window was unmapped, then configure
@@ -1491,23 +2263,18 @@ finish_unmap_win(Display *dpy, win *w) {
 #endif
 
   if (w->picture) {
-    set_ignore(dpy, NextRequest(dpy));
-    XRenderFreePicture(dpy, w->picture);
+    xcb_forget(xcb_render_free_picture_checked(g_xcb, w->picture));
     w->picture = None;
   }
 
-  if (w->border_size) {
-    set_ignore(dpy, NextRequest(dpy));
-      XFixesDestroyRegion(dpy, w->border_size);
-      w->border_size = None;
-  }
+  // The shape may change, while the window is unmapped
+  region_clear(&w->border_size);
+  w->shape_valid = false;
 
-  if (w->shadow) {
-    XRenderFreePicture(dpy, w->shadow);
-    w->shadow = None;
-  }
+  win_free_shadow(dpy, w);
 
-  clip_changed = True;
+  w->extents_dirty = true;
+  set_win_ignore_region_dirty(w);
 }
 
 #if HAS_NAME_WINDOW_PIXMAP
@@ -1523,12 +2290,16 @@ unmap_win(Display *dpy, Window id, Bool fade) {
 
   if (!w) return;
 
-    /* don't care about properties anymore */
-  set_ignore(dpy, NextRequest(dpy));
-  XSelectInput(dpy, w->id, 0);
+  if (unlikely(w->setup_pending)) {
+    win_setup(dpy, w);
+  }
+
+  // Keep listening for property changes, so the cached window type stays
+  // valid and a remap does not need to resolve it again.
+  xselect_input(w->id, PropertyChangeMask);
 
   w->a.map_state = IsUnmapped;
-  set_paint_ignore_region_dirty();
+  set_win_ignore_region_dirty(w);
 
 
 #if HAS_NAME_WINDOW_PIXMAP
@@ -1540,20 +2311,50 @@ unmap_win(Display *dpy, Window id, Bool fade) {
     finish_unmap_win(dpy, w);
 }
 
-static bool is_gtk_frame_extent(Display *dpy, Window w){
-  Atom type;
-  int format;
-  unsigned long nitems, after;
-  unsigned char *data = NULL;
-  int result;
+static bool is_gtk_frame_extent(Display *dpy, win *w){
+  xcb_get_property_reply_t *r;
 
-  result = XGetWindowProperty(dpy, w, atom_gtk_frame_extents, 0, LONG_MAX,
-    false, XA_CARDINAL, &type, &format, &nitems, &after, (unsigned char **)&data);
-  if (result == Success && data!=NULL) {
-    XFree((void *)data);
-    return nitems == 4 ;
+  if (likely(w->props_valid & WINPROP_GTK_FRAME_EXTENTS)) {
+    STAT_INC(prop_reads_avoided);
+    return w->has_gtk_frame_extents;
+  }
+  STAT_INC(prop_reads);
+  w->props_valid |= WINPROP_GTK_FRAME_EXTENTS;
+  w->has_gtk_frame_extents = false;
+
+  // We only care, whether all four values are present.
+  r = xprop_reply(xprop_request(w->id, atom_gtk_frame_extents,
+                                XCB_ATOM_CARDINAL, 4));
+  if (r) {
+    w->has_gtk_frame_extents = r->type == XCB_ATOM_CARDINAL &&
+                               r->value_len == 4;
+    free(r);
+  }
+  return w->has_gtk_frame_extents;
+}
+
+static xcb_get_property_cookie_t
+get_opacity_prop_request(win *w) {
+  return xprop_request(w->id, atom_opacity, XCB_ATOM_CARDINAL, 1);
+}
+
+/// Store the opacity property requested by get_opacity_prop_request in w.
+static void
+get_opacity_prop_reply(win *w, xcb_get_property_cookie_t cookie) {
+  xcb_get_property_reply_t *r;
+
+  STAT_INC(prop_reads);
+  w->props_valid |= WINPROP_OPACITY;
+  w->has_opacity_prop = false;
+
+  r = xprop_reply(cookie);
+  if (r) {
+    if (r->type == XCB_ATOM_CARDINAL && r->format == 32 && r->value_len == 1) {
+      w->opacity_prop = *(uint32_t *)xcb_get_property_value(r);
+      w->has_opacity_prop = true;
+    }
+    free(r);
   }
-  return false;
 }
 
 /* Get the opacity prop from window
@@ -1562,23 +2363,12 @@ static bool is_gtk_frame_extent(Display *dpy, Window w){
  */
 static unsigned int
 get_opacity_prop(Display *dpy, win *w, unsigned int def) {
-  Atom actual;
-  int format;
-  unsigned long n, left;
-
-  unsigned char *data;
-  int result = XGetWindowProperty(
-    dpy, w->id, atom_opacity, 0L, 1L, False,
-    XA_CARDINAL, &actual, &format, &n, &left, &data);
-
-  if (result == Success && data != NULL) {
-    unsigned int i;
-    memcpy(&i, data, sizeof(unsigned int));
-    XFree((void *)data);
-    return i;
+  if (likely(w->props_valid & WINPROP_OPACITY)) {
+    STAT_INC(prop_reads_avoided);
+  } else {
+    get_opacity_prop_reply(w, get_opacity_prop_request(w));
   }
-
-  return def;
+  return w->has_opacity_prop ? w->opacity_prop : def;
 }
 
 /*
@@ -1621,7 +2411,7 @@ determine_mode(Display *dpy, win *w) {
   if (w->a.class == InputOnly) {
     format = 0;
   } else {
-    format = XRenderFindVisualFormat(dpy, w->a.visual);
+    format = format_from_visual(w->a.visual);
   }
 
   if (format && format->type == PictTypeDirect
@@ -1651,14 +2441,13 @@ set_opacity(Display *dpy, win *w, unsigned long opacity) {
   } else {
     w->opacity = opacity;
     determine_mode(dpy, w);
-    if (w->shadow) {
+    if (win_has_shadow(w)) {
       // rebuild the shadow
-      XRenderFreePicture(dpy, w->shadow);
-      w->shadow = None;
+      win_free_shadow(dpy, w);
       win_extents(dpy, w);
     }
   }
-  set_paint_ignore_region_dirty();
+  set_win_ignore_region_dirty(w);
 }
 
 
@@ -1671,49 +2460,152 @@ win_suggest_opacity(win* w, bool* is_userdefined){
 }
 
 
+// Requests of win_setup in flight.
+typedef struct {
+  FrameExtentsCookie frame;
+  WintypeCookie type;
+  xcb_get_property_cookie_t opacity;
+  OpaqueRegionCookie opaque_region;
+} WinSetupCookie;
+
+/// Request everything the setup of a new window needs, once its client is
+/// known. All requests are independent, so they take a single round trip
+/// together, and the setup of many windows can be requested at once.
+static WinSetupCookie
+win_setup_request(win *w, Window client) {
+  WinSetupCookie c = { 0 };
+
+  c.frame = get_frame_extents_request(w, client);
+  if (w->a.map_state == IsViewable) {
+    // Select before reading the properties, so that no change is lost
+    // between the read and the select, see prop_changed.
+    xselect_input(w->id, PropertyChangeMask | FocusChangeMask);
+    if (w->window_type == WINTYPE_UNKNOWN) {
+      c.type = win_determine_wintype_request(w, client);
+    }
+    if (!(w->props_valid & WINPROP_OPACITY)) {
+      c.opacity = get_opacity_prop_request(w);
+    }
+    if (!(w->props_valid & WINPROP_OPAQUE_REGION)) {
+      c.opaque_region = get_opaque_region_request(w, client);
+    }
+  }
+  return c;
+}
+
+/// Windows get their Damage object only once they are mapped, many are never.
+static bool
+win_create_damage(Display *dpy, win *w) {
+  xcb_void_cookie_t cookie;
+
+  if (w->damage != None || w->a.class == InputOnly) return false;
+  w->damage = xcb_generate_id(g_xcb);
+  cookie = xcb_damage_create_checked(g_xcb, w->damage, w->id,
+                                     XCB_DAMAGE_REPORT_LEVEL_NON_EMPTY);
+  w->damage_sequence = cookie.sequence;
+  xcb_forget(cookie);
+  return true;
+}
+
+/// Nothing of w is visible, so stop the server from tracking and reporting
+/// its damage, e.g. of an animation behind a fullscreen window.
 static void
-add_win(Display *dpy, Window id, Window prev) {
-  win *new = calloc(1, sizeof(win));
-  win **p;
+win_suspend_damage(Display *dpy, win *w) {
+  if (w->damage == None) return;
+  xcb_forget(xcb_damage_destroy_checked(g_xcb, w->damage));
+  w->damage = None;
+  w->damage_suspended = true;
+  STAT_INC(damage_suspends);
+}
 
-  if (unlikely(!new)) return;
+/// w is visible again. Its content changed unnoticed, so repaint all of it.
+/// The server reports the window as damaged once the new Damage object
+/// exists, but it may be called from paint_all, whose damage is cleared after
+/// the frame, so repair_win handles that report.
+static void
+win_resume_damage(Display *dpy, win *w) {
+  if (!w->damage_suspended) return;
+  w->damage_suspended = false;
+  STAT_INC(damage_resumes);
+  if (win_create_damage(dpy, w)) {
+    w->damage_full = true;
+  }
+}
 
-  if (prev) {
-    for (p = &list; *p; p = &(*p)->next) {
-      if ((*p)->id == prev && !(*p)->destroyed)
-        break;
+static void
+win_setup_reply(Display *dpy, win *w, WinSetupCookie c) {
+  bool new_damage = false;
+
+  STAT_INC(win_setups);
+  w->setup_pending = false;
+  get_frame_extents_reply(w, c.frame,
+    &w->left_width, &w->right_width,
+    &w->top_width, &w->bottom_width);
+
+  if (w->a.map_state == IsViewable) {
+    if (w->window_type == WINTYPE_UNKNOWN) {
+      win_determine_wintype_reply(dpy, w, c.type);
     }
-  } else {
-    p = &list;
+    if (c.opacity.sequence) {
+      get_opacity_prop_reply(w, c.opacity);
+    }
+    if (c.opaque_region.region.sequence) {
+      get_opaque_region_reply(w, c.opaque_region);
+    }
+    w->opacity = win_suggest_opacity(w, &w->userdefined_opacity);
+    if (has_shape) {
+      xcb_forget(xcb_shape_select_input_checked(g_xcb, w->id, 1));
+    }
+    new_damage = win_create_damage(dpy, w);
+    map_win(dpy, w->id, w->damage_sequence - 1, True);
   }
 
-  new->id = id;
-  set_ignore(dpy, NextRequest(dpy));
-
-  if (unlikely(!XGetWindowAttributes(dpy, id, &new->a))) {
-    free(new);
-    return;
+  // Damage reported before the setup was not repaired, so no further damage
+  // would be reported. A Damage object created just now missed the content
+  // drawn since the window was mapped.
+  if (w->setup_damaged || new_damage) {
+    w->setup_damaged = false;
+    if (w->a.map_state == IsViewable) {
+      repair_win(dpy, w);
+    } else {
+      xcb_forget(xcb_damage_subtract_checked(g_xcb, w->damage, None, None));
+    }
   }
+}
+
+/// Find the client of a new window, read its properties and map it, if it is
+/// viewable. Only done, once the window is mapped, see add_win.
+static void
+win_setup(Display *dpy, win *w) {
+  win_setup_reply(dpy, w, win_setup_request(w, win_get_client(w)));
+}
+
+/// Create the record of a new window with the attributes a and place it
+/// above prev. Its setup and Damage object are left to win_setup.
+static win*
+add_win_create(Display *dpy, Window id, Window prev,
+               const XWindowAttributes *a) {
+  win *new = calloc(1, sizeof(win));
+
+  if (unlikely(!new)) return NULL;
+
+  new->id = id;
+  new->a = *a;
 
 #if HAS_NAME_WINDOW_PIXMAP
   new->pixmap = None;
 #endif
   new->picture = None;
 
-  if (new->a.class == InputOnly) {
-    // we used calloc, so no need to set zeroes
-    // new->damage_sequence = 0;
-    new->damage = None;
-  } else {
-    new->damage_sequence = NextRequest(dpy);
-    set_ignore(dpy, NextRequest(dpy));
-    new->damage = XDamageCreate(dpy, id, XDamageReportNonEmpty);
-  }
+  // we used calloc, so no need to set zeroes
+  // new->damage_sequence = 0;
+  new->damage = None;
+  new->setup_pending = true;
+  STAT_INC(win_creates);
 
   new->alpha_pict = None;
   new->alpha_border_pict = None;
   new->shadow_pict = None;
-  new->border_size = None;
   new->extents = None;
   new->shadow = None;
 
@@ -1737,54 +2629,152 @@ add_win(Display *dpy, Window id, Window prev) {
 
   new->opacity = OPAQUE;
 
-  new->border_clip = None;
-  get_frame_extents(new,
-    &new->left_width, &new->right_width,
-    &new->top_width, &new->bottom_width);
+  // prev is the sibling below the new window. A new window without one is
+  // placed on top, an unknown sibling moves the window to the bottom.
+  win_list_insert_above(new, prev ? find_win(prev) : list);
+  win_index_add(new);
+  return new;
+}
 
-  new->next = *p;
-  *p = new;
+static void
+add_win(Display *dpy, Window id, Window prev) {
+  XWindowAttributes a;
+  win *w;
 
-  if (new->a.map_state == IsViewable) {
-    new->window_type = determine_wintype(dpy, id, id);
-    new->opacity = win_suggest_opacity(new, &new->userdefined_opacity);
-    map_win(dpy, id, new->damage_sequence - 1, True);
+  if (unlikely(!win_attributes_reply(win_attributes_request(id), &a))) {
+    return;
+  }
+  w = add_win_create(dpy, id, prev, &a);
+  // Most windows are created unmapped and many of them, like tooltips or
+  // toolkit helper windows, are destroyed without ever being mapped. Defer
+  // their setup to map_win.
+  if (likely(w) && w->a.map_state == IsViewable) {
+    win_setup(dpy, w);
   }
 }
 
+// Toplevels found at startup, whose setup is still pending.
+static Window *startup_wins;
+static int startup_nwins;
+static int startup_next;
+
+/// Create the records of all existing toplevels under a server grab. Only
+/// the attributes are read during the grab, all requested at once. Clients
+/// and properties of viewable windows are read afterwards by
+/// startup_setup_batch, so the grab costs two round trips, regardless of the
+/// number of windows. Unmapped windows are set up, once mapped.
 static void
-set_paint_ignore_region_dirty(void){
-  g_paint_ignore_region_is_dirty = True;
-}
+startup_scan(Display *dpy) {
+  xcb_query_tree_reply_t *tree;
+  xcb_window_t *children;
+  WinAttrCookie *cookies;
+  XWindowAttributes a;
+  int nchildren, i;
+  win *w;
 
-void
-restack_win(Display *dpy, win *w, Window new_above) {
-  Window old_above;
+  XGrabServer(dpy);
 
-  if (w->next) {
-    old_above = w->next->id;
-  } else {
-    old_above = None;
-  }
+  XCompositeRedirectSubwindows(
+    dpy, root, CompositeRedirectManual);
 
-  if (old_above != new_above) {
-    win **prev;
+  XSelectInput(dpy, root,
+    SubstructureNotifyMask
+    | ExposureMask
+    | StructureNotifyMask
+    | PropertyChangeMask);
 
-    /* unhook */
-    for (prev = &list; *prev; prev = &(*prev)->next) {
-      if ((*prev) == w) break;
+  tree = xtree_reply(xcb_query_tree(g_xcb, root));
+  if (!tree) {
+    XUngrabServer(dpy);
+    return;
+  }
+  children = xcb_query_tree_children(tree);
+  nchildren = xcb_query_tree_children_length(tree);
+  cookies = malloc(nchildren * sizeof(*cookies));
+  startup_wins = malloc(nchildren * sizeof(*startup_wins));
+  if (unlikely(nchildren && (!cookies || !startup_wins))) {
+    // Set up one by one
+    for (i = 0; i < nchildren; i++) {
+      add_win(dpy, children[i], i ? children[i-1] : None);
     }
+    goto free_out;
+  }
 
-    *prev = w->next;
-
-    /* rehook */
-    for (prev = &list; *prev; prev = &(*prev)->next) {
-      if ((*prev)->id == new_above && !(*prev)->destroyed)
-        break;
+  for (i = 0; i < nchildren; i++) {
+    cookies[i] = win_attributes_request(children[i]);
+  }
+  for (i = 0; i < nchildren; i++) {
+    if (!win_attributes_reply(cookies[i], &a)) continue;
+    w = add_win_create(dpy, children[i], i ? children[i-1] : None, &a);
+    if (likely(w) && w->a.map_state == IsViewable) {
+      win_create_damage(dpy, w);
+      startup_wins[startup_nwins++] = w->id;
     }
+  }
+
+free_out:
+  XUngrabServer(dpy);
+  free(cookies);
+  free(tree);
+}
+
+static inline bool
+startup_pending(void) {
+  return startup_next < startup_nwins;
+}
+
+/// Set up the next STARTUP_BATCH windows found by startup_scan. The client
+/// searches of all of them are issued at once, followed by all other
+/// requests of their setup.
+static void
+startup_setup_batch(Display *dpy) {
+  ClientCookie client_cookies[STARTUP_BATCH];
+  WinSetupCookie setup_cookies[STARTUP_BATCH];
+  win *wins[STARTUP_BATCH];
+  int n = 0, i;
+
+  for (; startup_next < startup_nwins && n < STARTUP_BATCH; startup_next++) {
+    win *w = find_win(startup_wins[startup_next]);
+    // The window may have been destroyed or set up on demand meanwhile
+    if (!w || !w->setup_pending) continue;
+    wins[n] = w;
+    client_cookies[n] = win_client_request(w);
+    n++;
+  }
+  for (i = 0; i < n; i++) {
+    Window client = win_client_reply(wins[i], client_cookies[i]);
+    setup_cookies[i] = win_setup_request(wins[i], client);
+  }
+  for (i = 0; i < n; i++) {
+    win_setup_reply(dpy, wins[i], setup_cookies[i]);
+  }
 
-    w->next = *prev;
-    *prev = w;
+  if (!startup_pending()) {
+    free(startup_wins);
+    startup_wins = NULL;
+    startup_nwins = startup_next = 0;
+  }
+}
+
+static void
+set_paint_ignore_region_dirty(void){
+  g_paint_ignore_region_is_dirty = True;
+  g_paint_ignore_region_all_dirty = True;
+}
+
+/// Only w changed, what it covers or whether it is painted at all.
+static void
+set_win_ignore_region_dirty(win *w){
+  g_paint_ignore_region_is_dirty = True;
+  w->occlusion_dirty = true;
+}
+
+void
+restack_win(Display *dpy, win *w, Window new_above) {
+  // new_above is the sibling directly below w, or None, if w is the
+  // bottommost window.
+  if (win_list_restack(w, new_above ? find_win(new_above) : NULL)) {
+    set_paint_ignore_region_dirty();
   }
 }
 
@@ -1795,6 +2785,11 @@ do_configure_win(Display *dpy, win* w){
   w->need_configure = False;
   w->a.x = ce->x;
   w->a.y = ce->y;
+  // The shape only moves along, unless the size changes
+  region_clear(&w->border_size);
+  if (w->configure_size_changed || w->a.border_width != ce->border_width) {
+    w->shape_valid = false;
+  }
   if (w->configure_size_changed) {
 
 #if HAS_NAME_WINDOW_PIXMAP
@@ -1808,10 +2803,7 @@ do_configure_win(Display *dpy, win* w){
     }
 #endif
 
-    if (w->shadow) {
-      XRenderFreePicture(dpy, w->shadow);
-      w->shadow = None;
-    }
+    win_stale_shadow(dpy, w);
   }
 
   w->a.width = ce->width;
@@ -1828,12 +2820,13 @@ do_configure_win(Display *dpy, win* w){
       add_damage(dpy, w->extents);
     }
     add_damage(dpy, win_extents(dpy, w));
+  } else {
+    w->extents_dirty = true;
   }
 
-  clip_changed = True;
   w->a.override_redirect = ce->override_redirect;
   w->configure_size_changed = false;
-  set_paint_ignore_region_dirty();
+  set_win_ignore_region_dirty(w);
 }
 
 Bool g_configure_needed = False;
@@ -1850,6 +2843,8 @@ handle_ConfigureNotify(Display *dpy, XConfigureEvent *ce) {
       }
       root_width = ce->width;
       root_height = ce->height;
+      root_outputs_update();
+      set_paint_ignore_region_dirty();
     }
     return;
   }
@@ -1871,76 +2866,60 @@ handle_ConfigureNotify(Display *dpy, XConfigureEvent *ce) {
 static void
 circulate_win(Display *dpy, XCirculateEvent *ce) {
   win *w = find_win(ce->window);
-  Window new_above;
 
   if (!w) return;
 
-  if (ce->place == PlaceOnTop) {
-    new_above = list->id;
-  } else {
-    new_above = None;
+  if (win_list_restack(w, (ce->place == PlaceOnTop) ? list : NULL)) {
+    set_paint_ignore_region_dirty();
   }
-
-  restack_win(dpy, w, new_above);
-  clip_changed = True;
 }
 
 static void
-finish_destroy_win(Display *dpy, Window id) {
-  win **prev, *w;
-
-  for (prev = &list; (w = *prev); prev = &w->next) {
-    if (w->id == id && w->destroyed) {
-      finish_unmap_win(dpy, w);
-      *prev = w->next;
+finish_destroy_win(Display *dpy, win *w) {
+  finish_unmap_win(dpy, w);
+  win_list_unhook(w);
+  win_index_remove(w);
 
-      if (w->alpha_pict) {
-        XRenderFreePicture(dpy, w->alpha_pict);
-        w->alpha_pict = None;
-      }
+  if (w->alpha_pict) {
+    XRenderFreePicture(dpy, w->alpha_pict);
+    w->alpha_pict = None;
+  }
 
-      if (w->alpha_border_pict) {
-        XRenderFreePicture(dpy, w->alpha_border_pict);
-        w->alpha_border_pict = None;
-      }
+  if (w->alpha_border_pict) {
+    XRenderFreePicture(dpy, w->alpha_border_pict);
+    w->alpha_border_pict = None;
+  }
 
-      if (w->shadow_pict) {
-        XRenderFreePicture(dpy, w->shadow_pict);
-        w->shadow_pict = None;
-      }
+  if (w->shadow_pict) {
+    XRenderFreePicture(dpy, w->shadow_pict);
+    w->shadow_pict = None;
+  }
 
-      /* fix leak, from freedesktop repo */
-      if (w->shadow) {
-        XRenderFreePicture (dpy, w->shadow);
-        w->shadow = None;
-      }
+  /* fix leak, from freedesktop repo */
+  win_free_shadow(dpy, w);
 
-      if (w->damage != None) {
-        set_ignore(dpy, NextRequest(dpy));
-        XDamageDestroy(dpy, w->damage);
-        w->damage = None;
-      }
+  if (w->damage != None) {
+    xcb_forget(xcb_damage_destroy_checked(g_xcb, w->damage));
+    w->damage = None;
+  }
 
-      cleanup_fade(dpy, w);
+  cleanup_fade(dpy, w);
 
-      if (w->border_clip) {
-        XFixesDestroyRegion(dpy, w->border_clip);
-        w->border_clip = None;
-      }
-      if(w->extents){
-        XFixesDestroyRegion(dpy, w->extents);
-        w->extents = None;
-      }
-      free(w);
-      break;
-    }
+  region_fini(&w->border_clip);
+  region_fini(&w->border_size);
+  region_fini(&w->shape);
+  region_fini(&w->opaque_region);
+  if(w->extents){
+    XFixesDestroyRegion(dpy, w->extents);
+    w->extents = None;
   }
+  free(w);
 }
 
 #if HAS_NAME_WINDOW_PIXMAP
 static void
 destroy_callback(Display *dpy, win *w) {
-  finish_destroy_win(dpy, w->id);
+  finish_destroy_win(dpy, w);
 }
 #endif
 
@@ -1948,19 +2927,26 @@ static void
 destroy_win(Display *dpy, Window id, Bool fade) {
   win *w = find_win(id);
 
-  if (w) w->destroyed = True;
+  if (!w) return;
+
+  if (w->setup_pending) {
+    STAT_INC(win_setups_avoided);
+  }
+  w->destroyed = True;
+  // find_win must not return destroyed windows, which may still be fading out
+  win_index_remove(w);
 
   set_paint_ignore_region_dirty();
 
 #if HAS_NAME_WINDOW_PIXMAP
-  if (w && w->pixmap && fade && win_type_fade[w->window_type]) {
+  if (w->pixmap && fade && win_type_fade[w->window_type]) {
     set_fade(dpy, w, w->opacity * 1.0 / OPAQUE,
       0.0, fade_out_step, destroy_callback,
       False, True);
   } else
 #endif
   {
-    finish_destroy_win(dpy, id);
+    finish_destroy_win(dpy, w);
   }
 }
 
@@ -1984,12 +2970,43 @@ dump_wins(void) {
 }
 #endif
 
+/// The bounding shape of w changed. Refetch it, once it is painted next, and
+/// repaint w, since parts of the windows below may be (un)covered now.
+static void
+shape_win(Display *dpy, XShapeEvent *se) {
+  win *w;
+
+  if (se->kind != ShapeBounding) return;
+  w = find_win(se->window);
+  if (unlikely(!w)) return;
+
+  w->shape_valid = false;
+  region_clear(&w->border_size);
+  if (w->a.map_state == IsViewable && !w->setup_pending) {
+    if (w->extents) {
+      add_damage(dpy, w->extents);
+    }
+    set_win_ignore_region_dirty(w);
+  }
+}
+
 static void
 damage_win(Display *dpy, XDamageNotifyEvent *de) {
   win *w = find_win(de->drawable);
 
   if (unlikely(!w)) return;
 
+  // Don't block on the setup, the window is repaired once it completes
+  if (unlikely(w->setup_pending)) {
+    w->setup_damaged = true;
+    return;
+  }
+  // Reported before the Damage object was destroyed
+  if (unlikely(w->damage_suspended)) {
+    STAT_INC(damage_events_dropped);
+    return;
+  }
+
 #if CAN_DO_USABLE
   if (!w->usable) {
     if (w->damage_bounds.width == 0 || w->damage_bounds.height == 0) {
@@ -2031,7 +3048,7 @@ damage_win(Display *dpy, XDamageNotifyEvent *de) {
         && w->damage_bounds.y <= 0
         && w->a.width <= w->damage_bounds.x + w->damage_bounds.width
         && w->a.height <= w->damage_bounds.y + w->damage_bounds.height) {
-      clip_changed = True;
+      set_win_ignore_region_dirty(w);
       if (win_type_fade[w->window_type]) {
         set_fade(dpy, w, 0, get_opacity_percent(dpy, w),
                  fade_in_step, 0, True, True);
@@ -2054,6 +3071,13 @@ error(Display *dpy, XErrorEvent *ev) {
     return 0;
   }
 
+  if (has_shm && ev->request_code == shm_opcode
+      && ev->minor_code == X_ShmAttach) {
+    // e.g. a remote server, see a8_arena_shm
+    has_shm = False;
+    return 0;
+  }
+
   if (ev->request_code == composite_opcode
       && ev->minor_code == X_CompositeRedirectSubwindows) {
     fprintf(stderr, "Another composite manager is already running\n");
@@ -2113,6 +3137,18 @@ expose_root(Display *dpy, Window root, XRectangle *rects, int nrects) {
   add_damage(dpy, g_xregion_tmp);
 }
 
+/// The output configuration changed, parts of the root may have become
+/// visible or hidden.
+static void
+outputs_changed(Display *dpy, XEvent *ev) {
+  XRectangle r = { .x = 0, .y = 0, .width = root_width, .height = root_height };
+
+  XRRUpdateConfiguration(ev);
+  root_outputs_update();
+  expose_root(dpy, root, &r, 1);
+  set_paint_ignore_region_dirty();
+}
+
 #if DEBUG_EVENTS
 static int
 ev_serial(XEvent *ev) {
@@ -2224,7 +3260,10 @@ usage(char *program, int exitcode) {
     --shadow-green value
     Green color value of shadow (0.0 - 1.0, defaults to 0).
     --shadow-blue value
-    Blue color value of shadow (0.0 - 1.0, defaults to 0).)SOMERANDOMTEXT"
+    Blue color value of shadow (0.0 - 1.0, defaults to 0).
+    --damage-max-rects count
+    Paint fragmented damage of more rectangles as merged tiles or as its
+    bounding box, if that is cheaper. (default 256))SOMERANDOMTEXT"
   );
   fprintf(stderr, "\n");
 
@@ -2235,19 +3274,14 @@ static Bool
 register_cm (Display *dpy)
 {
   Window w;
-  Atom a;
-  static char net_wm_cm[] = "_NET_WM_CM_Sxx";
 
-  snprintf (net_wm_cm, sizeof (net_wm_cm), "_NET_WM_CM_S%d", g_screen);
-  a = XInternAtom (dpy, net_wm_cm, False);
-  w = XGetSelectionOwner (dpy, a);
+  w = XGetSelectionOwner (dpy, atom_net_wm_cm_s);
   if (w != None) {
     XTextProperty tp;
     char **strs;
     int count;
-    Atom winNameAtom = XInternAtom (dpy, "_NET_WM_NAME", False);
 
-    if (!XGetTextProperty (dpy, w, &tp, winNameAtom) &&
+    if (!XGetTextProperty (dpy, w, &tp, atom_net_wm_name) &&
         !XGetTextProperty (dpy, w, &tp, XA_WM_NAME))
     {
       fprintf (stderr,
@@ -2271,7 +3305,7 @@ register_cm (Display *dpy)
   Xutf8SetWMProperties (dpy, w, "fastcompmgr", "fastcompmgr", NULL, 0, NULL, NULL,
       NULL);
 
-  XSetSelectionOwner (dpy, a, w, 0);
+  XSetSelectionOwner (dpy, atom_net_wm_cm_s, w, 0);
   return True;
 }
 
@@ -2289,7 +3323,6 @@ do_paint(Display *dpy){
    paint_all(dpy, all_damage);
    XSync(dpy, False);
    all_damage_is_dirty = False;
-   clip_changed = False;
 }
 
 static Bool configure_timer_started = False;
@@ -2331,6 +3364,59 @@ check_paint(Display *dpy){
   }
 }
 
+static void
+root_background_changed(Display *dpy, XPropertyEvent *pe) {
+  if (pe->window == root && root_tile) {
+    XClearArea(dpy, root, 0, 0, 0, 0, True);
+    XRenderFreePicture(dpy, root_tile);
+    root_tile = None;
+  }
+}
+
+static void
+opacity_changed(Display *dpy, XPropertyEvent *pe) {
+  /* reset mode and redraw window */
+  win *w = find_win(pe->window);
+  if (w) {
+    prop_changed(w, pe, WINPROP_OPACITY);
+    uint opacity = win_suggest_opacity(w, &w->userdefined_opacity);
+    set_opacity(dpy, w, opacity);
+  }
+}
+
+static void
+net_wm_state_changed(Display *dpy, XPropertyEvent *pe) {
+  add_damage_if_hidden_changed(pe->window, false);
+}
+
+typedef void (*prop_handler)(Display *dpy, XPropertyEvent *pe);
+
+/// The properties we care about. Chatty clients change others (e.g. their
+/// title) all the time, those must be skipped without any request.
+static const struct {
+  const Atom *atom;
+  prop_handler handler;
+} prop_handlers[] = {
+  { &atom_opacity, opacity_changed },
+  { &atom_net_wm_state, net_wm_state_changed },
+  { &atom_win_type, wintype_changed },
+  { &atom_gtk_frame_extents, gtk_frame_extents_changed },
+  { &atom_net_wm_opaque_region, opaque_region_changed },
+  { &atom_net_frame_extents, net_frame_extents_changed },
+  { &atom_root_background[0], root_background_changed },
+  { &atom_root_background[1], root_background_changed },
+};
+
+static void
+handle_PropertyNotify(Display *dpy, XPropertyEvent *pe) {
+  for (size_t i = 0; i < sizeof(prop_handlers) / sizeof(prop_handlers[0]); i++) {
+    if (pe->atom == *prop_handlers[i].atom) {
+      prop_handlers[i].handler(dpy, pe);
+      return;
+    }
+  }
+}
+
 
 int
 main(int argc, char **argv) {
@@ -2339,19 +3425,16 @@ main(int argc, char **argv) {
     { "shadow-green", required_argument, NULL, 0 },
     { "shadow-blue", required_argument, NULL, 0 },
     { "help", no_argument, NULL, 0 },
+    { "damage-max-rects", required_argument, NULL, 0 },
     { 0, 0, 0, 0 },
   };
 
   XEvent ev;
-  Window root_return, parent_return;
-  Window *children;
-  unsigned int nchildren;
   int i;
   XRectangle *expose_rects = 0;
   int size_expose = 0;
   int n_expose = 0;
-  struct pollfd ufd;
-  int p;
+  struct pollfd ufd[2];
   int composite_major, composite_minor;
   double shadow_red = 0.0;
   double shadow_green = 0.0;
@@ -2360,7 +3443,7 @@ main(int argc, char **argv) {
   int o;
   int longopt_idx;
   Bool no_dock_shadow = False;
-  if(!event_init()){
+  if(!event_init() || !win_init() || !format_init()){
     exit(1);
   }
 
@@ -2380,6 +3463,12 @@ main(int argc, char **argv) {
           case 1: shadow_green = normalize_d(atof(optarg)); break;
           case 2: shadow_blue = normalize_d(atof(optarg)); break;
           case 3: usage(argv[0], 0); break;
+          case 4:
+            damage_max_rects = atoi(optarg);
+            if (damage_max_rects < 1) {
+              damage_max_rects = 1;
+            }
+            break;
           default:
             fprintf(stderr, "Bug, unhandeled longopt_idx %d\n", longopt_idx);
             exit(2);
@@ -2472,6 +3561,7 @@ main(int argc, char **argv) {
     exit(1);
   }
   g_dpy = dpy;
+  g_xcb = XGetXCBConnection(dpy);
 
   XSetErrorHandler(error);
   if (synchronize) {
@@ -2510,61 +3600,25 @@ main(int argc, char **argv) {
     exit(1);
   }
 
-  if(! register_cm(dpy))
+  // Without XShape, all windows are treated as rectangles.
+  has_shape = XShapeQueryExtension(dpy, &shape_event, &shape_error);
+
+  // Without MIT-SHM, shadows are uploaded through the socket.
+  {
+    int shm_event, shm_error;
+    has_shm = XQueryExtension(dpy, "MIT-SHM", &shm_opcode,
+                              &shm_event, &shm_error);
+  }
+
+  if(! atoms_init() || ! register_cm(dpy))
     exit(1);
 
-  /* get atoms */
-  atom_opacity = XInternAtom(dpy,
-    "_NET_WM_WINDOW_OPACITY", False);
-  atom_win_type = XInternAtom(dpy,
-    "_NET_WM_WINDOW_TYPE", False);
-  atom_pixmap = XInternAtom(dpy,
-    "PIXMAP", False);
-  atom_wm_state = XInternAtom(dpy,
-    "WM_STATE", False);
-  atom_net_frame_extents = XInternAtom(dpy,
-    "_NET_FRAME_EXTENTS", False);
-  atom_gtk_frame_extents = XInternAtom(dpy,
-    "_GTK_FRAME_EXTENTS", False);
-  atom_net_wm_state = XInternAtom(dpy,
-    "_NET_WM_STATE", False);
-  atom_net_wm_state_hidden = XInternAtom (dpy,
-    "_NET_WM_STATE_HIDDEN", False);
-  atom_net_wm_state_focused = XInternAtom (dpy,
-    "_NET_WM_STATE_FOCUSED", False);
-  atom_net_active_window = XInternAtom (dpy,
-    "_NET_ACTIVE_WINDOW", False);
-  win_type[WINTYPE_DESKTOP] = XInternAtom(dpy,
-    "_NET_WM_WINDOW_TYPE_DESKTOP", False);
-  win_type[WINTYPE_DOCK] = XInternAtom(dpy,
-    "_NET_WM_WINDOW_TYPE_DOCK", False);
-  win_type[WINTYPE_TOOLBAR] = XInternAtom(dpy,
-    "_NET_WM_WINDOW_TYPE_TOOLBAR", False);
-  win_type[WINTYPE_MENU] = XInternAtom(dpy,
-    "_NET_WM_WINDOW_TYPE_MENU", False);
-  win_type[WINTYPE_UTILITY] = XInternAtom(dpy,
-    "_NET_WM_WINDOW_TYPE_UTILITY", False);
-  win_type[WINTYPE_SPLASH] = XInternAtom(dpy,
-    "_NET_WM_WINDOW_TYPE_SPLASH", False);
-  win_type[WINTYPE_DIALOG] = XInternAtom(dpy,
-    "_NET_WM_WINDOW_TYPE_DIALOG", False);
-  win_type[WINTYPE_NORMAL] = XInternAtom(dpy,
-    "_NET_WM_WINDOW_TYPE_NORMAL", False);
-  win_type[WINTYPE_DROPDOWN_MENU] = XInternAtom(dpy,
-    "_NET_WM_WINDOW_TYPE_DROPDOWN_MENU", False);
-  win_type[WINTYPE_POPUP_MENU] = XInternAtom(dpy,
-    "_NET_WM_WINDOW_TYPE_POPUP_MENU", False);
-  win_type[WINTYPE_TOOLTIP] = XInternAtom(dpy,
-    "_NET_WM_WINDOW_TYPE_TOOLTIP", False);
-  win_type[WINTYPE_NOTIFY] = XInternAtom(dpy,
-    "_NET_WM_WINDOW_TYPE_NOTIFICATION", False);
-  win_type[WINTYPE_COMBO] = XInternAtom(dpy,
-    "_NET_WM_WINDOW_TYPE_COMBO", False);
-  win_type[WINTYPE_DND] = XInternAtom(dpy,
-    "_NET_WM_WINDOW_TYPE_DND", False);
-
-  gaussian_map = make_gaussian_map(dpy, shadow_radius);
+  a8_init_pad(dpy);
+  gaussian_map = make_gaussian_map(shadow_radius);
   presum_gaussian(gaussian_map);
+  shadow_simd_select(SHADOW_SIMD_AVX2);
+  shadow_cache_init(&shadow_cache, SHADOW_CACHE_BYTES, shadow_free_picture);
+  shadow_worker_init();
 
   if(!root_init()){
     exit(1);
@@ -2583,31 +3637,17 @@ main(int argc, char **argv) {
   all_damage_is_dirty = False;
   g_xregion_tmp = XFixesCreateRegion(dpy, 0, 0);
 
-  clip_changed = True;
-  XGrabServer(dpy);
-
-  XCompositeRedirectSubwindows(
-    dpy, root, CompositeRedirectManual);
-
-  XSelectInput(dpy, root,
-    SubstructureNotifyMask
-    | ExposureMask
-    | StructureNotifyMask
-    | PropertyChangeMask);
-
-  XQueryTree(dpy, root, &root_return,
-    &parent_return, &children, &nchildren);
-
-  for (i = 0; i < nchildren; i++) {
-    add_win(dpy, children[i], i ? children[i-1] : None);
-  }
-
-  XFree(children);
-
-  XUngrabServer(dpy);
+#if DEBUG_STARTUP
+  int startup_time = get_time_in_milliseconds();
+#endif
+  startup_scan(dpy);
+#if DEBUG_STARTUP
+  fprintf(stderr, "fastcompmgr startup: %d windows, server grabbed for %d ms\n",
+          startup_nwins, get_time_in_milliseconds() - startup_time);
+#endif
 
-  ufd.fd = ConnectionNumber(dpy);
-  ufd.events = POLLIN;
+  ufd[0].fd = ConnectionNumber(dpy);
+  ufd[0].events = POLLIN;
 
   {
     XRectangle root_rect = { .x=0, .y=0,
@@ -2615,18 +3655,42 @@ main(int argc, char **argv) {
     XFixesSetRegion(dpy, g_xregion_tmp, &root_rect, 1);
     paint_all(dpy, g_xregion_tmp);
   }
+#if DEBUG_STARTUP
+  XSync(dpy, False);
+  fprintf(stderr, "fastcompmgr startup: first frame after %d ms\n",
+          get_time_in_milliseconds() - startup_time);
+#endif
 
   for (;;) {
     /*    dump_wins(); */
     do {
+      // Windows found at startup are set up between events, so their
+      // setup does not delay painting the others.
+      if (unlikely(startup_pending()) && !QLength(dpy) && !XPending(dpy)) {
+        startup_setup_batch(dpy);
+#if DEBUG_STARTUP
+        if (!startup_pending()) {
+          XSync(dpy, False);
+          fprintf(stderr, "fastcompmgr startup: all windows set up after %d ms\n",
+                  get_time_in_milliseconds() - startup_time);
+        }
+#endif
+        break;
+      }
       if (!QLength(dpy)) {
         // TODO: check and re-implement fade time logic.
         int timeout = (configure_timer_started) ? 2 : fade_timeout();
-        if (unlikely(poll(&ufd, 1, timeout) == 0)) {
+        ufd[1].fd = shadow_worker.pipe[0];
+        ufd[1].events = POLLIN;
+        if (unlikely(poll(ufd, 2, timeout) == 0)) {
           check_paint(dpy);
            //   run_fades(dpy);
           break;
         }
+        if (ufd[1].revents & POLLIN) {
+          shadow_worker_collect(dpy);
+          if (!ufd[0].revents) break;
+        }
       }
 
       XNextEvent(dpy, &ev);
@@ -2679,6 +3743,7 @@ main(int argc, char **argv) {
           handle_ConfigureNotify(dpy, &ev.xconfigure);
           break;
         case DestroyNotify:
+          win_client_forget(ev.xdestroywindow.window);
           destroy_win(dpy, ev.xdestroywindow.window, True);
           break;
         case MapNotify:
@@ -2698,12 +3763,19 @@ main(int argc, char **argv) {
           // a hidden window where the client is reparented may remain hidden.
           // I did not see this in pracice though, since we take the _NET_WM_STATE_HIDDEN
           // from the client window and the client *should* be tied to its toplevel window.
+          // Any cached client->toplevel relation of the window is stale now.
+          win_client_forget(ev.xreparent.window);
+          {
+            win *pw = find_win(ev.xreparent.parent);
+            if (pw) win_client_invalidate(pw);
+          }
           if (ev.xreparent.parent == root) {
             add_win(dpy, ev.xreparent.window, 0);
           } else {
-            add_damage_if_hidden_changed(ev.xreparent.window, true);
             // FIXME: we only manage toplevel windows, so does this EVER fire?
             destroy_win(dpy, ev.xreparent.window, True);
+            // Only now, the window resolves to its new toplevel instead of itself.
+            add_damage_if_hidden_changed(ev.xreparent.window, true);
           }
           break;
         case CirculateNotify:
@@ -2734,32 +3806,7 @@ main(int argc, char **argv) {
           }
           break;
         case PropertyNotify:
-          for (p = 0; root_background_props[p]; p++) {
-            if (ev.xproperty.atom ==
-                XInternAtom(dpy, root_background_props[p], False)) {
-              if (root_tile) {
-                XClearArea(dpy, root, 0, 0, 0, 0, True);
-                XRenderFreePicture(dpy, root_tile);
-                root_tile = None;
-                break;
-              }
-            }
-          }
-          // if (ev.xproperty.atom == atom_net_active_window) {
-          //   fprintf(stderr, "active win changed\n");
-          // }
-
-          /* check if Trans property was changed */
-          if (ev.xproperty.atom == atom_opacity) {
-            /* reset mode and redraw window */
-            win *w = find_win(ev.xproperty.window);
-            if (w) {
-              uint opacity = win_suggest_opacity(w, &w->userdefined_opacity);
-              set_opacity(dpy, w, opacity);
-            }
-          } else if (ev.xproperty.atom == atom_net_wm_state) {
-            add_damage_if_hidden_changed(ev.xproperty.window, false);
-          }
+          handle_PropertyNotify(dpy, &ev.xproperty);
           break;
         case SelectionClear:
           fprintf(stderr, "Another composite manager started and took the _NET_WM_CM_Sn "
@@ -2769,11 +3816,17 @@ main(int argc, char **argv) {
         default:
           if (likely(ev.type == damage_event + XDamageNotify)) {
             damage_win(dpy, (XDamageNotifyEvent *)&ev);
+          } else if (has_shape && ev.type == shape_event + ShapeNotify) {
+            shape_win(dpy, (XShapeEvent *)&ev);
+          } else if (has_randr && (ev.type == randr_event + RRScreenChangeNotify ||
+                                   ev.type == randr_event + RRNotify)) {
+            outputs_changed(dpy, &ev);
           }
           break;
       }
     } while (QLength(dpy));
 
     check_paint(dpy);
+    stats_maybe_print();
   }
 }
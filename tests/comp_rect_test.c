@@ -0,0 +1,234 @@
+#include <string.h>
+
+#include "test.h"
+#include "comp_rect.h"
+
+// Every region operation is checked against a bitmap model on a small grid,
+// with random regions built from overlapping rectangles, so that bands split,
+// merge and coalesce in all ways. Negative coordinates are included.
+
+#define ORG (-8)
+#define SIZE 48
+
+typedef struct {
+  unsigned char px[SIZE][SIZE];
+} Bitmap;
+
+static void
+bitmap_from_region(Bitmap *b, const CompRegion *r) {
+  memset(b, 0, sizeof(*b));
+  for (int i = 0; i < r->n; i++) {
+    for (int y = r->rects[i].y1; y < r->rects[i].y2; y++) {
+      for (int x = r->rects[i].x1; x < r->rects[i].x2; x++) {
+        CHECK(x >= ORG && x < ORG + SIZE && y >= ORG && y < ORG + SIZE);
+        // rects never overlap
+        CHECK(!b->px[y - ORG][x - ORG]);
+        b->px[y - ORG][x - ORG] = 1;
+      }
+    }
+  }
+}
+
+static void
+bitmap_set_rect(Bitmap *b, const CompRect *r) {
+  for (int y = r->y1; y < r->y2; y++) {
+    for (int x = r->x1; x < r->x2; x++) {
+      b->px[y - ORG][x - ORG] = 1;
+    }
+  }
+}
+
+/// Check the y-x banded form, which makes the representation unique.
+static void
+check_canonical(const CompRegion *r) {
+  CompRect e = { 0 };
+
+  for (int i = 0; i < r->n; i++) {
+    const CompRect *a = &r->rects[i];
+    CHECK(!rect_is_empty(a));
+    if (i == 0) {
+      e = *a;
+    } else {
+      if (a->x1 < e.x1) e.x1 = a->x1;
+      if (a->x2 > e.x2) e.x2 = a->x2;
+      if (a->y2 > e.y2) e.y2 = a->y2;
+    }
+    if (i > 0) {
+      const CompRect *p = &r->rects[i - 1];
+      if (p->y1 == a->y1) {
+        // same band: sorted, neither overlapping nor touching
+        CHECK(p->y2 == a->y2);
+        CHECK(p->x2 < a->x1);
+      } else {
+        CHECK(p->y2 <= a->y1);
+      }
+    }
+  }
+  // Adjacent bands with the same spans are coalesced
+  for (int i = 0; i < r->n;) {
+    int j = i, k;
+    while (j < r->n && r->rects[j].y1 == r->rects[i].y1) j++;
+    k = j;
+    while (k < r->n && r->rects[k].y1 == r->rects[j].y1) k++;
+    if (j < r->n && k - j == j - i && r->rects[i].y2 == r->rects[j].y1) {
+      bool same = true;
+      for (int m = 0; m < j - i; m++) {
+        same &= r->rects[i + m].x1 == r->rects[j + m].x1 &&
+                r->rects[i + m].x2 == r->rects[j + m].x2;
+      }
+      CHECK(!same);
+    }
+    i = j;
+  }
+  if (r->n) {
+    CHECK(memcmp(&e, &r->extents, sizeof(e)) == 0);
+  }
+}
+
+static CompRect
+random_rect(void) {
+  CompRect r;
+  r.x1 = test_rand_range(ORG, ORG + SIZE - 1);
+  r.y1 = test_rand_range(ORG, ORG + SIZE - 1);
+  r.x2 = test_rand_range(r.x1 + 1, ORG + SIZE + 1);
+  r.y2 = test_rand_range(r.y1 + 1, ORG + SIZE + 1);
+  if (r.x2 > ORG + SIZE) r.x2 = ORG + SIZE;
+  if (r.y2 > ORG + SIZE) r.y2 = ORG + SIZE;
+  return r;
+}
+
+static void
+random_region(CompRegion *r, Bitmap *b) {
+  int n = test_rand_range(0, 8);
+
+  region_clear(r);
+  memset(b, 0, sizeof(*b));
+  for (int i = 0; i < n; i++) {
+    CompRect rect = random_rect();
+    CHECK(region_union_rect(r, &rect));
+    bitmap_set_rect(b, &rect);
+  }
+  check_canonical(r);
+}
+
+static void
+check_equals(const CompRegion *r, const Bitmap *expected) {
+  Bitmap b;
+  check_canonical(r);
+  bitmap_from_region(&b, r);
+  CHECK(memcmp(&b, expected, sizeof(b)) == 0);
+}
+
+enum { OP_OR, OP_AND, OP_AND_NOT };
+
+static void
+bitmap_op(Bitmap *d, const Bitmap *a, const Bitmap *b, int op) {
+  for (int y = 0; y < SIZE; y++) {
+    for (int x = 0; x < SIZE; x++) {
+      unsigned char pa = a->px[y][x], pb = b->px[y][x];
+      d->px[y][x] = op == OP_OR ? pa | pb : op == OP_AND ? pa & pb : pa & !pb;
+    }
+  }
+}
+
+static long long
+bitmap_area(const Bitmap *b) {
+  long long area = 0;
+  for (int y = 0; y < SIZE; y++) {
+    for (int x = 0; x < SIZE; x++) area += b->px[y][x];
+  }
+  return area;
+}
+
+int
+main(void) {
+  CompRegion a, b, d;
+  Bitmap ba, bb, bd;
+
+  region_init(&a);
+  region_init(&b);
+  region_init(&d);
+
+  // Copying an empty region must not touch its (NULL) rects
+  CHECK(region_copy(&d, &a));
+  CHECK(region_is_empty(&d));
+
+  for (int it = 0; it < 20000; it++) {
+    CompRect rect = random_rect();
+    bool all, any;
+
+    random_region(&a, &ba);
+    random_region(&b, &bb);
+
+    CHECK(region_union(&d, &a, &b));
+    bitmap_op(&bd, &ba, &bb, OP_OR);
+    check_equals(&d, &bd);
+
+    CHECK(region_intersect(&d, &a, &b));
+    bitmap_op(&bd, &ba, &bb, OP_AND);
+    check_equals(&d, &bd);
+
+    CHECK(region_subtract(&d, &a, &b));
+    bitmap_op(&bd, &ba, &bb, OP_AND_NOT);
+    check_equals(&d, &bd);
+    CHECK(region_area(&d) == bitmap_area(&bd));
+
+    // In place, as the compositor mostly uses them
+    CHECK(region_copy(&d, &a));
+    CHECK(region_subtract(&d, &d, &b));
+    check_equals(&d, &bd);
+
+    all = true;
+    any = false;
+    for (int y = rect.y1; y < rect.y2; y++) {
+      for (int x = rect.x1; x < rect.x2; x++) {
+        all &= ba.px[y - ORG][x - ORG];
+        any |= ba.px[y - ORG][x - ORG];
+      }
+    }
+    CHECK(region_contains_rect(&a, &rect) == all);
+    CHECK(region_intersects_rect(&a, &rect) == any);
+
+    CHECK(region_copy(&d, &a));
+    CHECK(region_union_rect(&d, &rect));
+    bd = ba;
+    bitmap_set_rect(&bd, &rect);
+    check_equals(&d, &bd);
+
+    // Tiles cover the region and only touched cells
+    CHECK(region_copy(&d, &a));
+    CHECK(region_tile(&d, 4));
+    check_canonical(&d);
+    bitmap_from_region(&bd, &d);
+    for (int y = 0; y < SIZE; y++) {
+      for (int x = 0; x < SIZE; x++) {
+        bool touched = false;
+        CHECK(!ba.px[y][x] || bd.px[y][x]);
+        for (int ty = y & ~3; ty < (y & ~3) + 4 && ty < SIZE; ty++) {
+          for (int tx = x & ~3; tx < (x & ~3) + 4 && tx < SIZE; tx++) {
+            touched |= ba.px[ty][tx];
+          }
+        }
+        // ORG is a multiple of 4, so cells are aligned to the bitmap
+        if (a.n > 1) CHECK(bd.px[y][x] == touched);
+      }
+    }
+
+    CHECK(region_copy(&d, &a));
+    region_translate(&d, 3, -2);
+    region_translate(&d, -3, 2);
+    check_equals(&d, &ba);
+  }
+
+  // 32 bit areas of a large multi-monitor root
+  {
+    CompRect big = { .x1 = 0, .y1 = 0, .x2 = 3 * 7680, .y2 = 4320 };
+    CHECK(region_set_rect(&d, &big));
+    CHECK(region_area(&d) == 3LL * 7680 * 4320);
+  }
+
+  region_fini(&a);
+  region_fini(&b);
+  region_fini(&d);
+  return 0;
+}
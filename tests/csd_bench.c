@@ -0,0 +1,133 @@
+#include <string.h>
+
+#include "test.h"
+#include "comp_rect.h"
+
+// A stack of client-side decorated GTK windows on a 3840x2160 root. They use
+// ARGB visuals, draw their shadow into a transparent margin and declare the
+// rest, except the rounded top corners, as _NET_WM_OPAQUE_REGION. Without
+// the opaque region, all of them are blended, with it, windows below are
+// culled and the opaque parts copied. Per pixel, OVER and SRC are measured,
+// so the composites of one full-screen repaint can be compared.
+
+enum { ROOT_W = 3840, ROOT_H = 2160, MARGIN = 26, RADIUS = 8 };
+
+typedef struct {
+  CompRect r;       // the window, including its shadow margin
+  CompRegion opaque;
+} csd_win;
+
+static void
+csd_layout(csd_win *wins, int n) {
+  for (int i = 0; i < n; i++) {
+    int w = test_rand_range(900, 1800), h = test_rand_range(700, 1300);
+    int x = test_rand_range(-MARGIN, ROOT_W - w + MARGIN);
+    int y = test_rand_range(-MARGIN, ROOT_H - h + MARGIN);
+    CompRect top = { x + MARGIN + RADIUS, y + MARGIN,
+                     x + w - MARGIN - RADIUS, y + MARGIN + RADIUS };
+    CompRect body = { x + MARGIN, y + MARGIN + RADIUS,
+                      x + w - MARGIN, y + h - MARGIN };
+
+    wins[i].r = (CompRect){ x, y, x + w, y + h };
+    region_init(&wins[i].opaque);
+    region_union_rect(&wins[i].opaque, &top);
+    region_union_rect(&wins[i].opaque, &body);
+  }
+}
+
+typedef struct {
+  int painted;
+  long long blended, copied;
+} csd_result;
+
+/// The culling and clipping pass of paint_all for a full repaint.
+static csd_result
+csd_pass(const csd_win *wins, int n, bool use_opaque, CompRegion *occluded,
+         CompRegion *paint, CompRegion *clip) {
+  CompRect screen = { 0, 0, ROOT_W, ROOT_H };
+  csd_result res = { 0 };
+
+  region_clear(occluded);
+  region_set_rect(paint, &screen);
+  for (int i = 0; i < n; i++) {
+    CompRect v;
+    rect_intersect(&v, &wins[i].r, &screen);
+    if (rect_is_empty(&v) || region_contains_rect(occluded, &v)) continue;
+    res.painted++;
+    if (use_opaque) {
+      region_intersect(clip, paint, &wins[i].opaque);
+      res.copied += region_area(clip);
+      region_subtract(paint, paint, &wins[i].opaque);
+      region_union(occluded, occluded, &wins[i].opaque);
+    }
+    // blended later, below everything above, through what is left
+    region_set_rect(clip, &v);
+    region_intersect(clip, clip, paint);
+    res.blended += region_area(clip);
+  }
+  return res;
+}
+
+int
+main(void) {
+  static const int counts[] = { 4, 8, 16, 32, 64 };
+  enum { TILE = 1024 };
+  uint32_t *dst = calloc(TILE * TILE, 4), *src = malloc(TILE * TILE * 4);
+  CompRegion occluded, paint, clip;
+  double t_over, t_src, t0;
+  int reps;
+
+  CHECK(dst && src);
+  for (int i = 0; i < TILE * TILE; i++) src[i] = 0xc0604020u + i;
+  region_init(&occluded);
+  region_init(&paint);
+  region_init(&clip);
+
+  t0 = bench_now();
+  for (reps = 0; bench_now() - t0 < 0.3; reps++) {
+    bench_over(dst, src, TILE, 0, 0, TILE, TILE);
+  }
+  t_over = (bench_now() - t0) / reps / (TILE * TILE);
+  t0 = bench_now();
+  for (reps = 0; bench_now() - t0 < 0.3; reps++) {
+    memcpy(dst, src, TILE * TILE * 4);
+    bench_use(dst);
+  }
+  t_src = (bench_now() - t0) / reps / (TILE * TILE);
+  printf("OVER %.2f ns/pixel, SRC %.2f ns/pixel\n\n",
+         t_over * 1e9, t_src * 1e9);
+
+  printf("%7s %16s %16s %16s %10s %10s\n", "windows", "painted w/o/with",
+         "blend Mpx w/o", "blend+copy with", "ms w/o", "ms with");
+  for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+    int n = counts[c];
+    csd_win *wins = malloc(n * sizeof(csd_win));
+    csd_result a, b;
+    double us_pass;
+
+    CHECK(wins);
+    csd_layout(wins, n);
+    a = csd_pass(wins, n, false, &occluded, &paint, &clip);
+    b = a;
+    t0 = bench_now();
+    for (reps = 0; bench_now() - t0 < 0.2; reps++) {
+      b = csd_pass(wins, n, true, &occluded, &paint, &clip);
+    }
+    us_pass = (bench_now() - t0) / reps * 1e6;
+
+    printf("%7d %8d/%-7d %16.1f %7.1f+%-8.1f %10.1f %10.1f  (pass %.0f us)\n",
+           n, a.painted, b.painted, a.blended / 1e6,
+           b.blended / 1e6, b.copied / 1e6,
+           a.blended * t_over * 1e3,
+           (b.blended * t_over + b.copied * t_src) * 1e3 + us_pass / 1e3,
+           us_pass);
+    for (int i = 0; i < n; i++) region_fini(&wins[i].opaque);
+    free(wins);
+  }
+  region_fini(&occluded);
+  region_fini(&paint);
+  region_fini(&clip);
+  free(dst);
+  free(src);
+  return 0;
+}
@@ -0,0 +1,187 @@
+#include <math.h>
+#include <string.h>
+
+#include "test.h"
+#include "comp_rect.h"
+
+// Measures the cost model of simplify_damage: what a clip rectangle costs
+// compared with a composited pixel. The software Render path of the X server
+// (fb with pixman) composites a clipped picture box by box: it intersects the
+// clip with the composite, then calls one kernel per box. So this models it
+// with the same structure: a comp_rect intersection and a per-box call of an
+// OVER kernel on a8r8g8b8. Per rect, the compositor additionally derives the
+// clip of each composite and converts it to XRectangles; that is the code of
+// paint_all and set_picture_clip, measured as is. Finally, typical fragmented
+// damage is simplified with the resulting model for several tile sizes.
+
+enum { ROOT_W = 3840, ROOT_H = 2160 };
+
+static uint32_t *dst_px, *src_px;
+
+/// Composite the screen through clip, as the server does for one request.
+static void
+composite(const CompRegion *clip) {
+  static CompRegion region;
+  CompRegion screen = { 0 };
+  CompRect all = { 0, 0, ROOT_W, ROOT_H };
+
+  region_set_rect(&screen, &all);
+  region_intersect(&region, clip, &screen);
+  for (int i = 0; i < region.n; i++) {
+    bench_over(dst_px, src_px, ROOT_W, region.rects[i].x1, region.rects[i].y1,
+               region.rects[i].x2, region.rects[i].y2);
+  }
+  region_fini(&screen);
+}
+
+typedef struct { short x, y; unsigned short width, height; } xrect;
+
+/// The compositor side of one composite: derive the clip of a window from
+/// the damage and convert it for XRenderSetPictureClipRectangles.
+static void
+client_clip(const CompRegion *damage, const CompRect *window) {
+  static CompRegion clip;
+  static xrect rects[1 << 16];
+
+  region_set_rect(&clip, window);
+  region_intersect(&clip, &clip, damage);
+  for (int i = 0; i < clip.n; i++) {
+    rects[i].x = clip.rects[i].x1;
+    rects[i].y = clip.rects[i].y1;
+    rects[i].width = clip.rects[i].x2 - clip.rects[i].x1;
+    rects[i].height = clip.rects[i].y2 - clip.rects[i].y1;
+  }
+  bench_use(rects);
+}
+
+/// n separate w x h boxes spread over the screen.
+static void
+scattered(CompRegion *r, int n, int w, int h) {
+  region_clear(r);
+  for (int i = 0; i < n; i++) {
+    int x = (i * 97 * w) % (ROOT_W - w);
+    int y = ((i * 97 * w) / (ROOT_W - w) * (h + 3) + i * 13) % (ROOT_H - h);
+    CompRect b = { x, y, x + w, y + h };
+    region_union_rect(r, &b);
+  }
+}
+
+/// Seconds per evaluation of expr, the best of 5 runs of at least 50 ms,
+/// so other load on the machine does not distort the model.
+#define TIME(expr) ({ \
+  double best_ = 1e9; \
+  for (int r_ = 0; r_ < 5; r_++) { \
+    double t0_ = bench_now(), t_; int n_ = 0; \
+    do { expr; n_++; } while ((t_ = bench_now() - t0_) < 0.05); \
+    if (t_ / n_ < best_) best_ = t_ / n_; \
+  } \
+  best_; \
+})
+
+// Damage of a terminal: text lines with glyph runs, a browser: scattered
+// small boxes and a few larger ones, two spinners in distant corners and a
+// small spinner grid, and a plot: a one pixel line graph.
+static void
+pattern(CompRegion *r, int which) {
+  region_clear(r);
+  switch (which) {
+  case 0:
+    for (int line = 0; line < 40; line++) {
+      for (int run = 0; run < 6; run++) {
+        int x = 100 + run * 230 + (line * 37) % 90;
+        CompRect b = { x, 200 + line * 18, x + 9 * (3 + (line + run) % 11),
+                       200 + line * 18 + 16 };
+        region_union_rect(r, &b);
+      }
+    }
+    break;
+  case 1:
+    scattered(r, 120, 24, 24);
+    for (int i = 0; i < 4; i++) {
+      CompRect b = { 400 + i * 700, 300, 400 + i * 700 + 320, 300 + 240 };
+      region_union_rect(r, &b);
+    }
+    break;
+  case 2: {
+    CompRect a = { 20, 20, 52, 52 };
+    CompRect b = { ROOT_W - 52, ROOT_H - 52, ROOT_W - 20, ROOT_H - 20 };
+    region_union_rect(r, &a);
+    region_union_rect(r, &b);
+    for (int i = 0; i < 40; i++) {
+      CompRect c = { 1800 + (i % 8) * 20, 1000 + (i / 8) * 20,
+                     1800 + (i % 8) * 20 + 12, 1000 + (i / 8) * 20 + 12 };
+      region_union_rect(r, &c);
+    }
+    break;
+  }
+  case 3:
+    for (int x = 0; x < 1200; x++) {
+      int y = 1000 + (int)(200 * sin(x / 40.0));
+      CompRect b = { 600 + x, y, 600 + x + 1, y + 3 };
+      region_union_rect(r, &b);
+    }
+    break;
+  }
+}
+
+int
+main(void) {
+  static const char *names[] = { "terminal", "browser", "spinners", "plot" };
+  static const int tiles[] = { 16, 32, 64, 128 };
+  CompRegion damage, work;
+  CompRect big = { 0, 0, 1024, 1024 };
+  CompRect window = { 0, 0, ROOT_W, ROOT_H };
+  double t_px, t_box, t_client, rect_cost;
+  int n_boxes = 4096;
+
+  dst_px = calloc((size_t)ROOT_W * ROOT_H, 4);
+  src_px = malloc((size_t)ROOT_W * ROOT_H * 4);
+  CHECK(dst_px && src_px);
+  for (size_t i = 0; i < (size_t)ROOT_W * ROOT_H; i++) {
+    src_px[i] = 0x80402010u + (uint32_t)i;
+  }
+  region_init(&damage);
+  region_init(&work);
+
+  region_set_rect(&damage, &big);
+  t_px = TIME(composite(&damage)) / (1024.0 * 1024.0);
+
+  scattered(&damage, n_boxes, 8, 8);
+  CHECK(damage.n >= n_boxes);
+  t_box = TIME(composite(&damage));
+  t_box = (t_box - region_area(&damage) * t_px) / damage.n;
+
+  t_client = TIME(client_clip(&damage, &window)) / damage.n;
+
+  // The server rebuilds the clip region from the rectangles as well
+  rect_cost = (t_box + 2 * t_client) / t_px;
+  printf("pixel %.3f ns, box %.1f ns, clip rect %.1f ns client side\n",
+         t_px * 1e9, t_box * 1e9, t_client * 1e9);
+  printf("one clip rect costs as much as %.0f pixels\n\n", rect_cost);
+
+  printf("%-9s %6s %5s %8s %10s %12s %12s\n", "damage", "rects", "tile",
+         "strategy", "rects", "model us", "simplify us");
+  for (int p = 0; p < 4; p++) {
+    pattern(&damage, p);
+    printf("%-9s %6d %5s %8s %10d %12.1f %12s\n", names[p], damage.n, "-",
+           "exact", damage.n,
+           (damage.n * rect_cost + region_area(&damage)) * t_px * 1e6, "-");
+    for (size_t t = 0; t < sizeof(tiles) / sizeof(tiles[0]); t++) {
+      int strategy = 0;
+      double t_simplify = TIME({
+        region_copy(&work, &damage);
+        strategy = region_simplify(&work, 0, (long long)rect_cost, tiles[t]);
+      });
+      printf("%-9s %6d %5d %8s %10d %12.1f %12.1f\n", names[p], damage.n,
+             tiles[t], strategy == REGION_SIMPLIFY_TILED ? "tiled" :
+                       strategy == REGION_SIMPLIFY_BBOX ? "bbox" : "exact",
+             work.n, (work.n * rect_cost + region_area(&work)) * t_px * 1e6,
+             t_simplify * 1e6);
+    }
+  }
+  region_fini(&damage);
+  region_fini(&work);
+  free(dst_px);
+  free(src_px);
+  return 0;
+}
@@ -0,0 +1,129 @@
+#include "test.h"
+#include "comp_rect.h"
+
+// The culling and clipping pass of paint_all on a 3840x2160 root: windows
+// are walked top to bottom, culled if the opaque ones above cover them, and
+// the rest gets its clip from the still unpainted area. Compared with a
+// single occluding rectangle, the largest window above, as used before the
+// banded region.
+
+enum { ROOT_W = 3840, ROOT_H = 2160, SHADOW = 24 };
+
+typedef struct {
+  CompRect r;
+} bwin;
+
+static CompRect
+visible_rect(const CompRect *r) {
+  CompRect screen = { 0, 0, ROOT_W, ROOT_H };
+  CompRect v = { r->x1 - SHADOW, r->y1 - SHADOW,
+                 r->x2 + SHADOW, r->y2 + SHADOW };
+  rect_intersect(&v, &v, &screen);
+  return v;
+}
+
+static int
+cull_banded(const bwin *wins, int n, CompRegion *occluded, CompRegion *paint,
+            CompRegion *clip) {
+  CompRect screen = { 0, 0, ROOT_W, ROOT_H };
+  int painted = 0;
+
+  region_clear(occluded);
+  region_set_rect(paint, &screen);
+  for (int i = 0; i < n; i++) {
+    CompRect v = visible_rect(&wins[i].r);
+    if (region_contains_rect(occluded, &v)) continue;
+    painted++;
+    region_union_rect(occluded, &wins[i].r);
+    region_set_rect(clip, &wins[i].r);
+    region_intersect(clip, clip, paint);
+    region_subtract(paint, paint, clip);
+  }
+  return painted;
+}
+
+static int
+cull_single(const bwin *wins, int n) {
+  CompRect ignore = { 0 };
+  long long ignore_area = 0;
+  int painted = 0;
+
+  for (int i = 0; i < n; i++) {
+    CompRect v = visible_rect(&wins[i].r);
+    long long area = (long long)(wins[i].r.x2 - wins[i].r.x1) *
+                     (wins[i].r.y2 - wins[i].r.y1);
+    if (v.x1 >= ignore.x1 && v.y1 >= ignore.y1 &&
+        v.x2 <= ignore.x2 && v.y2 <= ignore.y2) continue;
+    painted++;
+    if (area > ignore_area) {
+      ignore = wins[i].r;
+      ignore_area = area;
+    }
+  }
+  return painted;
+}
+
+/// k x k tiles on top, as with a tiling window manager, and the rest of the
+/// n windows below them.
+static void
+layout_tiled(bwin *wins, int n, int k) {
+  for (int i = 0; i < n; i++) {
+    if (i < k * k) {
+      int tx = i % k, ty = i / k;
+      wins[i].r = (CompRect){ tx * ROOT_W / k, ty * ROOT_H / k,
+                              (tx + 1) * ROOT_W / k, (ty + 1) * ROOT_H / k };
+    } else {
+      int x = test_rand_range(0, ROOT_W - 800);
+      int y = test_rand_range(0, ROOT_H - 600);
+      wins[i].r = (CompRect){ x, y, x + 800, y + 600 };
+    }
+  }
+}
+
+/// Overlapping windows of random size, as with a stacking window manager.
+static void
+layout_random(bwin *wins, int n) {
+  for (int i = 0; i < n; i++) {
+    int w = test_rand_range(400, 1600), h = test_rand_range(300, 1200);
+    int x = test_rand_range(-100, ROOT_W - w + 100);
+    int y = test_rand_range(-100, ROOT_H - h + 100);
+    wins[i].r = (CompRect){ x, y, x + w, y + h };
+  }
+}
+
+int
+main(void) {
+  static const int counts[] = { 16, 64, 256, 1024 };
+  CompRegion occluded, paint, clip;
+
+  region_init(&occluded);
+  region_init(&paint);
+  region_init(&clip);
+  printf("%-8s %7s %9s %9s %11s\n",
+         "layout", "windows", "painted", "1-rect", "us/pass");
+  for (int layout = 0; layout < 2; layout++) {
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+      int n = counts[c];
+      bwin *wins = malloc(n * sizeof(bwin));
+      int painted = 0, passes = 0;
+      double t0, t;
+
+      CHECK(wins);
+      if (layout == 0) layout_tiled(wins, n, 2);
+      else layout_random(wins, n);
+
+      t0 = bench_now();
+      do {
+        painted = cull_banded(wins, n, &occluded, &paint, &clip);
+        passes++;
+      } while ((t = bench_now() - t0) < 0.2);
+      printf("%-8s %7d %9d %9d %11.1f\n", layout == 0 ? "tiled" : "random",
+             n, painted, cull_single(wins, n), t / passes * 1e6);
+      free(wins);
+    }
+  }
+  region_fini(&occluded);
+  region_fini(&paint);
+  region_fini(&clip);
+  return 0;
+}
@@ -0,0 +1,73 @@
+#include "test.h"
+#include "cm-shadow.h"
+
+// Rasterizing the shadows of popups, which are smaller than the presummed
+// corner tables in at least one dimension and so sum each corner pixel from
+// the SAT, for radii 4-64 and the scalar, SSE2 and AVX2 row kernels. Also the
+// setup of kernel and tables, redone whenever the radius changes.
+
+static const struct {
+  const char *name;
+  int width, height;
+} popups[] = {
+  { "16x16 icon", 16, 16 },
+  { "80x24 tooltip", 80, 24 },
+  { "200x32 entry", 200, 32 },
+  { "180x300 menu", 180, 300 },
+  { "400x120 notify", 400, 120 },
+};
+
+static const char *simd_names[] = { "scalar", "sse2", "avx2" };
+
+/// Microseconds per shadow_raster, best of several runs
+static double
+time_raster(unsigned char *data, int width, int height) {
+  double best = 1e9;
+
+  for (int run = 0; run < 5; run++) {
+    double t0 = bench_now();
+    int reps;
+    for (reps = 0; bench_now() - t0 < 0.02; reps++) {
+      shadow_raster(data, width + gaussian_map->size, 0.75, width, height);
+      bench_use(data);
+    }
+    double t = (bench_now() - t0) / reps * 1e6;
+    if (t < best) best = t;
+  }
+  return best;
+}
+
+int
+main(void) {
+  static const int radii[] = { 4, 8, 16, 32, 64 };
+  unsigned char *data = malloc(1024 * 1024);
+
+  CHECK(data);
+  for (size_t r = 0; r < sizeof(radii) / sizeof(radii[0]); r++) {
+    double t0 = bench_now();
+    free(gaussian_map);
+    gaussian_map = make_gaussian_map(radii[r]);
+    presum_gaussian(gaussian_map);
+    printf("radius %d, kernel %d, setup %.0f us\n", radii[r],
+           gaussian_map->size, (bench_now() - t0) * 1e6);
+
+    printf("  %-16s", "us/shadow");
+    for (int l = SHADOW_SIMD_NONE; l <= SHADOW_SIMD_AVX2; l++) {
+      printf(" %9s", simd_names[l]);
+    }
+    printf("\n");
+    for (size_t p = 0; p < sizeof(popups) / sizeof(popups[0]); p++) {
+      printf("  %-16s", popups[p].name);
+      for (int l = SHADOW_SIMD_NONE; l <= SHADOW_SIMD_AVX2; l++) {
+        if (shadow_simd_select(l) != (shadow_simd) l) {
+          printf(" %9s", "-");
+          continue;
+        }
+        printf(" %9.2f", time_raster(data, popups[p].width, popups[p].height));
+      }
+      printf("\n");
+    }
+  }
+  free(data);
+  return 0;
+}
@@ -0,0 +1,299 @@
+#include <string.h>
+
+#include "test.h"
+#include "cm-shadow-cache.h"
+
+// Lookups, references, LRU order and eviction of the shadow cache, with the
+// pictures as plain numbers, whose free is recorded. Then the jobs of the
+// worker, first step by step, then with a worker thread.
+
+static Picture freed[1024];
+static int nfreed;
+
+static void
+record_free(Picture picture) {
+  CHECK(nfreed < 1024);
+  freed[nfreed++] = picture;
+}
+
+/// The LRU list holds exactly the unused entries with a picture, and bytes
+/// sums up all entries of the buckets.
+static void
+check_invariants(const ShadowCache *c) {
+  unsigned long bytes = 0;
+  int cached = 0, listed = 0;
+
+  for (int b = 0; b < SHADOW_CACHE_BUCKETS; b++) {
+    for (const ShadowEntry *e = c->buckets[b]; e; e = e->next) {
+      bytes += (unsigned long)e->swidth * e->sheight;
+      if (e->refs == 0 && e->picture) cached++;
+    }
+  }
+  CHECK(bytes == c->bytes);
+  for (const ShadowEntry *e = c->lru_first; e; e = e->lru_next) {
+    CHECK(e->refs == 0 && e->picture);
+    CHECK(e->lru_next ? e->lru_next->lru_prev == e : c->lru_last == e);
+    listed++;
+  }
+  CHECK(listed == cached);
+  CHECK(!c->lru_first == !c->lru_last);
+}
+
+/// A 4 x 4 window, whose shadow takes 100 bytes, of the given opacity
+static ShadowEntry *
+add(ShadowCache *c, int i) {
+  ShadowEntry *e = shadow_cache_add(c, i / 100.0, 1, 4, 4, 10, 10, i);
+  CHECK(e && e->refs == 1 && e->picture == (Picture) i);
+  return e;
+}
+
+static ShadowEntry *
+find(ShadowCache *c, int i) {
+  return shadow_cache_find(c, i / 100.0, 1, 4, 4);
+}
+
+static void
+test_lru(void) {
+  ShadowCache c;
+  ShadowEntry *e1, *e2, *e3, *e5;
+
+  shadow_cache_init(&c, 300, record_free);
+  nfreed = 0;
+
+  // Miss, then hit with the same key only
+  CHECK(!find(&c, 1));
+  e1 = add(&c, 1);
+  CHECK(find(&c, 1) == e1 && e1->refs == 2);
+  CHECK(!shadow_cache_find(&c, 0.01, 2, 4, 4));
+  CHECK(!shadow_cache_find(&c, 0.01, 1, 5, 4));
+  CHECK(!shadow_cache_find(&c, 0.02, 1, 4, 4));
+  shadow_cache_put(&c, e1);
+  CHECK(e1->refs == 1 && !c.lru_first);
+
+  // Unused ones are kept, most recently used first
+  shadow_cache_put(&c, e1);
+  CHECK(c.lru_first == e1);
+  e2 = add(&c, 2);
+  e3 = add(&c, 3);
+  shadow_cache_put(&c, e2);
+  shadow_cache_put(&c, e3);
+  CHECK(c.lru_first == e3 && c.lru_last == e1);
+  CHECK(c.bytes == 300 && nfreed == 0);
+  check_invariants(&c);
+
+  // Re-referencing an unused one takes it out of the list, until put again
+  CHECK(find(&c, 1) == e1 && e1->refs == 1);
+  CHECK(c.lru_first == e3 && c.lru_last == e2);
+  check_invariants(&c);
+  shadow_cache_put(&c, e1);
+  CHECK(c.lru_first == e1 && c.lru_last == e2);
+
+  // Over max_bytes, the least recently used unused ones go
+  add(&c, 4);
+  CHECK(nfreed == 1 && freed[0] == 2 && !find(&c, 2));
+  check_invariants(&c);
+
+  // Used ones are never evicted, even if the cache stays too large
+  e5 = add(&c, 5);
+  add(&c, 6);
+  CHECK(nfreed == 3 && freed[1] == 3 && freed[2] == 1);
+  CHECK(!c.lru_first && c.bytes == 300);
+  add(&c, 7);
+  CHECK(nfreed == 3 && c.bytes == 400);
+  check_invariants(&c);
+
+  // and go as soon as they are put
+  shadow_cache_put(&c, e5);
+  CHECK(nfreed == 4 && freed[3] == 5 && c.bytes == 300);
+  check_invariants(&c);
+}
+
+/// Random gets and puts, against the references held
+static void
+test_random(void) {
+  enum { KEYS = 64 };
+  ShadowCache c;
+  ShadowEntry *held[KEYS][4] = { { 0 } };
+  int nheld[KEYS] = { 0 };
+  bool alive[KEYS + 1] = { 0 };
+
+  shadow_cache_init(&c, 2000, record_free);
+  nfreed = 0;
+  for (int it = 0; it < 100000; it++) {
+    int k = test_rand_range(0, KEYS);
+    int i = k + 1;
+
+    if (nheld[k] < 4 && test_rand() % 2) {
+      ShadowEntry *e = find(&c, i);
+      CHECK(!e == !alive[i]);
+      if (!e) {
+        e = add(&c, i);
+        alive[i] = true;
+      }
+      held[k][nheld[k]++] = e;
+    } else if (nheld[k] > 0) {
+      shadow_cache_put(&c, held[k][--nheld[k]]);
+    }
+    while (nfreed > 0) {
+      Picture p = freed[--nfreed];
+      CHECK(alive[p] && nheld[p - 1] == 0);
+      alive[p] = false;
+    }
+    check_invariants(&c);
+    CHECK(c.bytes <= 2000 || !c.lru_first);
+  }
+}
+
+/// A 4 x 4 window, whose shadow is left to the worker
+static ShadowEntry *
+add_job(ShadowCache *c, int i) {
+  ShadowEntry *e = shadow_cache_add(c, i / 100.0, 1, 4, 4, 10, 10, None);
+  CHECK(e && e->refs == 1 && !e->picture);
+  return e;
+}
+
+/// What the worker thread does with a job, without blocking
+static ShadowEntry *
+run_job(ShadowCache *c, bool *first) {
+  ShadowEntry *e;
+
+  CHECK(c->queue);
+  e = shadow_cache_take_job(c);
+  CHECK(e->state == SHADOW_RUNNING);
+  if (e->data_size < 100) {
+    free(e->data);
+    e->data = malloc(100);
+    e->data_size = 100;
+  }
+  memset(e->data, 1, 100);
+  *first = shadow_cache_finish_job(c, e);
+  CHECK(e->state == SHADOW_DONE);
+  return e;
+}
+
+static void
+test_jobs(void) {
+  ShadowCache c;
+  ShadowEntry *a, *b, *e;
+  unsigned char *buf;
+  bool first;
+
+  shadow_cache_init(&c, 300, record_free);
+  nfreed = 0;
+
+  // Put while queued: cancelled and gone
+  a = add_job(&c, 1);
+  CHECK(c.queue == a && a->state == SHADOW_QUEUED && c.bytes == 100);
+  CHECK(find(&c, 1) == a && a->refs == 2);
+  shadow_cache_put(&c, a);
+  CHECK(c.queue == a);
+  shadow_cache_put(&c, a);
+  CHECK(!c.queue && !find(&c, 1) && c.bytes == 0);
+
+  // Newest first. Put while running or done: the worker still owns it, and
+  // it is cached once ready.
+  a = add_job(&c, 1);
+  b = add_job(&c, 2);
+  CHECK(run_job(&c, &first) == b && first);
+  shadow_cache_put(&c, b);
+  CHECK(b->refs == 0 && find(&c, 2) == b);
+  shadow_cache_put(&c, b);
+  CHECK(run_job(&c, &first) == a && !first);
+  CHECK(!c.queue);
+  shadow_cache_put(&c, a);
+  check_invariants(&c);
+  CHECK(!c.lru_first && c.bytes == 200);
+
+  e = shadow_cache_take_done(&c);
+  CHECK(e == a && a->job_next == b && !b->job_next);
+  CHECK(!shadow_cache_take_done(&c));
+  a->picture = 1;
+  b->picture = 2;
+  shadow_cache_ready(&c, a);
+  buf = c.buf;
+  CHECK(buf && c.buf_size == 100 && !a->data && a->state == SHADOW_READY);
+  shadow_cache_ready(&c, b);
+  CHECK(!b->data && c.buf_size == 100);
+  CHECK(c.lru_first == b && c.lru_last == a && nfreed == 0);
+  check_invariants(&c);
+
+  // The next job gets the raster memory back
+  a = add_job(&c, 3);
+  CHECK(run_job(&c, &first) == a && first && a->data == buf && !c.buf);
+
+  // Failed uploads are dropped from the cache, used ones once put
+  CHECK(shadow_cache_take_done(&c) == a);
+  shadow_cache_ready(&c, a);
+  CHECK(!find(&c, 3) && c.bytes == 200 && a->refs == 1);
+  check_invariants(&c);
+  shadow_cache_put(&c, a);
+  CHECK(c.bytes == 200 && nfreed == 0);
+  b = add_job(&c, 4);
+  CHECK(run_job(&c, &first) == b && first);
+  shadow_cache_put(&c, b);
+  CHECK(shadow_cache_take_done(&c) == b);
+  shadow_cache_ready(&c, b);
+  CHECK(!find(&c, 4) && c.bytes == 200);
+  check_invariants(&c);
+}
+
+static void *
+worker(void *arg) {
+  ShadowCache *c = arg;
+
+  for (;;) {
+    ShadowEntry *e = shadow_cache_take_job(c);
+    if (e->data_size < 100) {
+      free(e->data);
+      e->data = malloc(100);
+      e->data_size = e->data ? 100 : 0;
+    }
+    if (e->data) memset(e->data, e->width, 100);
+    shadow_cache_finish_job(c, e);
+  }
+  return NULL;
+}
+
+/// Random gets and puts of shadows rasterized by a worker thread
+static void
+test_worker(void) {
+  enum { KEYS = 16 };
+  static ShadowCache c;
+  ShadowEntry *held[KEYS] = { 0 };
+  pthread_t thread;
+
+  shadow_cache_init(&c, 500, record_free);
+  nfreed = 0;
+  CHECK(pthread_create(&thread, NULL, worker, &c) == 0);
+  pthread_detach(thread);
+  for (int it = 0; it < 20000; it++) {
+    int k = test_rand_range(0, KEYS);
+    ShadowEntry *e, *next;
+
+    if (!held[k]) {
+      held[k] = find(&c, k + 1);
+      if (!held[k]) held[k] = add_job(&c, k + 1);
+    } else {
+      shadow_cache_put(&c, held[k]);
+      held[k] = NULL;
+    }
+
+    for (e = shadow_cache_take_done(&c); e; e = next) {
+      next = e->job_next;
+      CHECK(e->state == SHADOW_DONE && e->data && e->data[99] == 4);
+      e->picture = (Picture)(long)(e->opacity * 100 + 0.5);
+      shadow_cache_ready(&c, e);
+    }
+    while (nfreed > 0) CHECK(!held[freed[--nfreed] - 1]);
+    check_invariants(&c);
+  }
+}
+
+int
+main(void) {
+  test_lru();
+  test_random();
+  test_jobs();
+  test_worker();
+  return 0;
+}
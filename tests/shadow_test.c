@@ -0,0 +1,238 @@
+#include <math.h>
+#include <string.h>
+
+#include "test.h"
+#include "cm-shadow.h"
+
+// The SIMD kernels against the scalar ones, shadow_raster against the
+// gaussian summed directly, in doubles, over the window, and the nine parts
+// painted from the shared patches against shadow_raster.
+
+/// Kernel weight of the shadow pixels p of a window of length n, summed
+/// directly over the window. The kernel is separable, so the alpha of pixel
+/// x, y is opacity * 255 * sums_x[x] * sums_y[y]. It is one pixel off
+/// center, so shadow_raster mirrors the top left quarter and so does this.
+static void
+reference_sums(double *sums, const double *g, int size, int n) {
+  for (int p = 0; p < n + size; p++) {
+    int q = p > n + size - 1 - p ? n + size - 1 - p : p;
+    sums[p] = 0;
+    for (int f = 0; f < size; f++) {
+      if (q + f - size >= 0 && q + f - size < n) sums[p] += g[f];
+    }
+  }
+}
+
+static void
+setup_radius(double r, double *g) {
+  int center;
+  double t = 0;
+
+  free(gaussian_map);
+  gaussian_map = make_gaussian_map(r);
+  presum_gaussian(gaussian_map);
+
+  // The normalized 1D kernel, as make_gaussian_map derives it
+  center = gaussian_map->size / 2;
+  for (int x = 0; x < gaussian_map->size; x++) {
+    g[x] = exp(-(double) (x - center) * (x - center) / (2 * r * r));
+    t += g[x];
+  }
+  for (int x = 0; x < gaussian_map->size; x++) g[x] /= t;
+}
+
+static void
+test_reverse(void) {
+  unsigned char src[300], dst[600], ref[600];
+
+  for (int it = 0; it < 2000; it++) {
+    int n = test_rand_range(0, 300);
+    for (int i = 0; i < n; i++) src[i] = test_rand();
+    memset(dst, 0, sizeof(dst));
+    reverse_bytes(dst, src, n);
+    for (int i = 0; i < n; i++) CHECK(dst[i] == src[n - 1 - i]);
+    CHECK(dst[n] == 0);
+
+    // In place, starting at the middle byte of an odd sized row
+    if (n == 0) continue;
+    for (int i = 0; i < 2 * n - 1; i++) ref[i] = dst[i] = test_rand();
+    reverse_bytes(dst + n - 1, dst, n);
+    for (int i = 0; i < n; i++) CHECK(dst[n - 1 + i] == ref[n - 1 - i]);
+    for (int i = 0; i < n - 1; i++) CHECK(dst[i] == ref[i]);
+  }
+}
+
+/// What the X server composites from the patches, each part reading its
+/// repeating patch from the mask offset on. With a window offset by dx, dy
+/// from its shadow, paint_all clips that window out of SHADOW_NOCENTER
+/// shadows, which is left 0 here.
+static void
+assemble_parts(unsigned char *out, size_t stride, int level,
+               int width, int height, bool nocenter, int dx, int dy) {
+  unsigned char *patches[SHADOW_PATCHES];
+  int pw[SHADOW_PATCHES], ph[SHADOW_PATCHES], pstride[SHADOW_PATCHES];
+  int swidth = width + Gsize, sheight = height + Gsize;
+  shadow_part parts[9];
+  int n;
+
+  for (int k = 0; k < SHADOW_PATCHES; k++) {
+    shadow_patch_size(k, &pw[k], &ph[k]);
+    // padded, as in the MIT-SHM segment
+    pstride[k] = (pw[k] + 3) & ~3;
+    patches[k] = malloc((size_t) pstride[k] * ph[k]);
+    CHECK(patches[k]);
+    memset(patches[k], 0xaa, (size_t) pstride[k] * ph[k]);
+    shadow_patch_raster(patches[k], pstride[k], level, k);
+  }
+
+  memset(out, 0xaa, stride * sheight);
+  n = shadow_parts(parts, swidth, sheight);
+  CHECK(n <= 9);
+  for (int i = 0; i < n; i++) {
+    const shadow_part *p = &parts[i];
+    int k = p->kind;
+    CHECK(p->x >= 0 && p->y >= 0);
+    CHECK(p->x + p->width <= swidth && p->y + p->height <= sheight);
+    if (k == SHADOW_PATCH_CORNERS) {
+      // does not repeat
+      CHECK(p->mask_x + p->width <= pw[k] && p->mask_y + p->height <= ph[k]);
+    }
+    for (int y = 0; y < p->height; y++) {
+      for (int x = 0; x < p->width; x++) {
+        unsigned char *d = &out[(p->y + y) * stride + p->x + x];
+        // every pixel is painted exactly once
+        CHECK(*d == 0xaa);
+        *d = patches[k][(p->mask_y + y) % ph[k] * pstride[k]
+                        + (p->mask_x + x) % pw[k]];
+      }
+    }
+  }
+
+  for (int y = 0; y < sheight; y++) {
+    for (int x = 0; x < swidth; x++) {
+      if (nocenter && x + dx >= 0 && x + dx < width &&
+          y + dy >= 0 && y + dy < height) {
+        out[y * stride + x] = 0;
+      }
+    }
+  }
+  for (int k = 0; k < SHADOW_PATCHES; k++) free(patches[k]);
+}
+
+static void
+test_patches(void) {
+  int g = gaussian_map->size;
+
+  CHECK(shadow_patch_level(1.0, g - 1, g) < 0);
+  CHECK(shadow_patch_level(1.0, g, g - 1) < 0);
+  for (int it = 0; it < 30; it++) {
+    int width = test_rand_range(g, 3 * g + 2);
+    int height = test_rand_range(g, 3 * g + 2);
+    int level = test_rand_range(0, SHADOW_LEVELS);
+    double opacity = level / 25.0;
+    bool nocenter = it & 1;
+    int dx = test_rand_range(-g, g + 1), dy = test_rand_range(-g, g + 1);
+    int swidth = width + g, sheight = height + g;
+    int stride = (swidth + 3) & ~3;
+    unsigned char *ref = malloc((size_t) stride * sheight);
+    unsigned char *out = malloc((size_t) stride * sheight);
+
+    CHECK(ref && out);
+    CHECK(shadow_patch_level(opacity, width, height) == level);
+    memset(ref, 0xaa, (size_t) stride * sheight);
+    shadow_raster(ref, stride, opacity, width, height);
+    if (nocenter) shadow_clear_center(ref, stride, width, height, dx, dy);
+    assemble_parts(out, stride, level, width, height, nocenter, dx, dy);
+    CHECK(memcmp(out, ref, (size_t) stride * sheight) == 0);
+    free(ref);
+    free(out);
+  }
+}
+
+int
+main(void) {
+  static const shadow_simd levels[] = {
+    SHADOW_SIMD_NONE, SHADOW_SIMD_SSE2, SHADOW_SIMD_AVX2,
+  };
+  static const double radii[] = { 1, 2.5, 4, 7, 12, 20, 33, 64 };
+  enum { NLEVELS = sizeof(levels) / sizeof(levels[0]) };
+  double g[256], sums_x[1024], sums_y[1024];
+
+  for (int l = 0; l < NLEVELS; l++) {
+    if (shadow_simd_select(levels[l]) != levels[l]) continue;
+    test_reverse();
+  }
+
+  for (size_t r = 0; r < sizeof(radii) / sizeof(radii[0]); r++) {
+    int size, stride;
+
+    setup_radius(radii[r], g);
+    size = gaussian_map->size;
+    stride = size + 1;
+
+    // Row kernels, random rows and widths, bit exact against scalar
+    for (int it = 0; it < 500; it++) {
+      unsigned char ref[257], out[257];
+      int top = test_rand_range(0, size + 1);
+      int bottom = test_rand_range(top, size + 1);
+      int width = test_rand_range(1, 2 * size + 2);
+      double opacity = test_rand_range(0, 1001) / 1000.0;
+      const uint32_t *t = &gaussian_map->sat[top * stride];
+      const uint32_t *b = &gaussian_map->sat[bottom * stride];
+
+      shadow_simd_select(SHADOW_SIMD_NONE);
+      shadow_sat_row(ref, t, b, size, width, opacity);
+      for (int l = 1; l < NLEVELS; l++) {
+        if (shadow_simd_select(levels[l]) != levels[l]) continue;
+        memset(out, 0xaa, sizeof(out));
+        shadow_sat_row(out, t, b, size, width, opacity);
+        CHECK(memcmp(out, ref, size + 1) == 0);
+        CHECK(out[size + 1] == 0xaa);
+      }
+    }
+
+    // Whole shadows: small popups take the SAT path, large windows the
+    // presummed tables, which quantize opacity to 1/25.
+    for (int it = 0; it < 40; it++) {
+      int width = it < 30 ? test_rand_range(1, 2 * size + 3)
+                          : test_rand_range(size, 3 * size + 1);
+      int height = it < 30 ? test_rand_range(1, 2 * size + 3)
+                           : test_rand_range(size, 3 * size + 1);
+      double opacity = test_rand_range(1, 26) / 25.0;
+      int swidth = width + size, sheight = height + size;
+      // padded rows, as for the X server
+      int stride = (swidth + 3) & ~3;
+      unsigned char *ref = malloc((size_t) stride * sheight);
+      unsigned char *out = malloc((size_t) stride * sheight);
+
+      CHECK(ref && out);
+      shadow_simd_select(SHADOW_SIMD_NONE);
+      memset(ref, 0xaa, (size_t) stride * sheight);
+      shadow_raster(ref, stride, opacity, width, height);
+      reference_sums(sums_x, g, size, width);
+      reference_sums(sums_y, g, size, height);
+      for (int y = 0; y < sheight; y++) {
+        for (int x = 0; x < swidth; x++) {
+          double a = sums_x[x] * sums_y[y] * opacity * 255;
+          // rounding of the table, the fixed point scale and the presummed
+          // opacity steps, each truncating by at most one
+          CHECK(fabs(ref[y * stride + x] - a) <= 2.0);
+        }
+        for (int x = swidth; x < stride; x++) {
+          CHECK(ref[y * stride + x] == 0xaa);
+        }
+      }
+      for (int l = 1; l < NLEVELS; l++) {
+        if (shadow_simd_select(levels[l]) != levels[l]) continue;
+        memset(out, 0xaa, (size_t) stride * sheight);
+        shadow_raster(out, stride, opacity, width, height);
+        CHECK(memcmp(out, ref, (size_t) stride * sheight) == 0);
+      }
+      free(ref);
+      free(out);
+    }
+
+    test_patches();
+  }
+  return 0;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+// Shared by the tests and benchmarks in this directory. They only link the
+// modules without X dependencies, so make check and make bench run without
+// a display.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define CHECK(cond) do { \
+  if (!(cond)) { \
+    fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+    exit(1); \
+  } \
+} while (0)
+
+/// Deterministic xorshift generator, so failures can be reproduced.
+static inline uint32_t
+test_rand(void) {
+  static uint32_t s = 2463534242u;
+  s ^= s << 13;
+  s ^= s >> 17;
+  s ^= s << 5;
+  return s;
+}
+
+/// Uniform in [lo, hi).
+static inline int
+test_rand_range(int lo, int hi) {
+  return lo + (int)(test_rand() % (uint32_t)(hi - lo));
+}
+
+/// Monotonic time in seconds.
+static inline double
+bench_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/// Keep the compiler from optimizing a benchmarked result away.
+static inline void
+bench_use(const void *p) {
+  __asm__ volatile("" : : "g"(p) : "memory");
+}
+
+/// Composite the box [x1, x2) x [y1, y2) of src OVER dst, both a8r8g8b8 with
+/// premultiplied alpha, like the fast path of pixman. Not inlined, so every
+/// call pays the per-box overhead of the server.
+__attribute__((noinline, unused)) static void
+bench_over(uint32_t *dst, const uint32_t *src, int stride,
+           int x1, int y1, int x2, int y2) {
+  for (int y = y1; y < y2; y++) {
+    uint32_t *restrict d = dst + (size_t)y * stride;
+    const uint32_t *restrict s = src + (size_t)y * stride;
+    for (int x = x1; x < x2; x++) {
+      uint32_t sp = s[x], dp = d[x];
+      uint32_t ia = 255 - (sp >> 24);
+      uint32_t rb = (dp & 0xff00ff) * ia + 0x800080;
+      uint32_t ag = ((dp >> 8) & 0xff00ff) * ia + 0x800080;
+      rb = ((rb + ((rb >> 8) & 0xff00ff)) >> 8) & 0xff00ff;
+      ag = (ag + ((ag >> 8) & 0xff00ff)) & 0xff00ff00;
+      d[x] = sp + (rb | ag);
+    }
+  }
+}
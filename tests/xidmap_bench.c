@@ -0,0 +1,66 @@
+#include "test.h"
+#include "cm-xidmap.h"
+
+// Lookup cost of find_win by window count: the XidMap index versus the walk
+// of the stacking list it replaced.
+
+typedef struct _node {
+  struct _node *next;
+  XID id;
+  char payload[480]; // about the size of a win, so the walk misses the cache
+} node;
+
+static node *
+list_find(node *list, XID id) {
+  for (node *n = list; n; n = n->next) {
+    if (n->id == id) return n;
+  }
+  return NULL;
+}
+
+int
+main(void) {
+  static const int counts[] = { 16, 64, 256, 1024, 4096 };
+  enum { LOOKUPS = 1 << 20 };
+
+  printf("%8s %12s %12s\n", "windows", "list ns", "xidmap ns");
+  for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+    int n = counts[c];
+    node *nodes = calloc(n, sizeof(node));
+    node *list = NULL;
+    XID *keys = malloc(LOOKUPS * sizeof(XID));
+    XidMap m;
+    double t0, t_list, t_map;
+    int list_lookups = LOOKUPS / (n / 16);
+
+    CHECK(nodes && keys && xidmap_init(&m, 64));
+    for (int i = 0; i < n; i++) {
+      nodes[i].id = 0x1a00000 + i * 7;
+      nodes[i].next = list;
+      list = &nodes[i];
+      CHECK(xidmap_put(&m, nodes[i].id, &nodes[i]));
+    }
+    for (int i = 0; i < LOOKUPS; i++) {
+      keys[i] = nodes[test_rand_range(0, n)].id;
+    }
+
+    t0 = bench_now();
+    for (int i = 0; i < list_lookups; i++) {
+      bench_use(list_find(list, keys[i]));
+    }
+    t_list = (bench_now() - t0) / list_lookups;
+
+    t0 = bench_now();
+    for (int i = 0; i < LOOKUPS; i++) {
+      bench_use(xidmap_get(&m, keys[i]));
+    }
+    t_map = (bench_now() - t0) / LOOKUPS;
+
+    printf("%8d %12.1f %12.1f\n", n, t_list * 1e9, t_map * 1e9);
+    free(nodes);
+    free(keys);
+    free(m.keys);
+    free(m.vals);
+  }
+  return 0;
+}
@@ -0,0 +1,42 @@
+#include "test.h"
+#include "cm-xidmap.h"
+
+// Random puts, removes and gets against a plain array of the expected values.
+int
+main(void) {
+  enum { N = 20000 };
+  static long ref[N];
+  XidMap m;
+  unsigned long count = 0;
+
+  CHECK(xidmap_init(&m, 4));
+  for (int it = 0; it < 400000; it++) {
+    int k = test_rand_range(0, N);
+    // Adjacent XIDs of one client, as the server hands them out
+    XID key = 0x1a00000 + k * 3;
+
+    switch (test_rand() % 3) {
+    case 0:
+      CHECK(xidmap_put(&m, key, (void *)(long)(k + 1)));
+      ref[k] = k + 1;
+      break;
+    case 1:
+      CHECK((long)xidmap_remove(&m, key) == ref[k]);
+      ref[k] = 0;
+      break;
+    default:
+      CHECK((long)xidmap_get(&m, key) == ref[k]);
+    }
+  }
+  for (int k = 0; k < N; k++) {
+    if (ref[k]) count++;
+  }
+  CHECK(count == m.count);
+
+  // None marks free slots, so it is never a key
+  CHECK(!xidmap_put(&m, None, &m));
+  CHECK(xidmap_get(&m, None) == NULL);
+  CHECK(xidmap_remove(&m, None) == NULL);
+  CHECK(count == m.count);
+  return 0;
+}